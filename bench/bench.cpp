@@ -0,0 +1,514 @@
+//
+// bench.cpp
+//
+// Google Benchmark suite comparing the library with std::map, std::set and
+// (if RB_BENCH_ABSL is defined) absl::btree_set as a B-tree baseline.
+//
+// Every benchmark reports the time per operation (time/op) and the number of
+// comparisons per operation (cmp/op). On Linux, it also reports how much the
+// peak resident set size grew during the benchmark (peak_rss_MB), and finds
+// report the data TLB misses per operation (dtlb_miss/op) when the kernel
+// lets the process count them.
+//
+
+#include <benchmark/benchmark.h>
+#include "rbtree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+#ifdef RB_BENCH_ABSL
+#include "absl/container/btree_set.h"
+#endif
+
+#ifdef __linux__
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+// Largest tree size: 100M elements require several GB of memory
+#ifndef RB_BENCH_MAX
+#define RB_BENCH_MAX (1 << 20)
+#endif
+
+namespace {
+	unsigned long long ncomp;
+
+	int compare(const void* a, const void* b) {
+		ncomp += 1;
+		intptr_t x = (intptr_t)a, y = (intptr_t)b;
+		return (x > y) - (x < y);
+	}
+
+	struct Less {
+		bool operator()(intptr_t a, intptr_t b) const {
+			ncomp += 1;
+			return a < b;
+		}
+	};
+
+#ifdef __linux__
+	// Reads a field in kB of /proc/self/status, or returns -1
+	double status_kb(const char* field) {
+		FILE* f = fopen("/proc/self/status", "r");
+		if (f == nullptr) return -1;
+		char line[256];
+		double kb = -1;
+		size_t len = strlen(field);
+		while (fgets(line, sizeof(line), f)) {
+			if (strncmp(line, field, len) == 0 && line[len] == ':') {
+				kb = atof(line + len + 1);
+				break;
+			}
+		}
+		fclose(f);
+		return kb;
+	}
+#endif
+
+	// Measures how much the peak resident set size of the process grows
+	// from its construction. The process high-water mark never goes down,
+	// so it is reset first (Linux only, mb returns -1 otherwise), and the
+	// memory freed by the previous benchmarks is given back to the system
+	// so that reusing it still counts.
+	class PeakRss {
+		double start = -1;
+	public:
+		PeakRss() {
+#ifdef __linux__
+#ifdef __GLIBC__
+			malloc_trim(0);
+#endif
+			FILE* f = fopen("/proc/self/clear_refs", "w");
+			if (f == nullptr) return;
+			// 5 resets the peak RSS
+			bool reset = fputs("5", f) >= 0;
+			if (fclose(f) == 0 && reset) start = status_kb("VmRSS");
+#endif
+		}
+		double mb() const {
+#ifdef __linux__
+			if (start >= 0) {
+				double peak = status_kb("VmHWM");
+				if (peak >= start) return (peak - start) / 1024;
+			}
+#endif
+			return -1;
+		}
+	};
+
+	// Counts the data TLB load misses of the process in user mode, if the
+	// system allows it (count returns -1 otherwise)
+	class TlbMisses {
+		int fd = -1;
+	public:
+		TlbMisses() {
+#ifdef __linux__
+			perf_event_attr attr{};
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_DTLB
+				| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+				| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+		}
+		~TlbMisses() {
+#ifdef __linux__
+			if (fd >= 0) close(fd);
+#endif
+		}
+		double count() const {
+			long long n = 0;
+#ifdef __linux__
+			if (fd >= 0 && read(fd, &n, sizeof(n)) == sizeof(n)) return (double)n;
+#endif
+			return -1;
+		}
+	};
+
+	enum Workload { RANDOM, SEQUENTIAL, ZIPF };
+
+	// Zipf distribution (theta = 0.99) over [0, n), as described by Gray et
+	// al. in "Quickly generating billion-record synthetic databases".
+	class Zipf {
+		double theta, alpha, zetan, eta;
+		size_t n;
+	public:
+		explicit Zipf(size_t n) : theta(0.99), n(n) {
+			zetan = 0;
+			for (size_t i = 1; i <= n; i++) zetan += 1 / std::pow((double)i, theta);
+			double zeta2 = 1 + 1 / std::pow(2.0, theta);
+			alpha = 1 / (1 - theta);
+			eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+		}
+
+		size_t operator()(std::mt19937_64& rg) {
+			double u = std::uniform_real_distribution<double>(0, 1)(rg);
+			double uz = u * zetan;
+			if (uz < 1) return 0;
+			if (uz < 1 + std::pow(0.5, theta)) return 1;
+			size_t r = (size_t)(n * std::pow(eta * u - eta + 1, alpha));
+			return r < n ? r : n - 1;
+		}
+	};
+
+	// The n distinct keys of a tree in insertion order
+	std::vector<intptr_t> keys(size_t n, int workload) {
+		std::vector<intptr_t> k(n);
+		for (size_t i = 0; i < n; i++) k[i] = (intptr_t)i + 1;
+		if (SEQUENTIAL != workload) {
+			std::shuffle(k.begin(), k.end(), std::mt19937_64(n));
+		}
+		return k;
+	}
+
+	// Keys used to probe a tree built from keys(n, workload): sequential
+	// probes follow the key order, zipfian ones hit a few keys most of time
+	std::vector<intptr_t> probes(size_t n, int workload, size_t count) {
+		std::vector<intptr_t> p(count);
+		std::mt19937_64 rg(n + 1);
+		if (ZIPF == workload) {
+			std::vector<intptr_t> k = keys(n, RANDOM);
+			Zipf zipf(n);
+			for (size_t i = 0; i < count; i++) p[i] = k[zipf(rg)];
+		}
+		else if (SEQUENTIAL == workload) {
+			for (size_t i = 0; i < count; i++) p[i] = (intptr_t)(i % n) + 1;
+		}
+		else {
+			for (size_t i = 0; i < count; i++) p[i] = (intptr_t)(rg() % n) + 1;
+		}
+		return p;
+	}
+
+	struct RB {
+		RBTree tree;
+		RB() { RBinit(&tree, compare); }
+		RB(const RB& other) {
+			RBTree* copy = RBclone(const_cast<RBTree*>(&other.tree), nullptr);
+			tree = *copy;
+			free(copy);
+		}
+		~RB() { RBdestroy(&tree, nullptr); }
+		void insert(intptr_t k) { RBinsert(&tree, (void*)k, nullptr); }
+		bool find(intptr_t k) { return RBfind(&tree, (void*)k) != nullptr; }
+		void remove(intptr_t k) { RBremove(&tree, (void*)k); }
+		intptr_t scan(intptr_t k, int len) {
+			intptr_t sum = 0;
+			RBIter* iter = RBsearch(&tree, (void*)k);
+			if (iter == nullptr) return 0;
+			for (int i = 0; i < len; i++) {
+				void* data = RBnext(iter);
+				if (data == nullptr) break;
+				sum += (intptr_t)data;
+			}
+			RBiter_release(iter);
+			return sum;
+		}
+		void clear() { RBdestroy(&tree, nullptr); }
+	};
+
+	// Same as RB with the nodes cut from an arena of normal pages
+	struct RBArena : RB {
+		RBArena() { RBpool(&tree, 0, 0); }
+	};
+
+	// Same as RB with the nodes cut from an arena of huge pages, which
+	// should show fewer TLB misses on large random finds
+	struct RBHuge : RB {
+		RBHuge() { RBpool(&tree, RB_POOL_HUGE, 0); }
+	};
+
+	// Same as RB balanced as an AVL tree
+	struct RBAvl : RB {
+		RBAvl() { RBbalance(&tree, RB_BALANCE_AVL); }
+	};
+
+	// Same as RB balanced as a WAVL tree
+	struct RBWavl : RB {
+		RBWavl() { RBbalance(&tree, RB_BALANCE_WAVL); }
+	};
+
+	// Same as RB but scans with RBforeach_range instead of an iterator
+	struct RBVisit : RB {
+		struct Ctx {
+			intptr_t sum;
+			int left;
+		};
+
+		static int visit(void* data, void* ctx) {
+			Ctx* c = (Ctx*)ctx;
+			c->sum += (intptr_t)data;
+			return --c->left == 0;
+		}
+
+		intptr_t scan(intptr_t k, int len) {
+			Ctx ctx{ 0, len };
+			RBforeach_range(&tree, (void*)k, nullptr, visit, &ctx);
+			return ctx.sum;
+		}
+	};
+
+	template <class C>
+	struct Std {
+		C c;
+		void insert(intptr_t k) { c.emplace(k, k); }
+		bool find(intptr_t k) { return c.find(k) != c.end(); }
+		void remove(intptr_t k) { c.erase(k); }
+		intptr_t scan(intptr_t k, int len) {
+			intptr_t sum = 0;
+			auto it = c.lower_bound(k);
+			for (int i = 0; i < len && it != c.end(); i++, ++it) sum += it->first;
+			return sum;
+		}
+		void clear() { c.clear(); }
+	};
+
+	template <class C>
+	struct StdSet {
+		C c;
+		void insert(intptr_t k) { c.insert(k); }
+		bool find(intptr_t k) { return c.find(k) != c.end(); }
+		void remove(intptr_t k) { c.erase(k); }
+		intptr_t scan(intptr_t k, int len) {
+			intptr_t sum = 0;
+			auto it = c.lower_bound(k);
+			for (int i = 0; i < len && it != c.end(); i++, ++it) sum += *it;
+			return sum;
+		}
+		void clear() { c.clear(); }
+	};
+
+	using Map = Std<std::map<intptr_t, intptr_t, Less>>;
+	using Set = StdSet<std::set<intptr_t, Less>>;
+#ifdef RB_BENCH_ABSL
+	using BTree = StdSet<absl::btree_set<intptr_t, Less>>;
+#endif
+
+	constexpr size_t NPROBES = 1 << 20;
+	constexpr int SCAN_LENGTH = 100;
+
+	template <class T>
+	void build(T& t, const std::vector<intptr_t>& k) {
+		for (intptr_t key : k) t.insert(key);
+	}
+
+	void report(benchmark::State& state, unsigned long long ops,
+			const PeakRss& rss) {
+		state.SetItemsProcessed(ops);
+		state.counters["time/op"] = benchmark::Counter((double)ops,
+			benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+		state.counters["cmp/op"] = ops ? (double)ncomp / ops : 0;
+		double mb = rss.mb();
+		if (mb >= 0) state.counters["peak_rss_MB"] = mb;
+	}
+
+	template <class T, int W>
+	void BM_Insert(benchmark::State& state) {
+		PeakRss rss;
+		size_t n = state.range(0);
+		std::vector<intptr_t> k = (ZIPF == W) ? probes(n, W, n) : keys(n, W);
+		unsigned long long ops = 0;
+		ncomp = 0;
+		for (auto _ : state) {
+			T* t = new T;
+			build(*t, k);
+			ops += n;
+			state.PauseTiming();
+			delete t;
+			state.ResumeTiming();
+		}
+		report(state, ops, rss);
+	}
+
+	template <class T, int W>
+	void BM_Find(benchmark::State& state) {
+		PeakRss rss;
+		size_t n = state.range(0);
+		T t;
+		build(t, keys(n, W));
+		std::vector<intptr_t> p = probes(n, W, NPROBES);
+		size_t i = 0;
+		unsigned long long ops = 0;
+		ncomp = 0;
+		TlbMisses tlb;
+		double misses = tlb.count();
+		for (auto _ : state) {
+			benchmark::DoNotOptimize(t.find(p[i]));
+			i = (i + 1) % NPROBES;
+			ops += 1;
+		}
+		report(state, ops, rss);
+		if (misses >= 0 && ops) {
+			state.counters["dtlb_miss/op"] = (tlb.count() - misses) / ops;
+		}
+	}
+
+	template <class T, int W>
+	void BM_Scan(benchmark::State& state) {
+		PeakRss rss;
+		size_t n = state.range(0);
+		T t;
+		build(t, keys(n, W));
+		std::vector<intptr_t> p = probes(n, W, NPROBES);
+		size_t i = 0;
+		unsigned long long ops = 0;
+		ncomp = 0;
+		for (auto _ : state) {
+			benchmark::DoNotOptimize(t.scan(p[i], SCAN_LENGTH));
+			i = (i + 1) % NPROBES;
+			ops += 1;
+		}
+		report(state, ops, rss);
+	}
+
+	template <class T, int W>
+	void BM_Remove(benchmark::State& state) {
+		PeakRss rss;
+		size_t n = state.range(0);
+		std::vector<intptr_t> k = keys(n, W);
+		std::vector<intptr_t> r = (ZIPF == W) ? probes(n, W, n) : keys(n, W);
+		unsigned long long ops = 0;
+		unsigned long long comps = 0;
+		for (auto _ : state) {
+			state.PauseTiming();
+			T* t = new T;
+			build(*t, k);
+			ncomp = 0;
+			state.ResumeTiming();
+			for (intptr_t key : r) t->remove(key);
+			ops += n;
+			state.PauseTiming();
+			comps += ncomp;
+			delete t;
+			state.ResumeTiming();
+		}
+		ncomp = comps;
+		report(state, ops, rss);
+	}
+
+	// Mixed reads and writes: every 10 operations, 9 finds then the removal
+	// and the insertion back of a key (the key stays in the tree)
+	template <class T, int W>
+	void BM_Mixed(benchmark::State& state) {
+		PeakRss rss;
+		size_t n = state.range(0);
+		T t;
+		build(t, keys(n, W));
+		std::vector<intptr_t> p = probes(n, W, NPROBES);
+		size_t i = 0;
+		unsigned long long ops = 0;
+		ncomp = 0;
+		for (auto _ : state) {
+			if (i % 10 == 9) {
+				t.remove(p[i]);
+				t.insert(p[i]);
+			}
+			else benchmark::DoNotOptimize(t.find(p[i]));
+			i = (i + 1) % NPROBES;
+			ops += 1;
+		}
+		report(state, ops, rss);
+	}
+
+	template <class T, int W>
+	void BM_Clone(benchmark::State& state) {
+		PeakRss rss;
+		size_t n = state.range(0);
+		T t;
+		build(t, keys(n, W));
+		unsigned long long ops = 0;
+		ncomp = 0;
+		for (auto _ : state) {
+			T* copy = new T(t);
+			ops += n;
+			state.PauseTiming();
+			delete copy;
+			state.ResumeTiming();
+		}
+		report(state, ops, rss);
+	}
+
+	template <class T, int W>
+	void BM_Destroy(benchmark::State& state) {
+		PeakRss rss;
+		size_t n = state.range(0);
+		T t;
+		build(t, keys(n, W));
+		unsigned long long ops = 0;
+		ncomp = 0;
+		for (auto _ : state) {
+			state.PauseTiming();
+			T* copy = new T(t);
+			state.ResumeTiming();
+			copy->clear();
+			ops += n;
+			state.PauseTiming();
+			delete copy;
+			state.ResumeTiming();
+		}
+		report(state, ops, rss);
+	}
+
+	void sizes(benchmark::internal::Benchmark* b) {
+		for (long long n = 1000; n <= RB_BENCH_MAX; n *= 10) b->Arg(n);
+		b->Unit(benchmark::kNanosecond);
+	}
+}
+
+#define RB_BENCH_OP(op, T) \
+	BENCHMARK_TEMPLATE(op, T, RANDOM)->Apply(sizes); \
+	BENCHMARK_TEMPLATE(op, T, SEQUENTIAL)->Apply(sizes); \
+	BENCHMARK_TEMPLATE(op, T, ZIPF)->Apply(sizes)
+
+#ifdef RB_BENCH_ABSL
+#define RB_BENCH_BTREE(op) RB_BENCH_OP(op, BTree)
+#else
+#define RB_BENCH_BTREE(op)
+#endif
+
+#define RB_BENCH(op) \
+	RB_BENCH_OP(op, RB); \
+	RB_BENCH_OP(op, Map); \
+	RB_BENCH_OP(op, Set); \
+	RB_BENCH_BTREE(op)
+
+RB_BENCH(BM_Insert);
+RB_BENCH_OP(BM_Insert, RBArena);
+RB_BENCH(BM_Find);
+RB_BENCH_OP(BM_Find, RBArena);
+RB_BENCH_OP(BM_Find, RBHuge);
+RB_BENCH(BM_Scan);
+RB_BENCH_OP(BM_Scan, RBVisit);
+RB_BENCH(BM_Remove);
+RB_BENCH(BM_Mixed);
+
+// Balancing policies
+#define RB_BENCH_POLICIES(op) \
+	RB_BENCH_OP(op, RBAvl); \
+	RB_BENCH_OP(op, RBWavl)
+
+RB_BENCH_POLICIES(BM_Insert);
+RB_BENCH_POLICIES(BM_Find);
+RB_BENCH_POLICIES(BM_Remove);
+RB_BENCH_POLICIES(BM_Mixed);
+RB_BENCH(BM_Clone);
+RB_BENCH(BM_Destroy);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,73 @@
+"""Compares crbtree with sortedcontainers: python bench.py [size]"""
+
+import random
+import sys
+import timeit
+
+import crbtree
+
+try:
+	import sortedcontainers
+except ImportError:
+	sys.exit("sortedcontainers is needed for the comparison")
+
+
+def run(name, make, n):
+	rg = random.Random(0)
+	ints = rg.sample(range(10 * n), n)
+	strs = [str(k) for k in ints]
+	probe = [rg.randrange(10 * n) for _ in range(n)]
+
+	def add_loop():
+		s = make.Set()
+		for k in ints:
+			s.add(k)
+		return s
+
+	s = add_loop()
+	d = make.Dict(zip(ints, ints))
+	cases = {
+		"add (int)": add_loop,
+		"update (int)": lambda: make.Set().update(ints),
+		"update (str)": lambda: make.Set().update(strs),
+		"contains (int)": lambda: [k in s for k in probe],
+		"getitem (int)": lambda: [d.get(k) for k in probe],
+		"find_many (int)": lambda: make.find_many(d, probe),
+		"iterate": lambda: sum(1 for _ in s),
+		"range": lambda: list(make.irange(s, n, 5 * n)),
+	}
+	for case, fn in cases.items():
+		t = min(timeit.repeat(fn, number=1, repeat=5))
+		print(f"{name:18} {case:16} {t * 1e3:9.2f} ms")
+
+
+class Native:
+	Set = crbtree.SortedSet
+	Dict = crbtree.SortedDict
+
+	@staticmethod
+	def find_many(d, keys):
+		return d.find_many(keys)
+
+	@staticmethod
+	def irange(s, lo, hi):
+		return s.irange(lo, hi)
+
+
+class Pure:
+	Set = sortedcontainers.SortedSet
+	Dict = sortedcontainers.SortedDict
+
+	@staticmethod
+	def find_many(d, keys):
+		return [d.get(k) for k in keys]
+
+	@staticmethod
+	def irange(s, lo, hi):
+		return s.irange(lo, hi, inclusive=(True, False))
+
+
+if __name__ == "__main__":
+	n = int(sys.argv[1]) if len(sys.argv) > 1 else 200000
+	run("crbtree", Native, n)
+	run("sortedcontainers", Pure, n)
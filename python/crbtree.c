@@ -0,0 +1,1509 @@
+/*
+ * CPython extension exposing the library as SortedSet and SortedDict.
+ *
+ * The trees are initialized with RBinit2, the comparison function reporting
+ * the exceptions raised by the comparisons of Python objects. Exact int,
+ * float and str keys are compared without calling Python. A SortedDict is a
+ * map (see RBmap) whose keys are the elements and whose values are kept in
+ * the value slots of the nodes. The trees own a reference to every key and
+ * value they hold.
+ *
+ * While all their keys are of the same kind (see kind_of), the trees keep
+ * abbreviated keys and a hash index. Lookups never change a tree: a key of
+ * another kind is searched by comparison alone, and only its insertion
+ * rebuilds the tree without them.
+ *
+ * The iterations read the keys in batches borrowed from the tree, each one
+ * with a single walk (see RBforeach_range). Once the walks read as many keys
+ * as the tree holds, its nodes are laid out again and its keys copied in
+ * order (see lay_out), which the next walks read instead while it does not
+ * change.
+ *
+ * The GIL is only released while update sorts a batch of numbers whose
+ * abbreviated keys are exact, as that sort reads none of the keys. The other
+ * loops keep it: the comparisons, the hashes and the reference counts call
+ * Python, and a tree shared by several threads has no lock of its own. The
+ * batched operations (update, find_many, range_buffer) amortize the cost of
+ * the calls from Python instead.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "rbtree.h"
+
+typedef struct _Iterator Iterator;
+
+typedef struct {
+	PyObject_HEAD
+	RBTree tree;
+	RBFinger* finger;	// for the lookups, which are often close
+	Iterator* iters;	// the iterators which are not exhausted
+	int map;	// a SortedDict
+	int kind;	// the kind of all the keys or KIND_ANY
+	size_t laid_out;	// the number of keys when the nodes were laid out
+	size_t walked;	// the number of keys the walks read since lay_out
+	PyObject** sorted;	// the keys in order while tree.mods is sorted_mods
+	size_t sorted_size;	// the room of sorted
+	unsigned long sorted_mods;
+} Container;
+
+// The largest number of keys an iterator reads at once
+#define ITER_BATCH 512
+
+/*
+ * The keys of the batch of an iterator are borrowed from the tree: they stay
+ * there while tree.mods is unchanged. Otherwise the next batch is read after
+ * the last returned key, which the container pins before removing any key.
+ */
+struct _Iterator {
+	PyObject_HEAD
+	Container* owner;
+	Iterator* next_iter;	// the next iterator of the owner
+	Iterator** prev_iter;	// the link to this one in the owner
+	PyObject* lo;	// the bound the first batch starts from or NULL
+	PyObject* hi;	// the excluded upper bound or NULL
+	PyObject* stop;	// the first key from hi, compared by address, or NULL
+	PyObject* pinned;	// the last returned key if the owner removed keys
+	unsigned long mods;	// the value of tree.mods when the batch was read
+	int end;	// the batch ends the range
+	int size;	// the number of keys of the next batch
+	int n;	// the number of keys of the batch, -1 once exhausted
+	int pos;	// the next key of the batch to return
+	Py_ssize_t next;	// the index in the sorted keys after the batch or -1
+	PyObject* keys[ITER_BATCH];
+};
+
+// A key and its value (NULL in a SortedSet) in a batch
+struct pair {
+	PyObject* key;
+	PyObject* value;
+	uint64_t prefix;	// the abbreviated key if the batch has a kind, or 0
+};
+
+/*
+ * The kinds of keys which have abbreviated keys (see RBprefix), sparing the
+ * accesses to the key objects during searches. The tree of a container only
+ * has them while all its keys are of the same kind.
+ */
+enum {
+	KIND_ANY,
+	KIND_NUMBER,	// exact int fitting in 64 bits or exact float but NaN
+	KIND_STR	// exact str
+};
+
+// Brings the object at an address in the cache ahead of its use
+#if defined(__GNUC__)
+#define PREFETCH(p) __builtin_prefetch((p), 1)
+#else
+#define PREFETCH(p) ((void)(p))
+#endif
+
+static PyTypeObject SortedSetType;
+static PyTypeObject SortedDictType;
+static PyTypeObject IteratorType;
+
+/*
+ * Compares two keys, without calling Python for two exact ints fitting in
+ * 64 bits, two floats which are not NaN or two strs.
+ * Returns -1, 0 or 1, or sets *err if a comparison raised an exception.
+ */
+static int compare_keys(PyObject* a, PyObject* b, int* err) {
+	if (PyLong_CheckExact(a) && PyLong_CheckExact(b)) {
+		int oa, ob;
+		long long x = PyLong_AsLongLongAndOverflow(a, &oa);
+		long long y = PyLong_AsLongLongAndOverflow(b, &ob);
+		if (0 == oa && 0 == ob) return (x > y) - (x < y);
+	}
+	else if (PyFloat_CheckExact(a) && PyFloat_CheckExact(b)) {
+		double x = PyFloat_AS_DOUBLE(a), y = PyFloat_AS_DOUBLE(b);
+		if (x < y) return -1;
+		if (x > y) return 1;
+		if (x == y) return 0;
+	}
+	else if (PyUnicode_CheckExact(a) && PyUnicode_CheckExact(b)) {
+		int cmp = PyUnicode_Compare(a, b);
+		if (-1 == cmp && PyErr_Occurred()) *err = 1;
+		return cmp;
+	}
+	int lt = PyObject_RichCompareBool(a, b, Py_LT);
+	if (lt < 0) {
+		*err = 1;
+		return 0;
+	}
+	if (lt) return -1;
+	int gt = PyObject_RichCompareBool(a, b, Py_GT);
+	if (gt < 0) *err = 1;
+	return gt > 0;
+}
+
+static int compare(const void* a, const void* b, int* err) {
+	return compare_keys((PyObject*)a, (PyObject*)b, err);
+}
+
+static void decref(const void* data) {
+	Py_DECREF((PyObject*)data);
+}
+
+// Reports a failure of the tree: an exception of a comparison or no memory
+static void tree_error(void) {
+	if (!PyErr_Occurred()) PyErr_NoMemory();
+}
+
+static int decref_value(void* key, void** slot, void* ctx) {
+	(void)key;
+	(void)ctx;
+	Py_XDECREF((PyObject*)*slot);
+	return 0;
+}
+
+static int first_key(void* data, void* ctx) {
+	*(PyObject**)ctx = data;
+	return 1;
+}
+
+/*
+ * Finds the first key from a bound, which may be of any kind, in a tree:
+ * RBforeach_range only compares the keys, without the abbreviated keys and
+ * the hash index of the tree.
+ * Returns 0 or -1 if a comparison raised an exception.
+ */
+static int first_from(RBTree* tree, PyObject* bound, PyObject** key) {
+	*key = NULL;
+	return (RBforeach_range(tree, bound, NULL, first_key, key) < 0) ? -1 : 0;
+}
+
+static int kind_of(PyObject* key) {
+	if (PyLong_CheckExact(key)) {
+		int overflow;
+		PyLong_AsLongLongAndOverflow(key, &overflow);
+		return overflow ? KIND_ANY : KIND_NUMBER;
+	}
+	if (PyFloat_CheckExact(key)) {
+		return isnan(PyFloat_AS_DOUBLE(key)) ? KIND_ANY : KIND_NUMBER;
+	}
+	return PyUnicode_CheckExact(key) ? KIND_STR : KIND_ANY;
+}
+
+/*
+ * Abbreviates a number as its value as a double, whose bits are reordered
+ * so that they compare as the values. The rounding of the large ints keeps
+ * the order, only making some abbreviated keys equal.
+ */
+static uint64_t number_prefix(const void* key) {
+	PyObject* obj = (PyObject*)key;
+	double d = PyFloat_CheckExact(obj) ? PyFloat_AS_DOUBLE(obj)
+		: (double)PyLong_AsLongLong(obj);
+	if (0 == d) d = 0;	// -0.0 is equal to 0
+	uint64_t bits;
+	memcpy(&bits, &d, sizeof(bits));
+	return (bits >> 63) ? ~bits : bits | (UINT64_C(1) << 63);
+}
+
+// Tells whether only the numbers equal to a number share its abbreviated key
+static int exact_number(PyObject* key) {
+	if (PyFloat_CheckExact(key)) return 1;
+	long long v = PyLong_AsLongLong(key);
+	return -(1LL << 53) <= v && v <= (1LL << 53);
+}
+
+/*
+ * Abbreviates a str as the first 8 bytes of its UTF-8 encoding, which orders
+ * the strs like their code points.
+ */
+static uint64_t str_prefix(const void* key) {
+	PyObject* obj = (PyObject*)key;
+	int kind = PyUnicode_KIND(obj);
+	const void* data = PyUnicode_DATA(obj);
+	Py_ssize_t len = PyUnicode_GET_LENGTH(obj);
+	uint64_t prefix = 0;
+	int bytes = 0;
+	for (Py_ssize_t i = 0; i < len && bytes < 8; i++) {
+		Py_UCS4 c = PyUnicode_READ(kind, data, i);
+		unsigned char utf8[4];
+		int n;
+		if (c < 0x80) {
+			utf8[0] = (unsigned char)c;
+			n = 1;
+		}
+		else if (c < 0x800) {
+			utf8[0] = (unsigned char)(0xC0 | (c >> 6));
+			utf8[1] = (unsigned char)(0x80 | (c & 0x3F));
+			n = 2;
+		}
+		else if (c < 0x10000) {
+			utf8[0] = (unsigned char)(0xE0 | (c >> 12));
+			utf8[1] = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+			utf8[2] = (unsigned char)(0x80 | (c & 0x3F));
+			n = 3;
+		}
+		else {
+			utf8[0] = (unsigned char)(0xF0 | (c >> 18));
+			utf8[1] = (unsigned char)(0x80 | ((c >> 12) & 0x3F));
+			utf8[2] = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+			utf8[3] = (unsigned char)(0x80 | (c & 0x3F));
+			n = 4;
+		}
+		for (int j = 0; j < n && bytes < 8; j++, bytes++) {
+			prefix = (prefix << 8) | utf8[j];
+		}
+	}
+	return bytes ? prefix << (8 * (8 - bytes)) : 0;
+}
+
+// The hash of a key of a kind other than KIND_ANY, which cannot fail
+static size_t hash_key(const void* key) {
+	return (size_t)PyObject_Hash((PyObject*)key);
+}
+
+/*
+ * Initializes an empty tree for the keys of a kind. The trees also get a hash
+ * index for the lookups, if Python hashes their keys consistently with their
+ * comparison.
+ */
+static void init_tree(Container* self, RBTree* tree, int kind) {
+	RBinit2(tree, compare);
+	if (self->map) RBmap(tree);
+	if (KIND_NUMBER == kind) RBprefix(tree, number_prefix);
+	else if (KIND_STR == kind) RBprefix(tree, str_prefix);
+	// the index is only an optimization: a failure is ignored
+	if (KIND_ANY != kind) RBhash(tree, hash_key);
+}
+
+// Gives an empty tree to a container
+static void reset(Container* self, unsigned long mods, int kind) {
+	init_tree(self, &self->tree, kind);
+	self->kind = kind;
+	self->laid_out = 0;
+	self->walked = 0;
+	// the cursors and the finger must see the change
+	self->tree.mods = mods + 1;
+}
+
+/*
+ * Keeps the last key returned by every iterator of a container which just
+ * removed keys from its tree, before releasing them, as the next batches
+ * start after it.
+ */
+static void pin(Container* self) {
+	for (Iterator* it = self->iters; NULL != it; it = it->next_iter) {
+		if (it->pos > 0 && NULL == it->pinned) {
+			it->pinned = it->keys[it->pos - 1];
+			Py_INCREF(it->pinned);
+		}
+	}
+}
+
+struct range_ctx {
+	PyObject** keys;
+	size_t n;
+	size_t size;
+	PyObject* stop;	// the first key not collected or NULL
+};
+
+static int collect_key(void* data, void* ctx) {
+	struct range_ctx* r = ctx;
+	if (data == r->stop) return 1;
+	if (r->n == r->size) {
+		size_t size = r->size ? 2 * r->size : 64;
+		PyObject** keys = PyMem_Realloc(r->keys, size * sizeof(*keys));
+		if (NULL == keys) return -1;
+		r->keys = keys;
+		r->size = size;
+	}
+	r->keys[r->n++] = data;
+	return 0;
+}
+
+/*
+ * Prepares the tree of a container for the next walks once the walks read
+ * as many keys as it has, as the work costs about as much as they did: the
+ * walks pay for it instead of the insertions. Its nodes are laid out in key
+ * order again (see RBcompact) if it doubled since they last were, as
+ * inserted one at a time, they are scattered in the heap, where every step
+ * of a walk misses the cache. And its keys are copied in order to sorted,
+ * which the iterations and range_buffer read instead of the tree while it
+ * does not change. It is only an optimization, which may fail.
+ */
+static void lay_out(Container* self) {
+	size_t count = self->tree.count;
+	if (count < 1024 || self->walked < count) return;
+	self->walked = 0;
+	if (count >= 2 * self->laid_out && 0 == RBcompact(&self->tree)) {
+		self->laid_out = count;
+	}
+	if (count > self->sorted_size) {
+		PyObject** sorted = PyMem_Realloc(self->sorted,
+			count * sizeof(*sorted));
+		if (NULL == sorted) return;
+		self->sorted = sorted;
+		self->sorted_size = count;
+	}
+	// with room for all the keys, the copy cannot fail
+	struct range_ctx r = { self->sorted, 0, self->sorted_size, NULL };
+	RBforeach(&self->tree, collect_key, &r);
+	self->sorted_mods = self->tree.mods;
+}
+
+// Tells whether the sorted keys of a container are those of its tree
+static int sorted_valid(const Container* self) {
+	return NULL != self->sorted && self->sorted_mods == self->tree.mods;
+}
+
+/*
+ * Finds the index of the first sorted key of a container from a bound, or
+ * after it.
+ * Returns the index or -1 if a comparison raised an exception.
+ */
+static Py_ssize_t sorted_from(Container* self, PyObject* bound, int after) {
+	size_t lo = 0, hi = self->tree.count;
+	int err = 0;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = compare_keys(self->sorted[mid], bound, &err);
+		if (err) return -1;
+		if (cmp < 0 || (after && 0 == cmp)) lo = mid + 1;
+		else hi = mid;
+	}
+	return (Py_ssize_t)lo;
+}
+
+/*
+ * Empties a container. The tree is detached first, as releasing the keys
+ * and values may run code using the container.
+ */
+static void clear(Container* self) {
+	RBTree old = self->tree;
+	reset(self, old.mods, KIND_ANY);
+	pin(self);
+	if (self->map) RBforeach_kv(&old, decref_value, NULL);
+	RBdestroy(&old, decref);
+}
+
+static PyObject* container_new(PyTypeObject* type, PyObject* args,
+		PyObject* kwds) {
+	(void)args;
+	(void)kwds;
+	Container* self = (Container*)type->tp_alloc(type, 0);
+	if (NULL == self) return NULL;
+	self->map = PyType_IsSubtype(type, &SortedDictType);
+	reset(self, 0, KIND_ANY);
+	self->finger = RBfinger_open(&self->tree);
+	if (NULL == self->finger) {
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+	return (PyObject*)self;
+}
+
+struct visit_ctx {
+	visitproc visit;
+	void* arg;
+};
+
+static int visit_node(void* key, void** slot, void* ctx) {
+	struct visit_ctx* v = ctx;
+	int ret = v->visit((PyObject*)key, v->arg);
+	if (0 == ret && NULL != slot && NULL != *slot) {
+		ret = v->visit((PyObject*)*slot, v->arg);
+	}
+	return ret;
+}
+
+static int container_traverse(Container* self, visitproc visit, void* arg) {
+	struct visit_ctx v = { visit, arg };
+	return RBforeach_kv(&self->tree, visit_node, &v);
+}
+
+static int container_clear(Container* self) {
+	clear(self);
+	return 0;
+}
+
+static void container_dealloc(Container* self) {
+	PyObject_GC_UnTrack(self);
+	clear(self);
+	RBfinger_close(self->finger);
+	PyMem_Free(self->sorted);
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* Batches */
+
+static int compare_pairs(const struct pair* a, const struct pair* b,
+		int* err) {
+	if (a->prefix != b->prefix) return (a->prefix < b->prefix) ? -1 : 1;
+	return compare_keys(a->key, b->key, err);
+}
+
+/*
+ * Sorts pairs by key, keeping the order of the pairs with equal keys, with
+ * a merge sort using tmp as a buffer of n pairs. Runs already in order are
+ * not merged, so that sorted batches only cost n comparisons.
+ * Returns 0 or -1 if a comparison raised an exception.
+ */
+static int sort_pairs(struct pair* pairs, struct pair* tmp, size_t n) {
+	int err = 0;
+	for (size_t width = 1; width < n; width *= 2) {
+		for (size_t lo = 0; lo < n; lo += 2 * width) {
+			size_t mid = (lo + width < n) ? lo + width : n;
+			size_t hi = (mid + width < n) ? mid + width : n;
+			size_t i = lo, j = mid, k = lo;
+			if (mid < hi
+				&& compare_pairs(pairs + mid - 1, pairs + mid, &err) <= 0) {
+				i = j = hi;
+			}
+			while (0 == err && i < mid && j < hi) {
+				int cmp = compare_pairs(pairs + j, pairs + i, &err);
+				tmp[k++] = (cmp < 0) ? pairs[j++] : pairs[i++];
+			}
+			if (err) return -1;
+			while (i < mid) tmp[k++] = pairs[i++];
+			while (j < hi) tmp[k++] = pairs[j++];
+			// the pairs in order are left in place
+			if (k > lo) memcpy(pairs + lo, tmp + lo, (k - lo) * sizeof(*pairs));
+		}
+	}
+	return 0;
+}
+
+/*
+ * Sorts pairs by their abbreviated keys with a radix sort using tmp as a
+ * buffer of n pairs, keeping the order of the pairs with equal keys. The
+ * bytes which all the abbreviated keys share are skipped. As the keys
+ * themselves are not read, it can run without the GIL.
+ */
+static void radix_pairs(struct pair* pairs, struct pair* tmp, size_t n) {
+	size_t count[8][256] = { { 0 } };
+	for (size_t i = 0; i < n; i++) {
+		for (int d = 0; d < 8; d++) {
+			count[d][(pairs[i].prefix >> (8 * d)) & 0xFF] += 1;
+		}
+	}
+	struct pair* from = pairs;
+	struct pair* to = tmp;
+	for (int d = 0; d < 8; d++) {
+		size_t* pos = count[d];
+		if (n == pos[(from[0].prefix >> (8 * d)) & 0xFF]) continue;
+		size_t sum = 0;
+		for (int b = 0; b < 256; b++) {
+			size_t k = pos[b];
+			pos[b] = sum;
+			sum += k;
+		}
+		for (size_t i = 0; i < n; i++) {
+			to[pos[(from[i].prefix >> (8 * d)) & 0xFF]++] = from[i];
+		}
+		struct pair* swap = from;
+		from = to;
+		to = swap;
+	}
+	if (from != pairs) memcpy(pairs, from, n * sizeof(*pairs));
+}
+
+/*
+ * Sorts pairs and merges the ones with equal keys, keeping the first key and
+ * the last value as successive assignments would. If the abbreviated keys
+ * are exact, only equal keys sharing theirs, the keys are not compared.
+ * Returns the number of pairs left or -1 if a comparison raised an exception.
+ */
+static Py_ssize_t sort_unique(struct pair* pairs, size_t n, int exact) {
+	if (n < 2) return (Py_ssize_t)n;
+	struct pair* tmp = PyMem_Malloc(n * sizeof(*tmp));
+	if (NULL == tmp) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	int cr = 0;
+	if (exact) {
+		Py_BEGIN_ALLOW_THREADS
+		radix_pairs(pairs, tmp, n);
+		Py_END_ALLOW_THREADS
+	}
+	else cr = sort_pairs(pairs, tmp, n);
+	PyMem_Free(tmp);
+	if (cr) return -1;
+	size_t m = 0;
+	for (size_t i = 1; i < n; i++) {
+		int err = 0;
+		int cmp = exact ? (pairs[m].prefix != pairs[i].prefix)
+			: compare_pairs(pairs + m, pairs + i, &err);
+		if (err) return -1;
+		if (0 == cmp) pairs[m].value = pairs[i].value;
+		else pairs[++m] = pairs[i];
+	}
+	return (Py_ssize_t)m + 1;
+}
+
+struct collect_ctx {
+	struct pair* pairs;
+	size_t n;
+};
+
+static int collect_node(void* key, void** slot, void* ctx) {
+	struct collect_ctx* c = ctx;
+	c->pairs[c->n].key = key;
+	c->pairs[c->n].value = (NULL == slot) ? NULL : *slot;
+	c->pairs[c->n].prefix = 0;
+	c->n += 1;
+	return 0;
+}
+
+/*
+ * Replaces the tree of a container with the merge of its pairs and of n
+ * sorted unique pairs, in linear time, for keys of the given kind. A key
+ * already in the tree is kept and only its value replaced.
+ * Returns 0 or -1 on error, the container being then unchanged.
+ */
+static int rebuild(Container* self, struct pair* batch, size_t n, int kind) {
+	size_t count = self->tree.count;
+	struct pair* old = PyMem_Malloc((count + 1) * sizeof(*old));
+	struct pair* pairs = PyMem_Malloc((count + n + 1) * sizeof(*pairs));
+	void** keys = PyMem_Malloc(2 * (count + n + 1) * sizeof(*keys));
+	void** values = keys + count + n + 1;
+	// tells which batch keys are added to the tree
+	char* added = PyMem_Malloc(n + 1);
+	if (NULL == old || NULL == pairs || NULL == keys || NULL == added) {
+		PyMem_Free(old);
+		PyMem_Free(pairs);
+		PyMem_Free(keys);
+		PyMem_Free(added);
+		PyErr_NoMemory();
+		return -1;
+	}
+	struct collect_ctx c = { old, 0 };
+	RBforeach_kv(&self->tree, collect_node, &c);
+	// the replaced values are moved to the beginning of old, already merged
+	size_t i = 0, j = 0, m = 0, r = 0;
+	int err = 0;
+	while (0 == err && (i < count || j < n)) {
+		int cmp = (i == count) ? 1 : (j == n) ? -1
+			: compare_keys(old[i].key, batch[j].key, &err);
+		if (cmp < 0) pairs[m++] = old[i++];
+		else {
+			added[j] = (cmp > 0);
+			if (cmp > 0) pairs[m].key = batch[j].key;
+			else {
+				pairs[m].key = old[i].key;
+				old[r++].value = old[i++].value;
+			}
+			pairs[m++].value = batch[j++].value;
+		}
+	}
+	for (size_t k = 0; k < m; k++) {
+		keys[k] = pairs[k].key;
+		values[k] = pairs[k].value;
+	}
+	RBTree fresh;
+	init_tree(self, &fresh, kind);
+	int cr = err ? -1 : RBbuild(&fresh, keys, values, m);
+	if (0 == cr) {
+		for (size_t k = 0; k < n; k++) {
+			if (added[k]) Py_INCREF(batch[k].key);
+			Py_XINCREF(batch[k].value);
+		}
+		unsigned long mods = self->tree.mods;
+		RBdestroy(&self->tree, NULL);
+		self->tree = fresh;
+		self->tree.mods = mods + 1;
+		self->kind = kind;
+		self->laid_out = self->tree.count;
+		self->walked = 0;
+		// released once the tree is consistent, as that may run any code
+		for (size_t k = 0; k < r; k++) Py_XDECREF(old[k].value);
+	}
+	else {
+		RBdestroy(&fresh, NULL);
+		if (!err) PyErr_NoMemory();
+	}
+	PyMem_Free(old);
+	PyMem_Free(pairs);
+	PyMem_Free(keys);
+	PyMem_Free(added);
+	return cr;
+}
+
+/* Single keys */
+
+/*
+ * Tells whether the tree of a container searches a key with its abbreviated
+ * keys and its hash index. The other keys are searched with first_from.
+ */
+static int native(Container* self, PyObject* key) {
+	return KIND_ANY == self->kind || kind_of(key) == self->kind;
+}
+
+/*
+ * Prepares the tree of a container for the insertion of a key: an empty tree
+ * takes the kind of the key, and a tree of another kind is rebuilt without
+ * abbreviated keys. The lookups never call it, as they leave the tree alone.
+ * Returns 0 or -1 on error.
+ */
+static int adapt(Container* self, PyObject* key) {
+	if (KIND_ANY == self->kind && NULL != self->tree.root) return 0;
+	int kind = kind_of(key);
+	if (kind == self->kind) return 0;
+	if (NULL == self->tree.root) {
+		RBdestroy(&self->tree, NULL);
+		reset(self, self->tree.mods, kind);
+		return 0;
+	}
+	return rebuild(self, NULL, 0, KIND_ANY);
+}
+
+static Py_ssize_t container_len(Container* self) {
+	return (Py_ssize_t)self->tree.count;
+}
+
+/*
+ * Finds the key equal to a key in a container.
+ * Returns that key (borrowed), or NULL, with an exception set on error.
+ */
+static PyObject* find_key(Container* self, PyObject* key) {
+	if (native(self, key)) return RBfinger_find(self->finger, key);
+	PyObject* next;
+	if (first_from(&self->tree, key, &next) || NULL == next) return NULL;
+	// an equal key must also be equal, which a NaN never is
+	int eq = PyObject_RichCompareBool(key, next, Py_EQ);
+	return (eq > 0) ? next : NULL;
+}
+
+static int container_contains(Container* self, PyObject* key) {
+	if (NULL != find_key(self, key)) return 1;
+	return PyErr_Occurred() ? -1 : 0;
+}
+
+// Finds the value slot of a key in a SortedDict, NULL with an exception set
+// on error
+static void** find_slot(Container* self, PyObject* key) {
+	if (!native(self, key)) {
+		// the key equal to it is searched instead, which is native
+		key = find_key(self, key);
+		if (NULL == key) return NULL;
+	}
+	return RBfind_slot(&self->tree, key);
+}
+
+/*
+ * Adds a key to a SortedSet or sets its value in a SortedDict. As in Python
+ * sets and dicts, a key already there is kept.
+ */
+static int put(Container* self, PyObject* key, PyObject* value) {
+	int err = 0;
+	if (self->map) {
+		void** slot = find_slot(self, key);
+		if (NULL != slot) {
+			PyObject* old = *slot;
+			Py_INCREF(value);
+			*slot = value;
+			Py_XDECREF(old);
+			return 0;
+		}
+		if (PyErr_Occurred() || adapt(self, key)) return -1;
+		Py_INCREF(key);
+		Py_INCREF(value);
+		RBinsert_kv(&self->tree, key, value, NULL, &err);
+		if (err) Py_DECREF(value);
+	}
+	else {
+		if (NULL != find_key(self, key)) return 0;
+		if (PyErr_Occurred() || adapt(self, key)) return -1;
+		Py_INCREF(key);
+		RBinsert(&self->tree, key, &err);
+	}
+	if (err) {
+		Py_DECREF(key);
+		tree_error();
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Removes a key and gives its value (a new reference to the key in a
+ * SortedSet) in *value.
+ * Returns 1 if it was removed, 0 if it was not there and -1 on error.
+ */
+static int take(Container* self, PyObject* key, PyObject** value) {
+	if (!native(self, key)) {
+		// the key equal to it is removed instead, which is native
+		key = find_key(self, key);
+		if (NULL == key) return PyErr_Occurred() ? -1 : 0;
+	}
+	PyObject* stored = self->map
+		? RBremove_kv(&self->tree, key, (void**)value)
+		: RBremove(&self->tree, key);
+	if (NULL == stored) return PyErr_Occurred() ? -1 : 0;
+	pin(self);
+	if (self->map) Py_DECREF(stored);
+	else *value = stored;
+	return 1;
+}
+
+/*
+ * Reads the pairs of an iterable: keys for a SortedSet, a mapping or (key,
+ * value) pairs for a SortedDict. The pairs hold borrowed references to the
+ * items of *owner, a new list to release after use.
+ * Returns the number of pairs or -1 on error.
+ */
+static Py_ssize_t read_pairs(Container* self, PyObject* iterable,
+		struct pair** pairs, PyObject** owner) {
+	PyObject* items;
+	if (self->map && PyDict_Check(iterable)) {
+		items = PyDict_Items(iterable);
+	}
+	else if (self->map && PyObject_HasAttrString(iterable, "keys")) {
+		items = PyObject_CallMethod(iterable, "items", NULL);
+		if (NULL != items) Py_SETREF(items, PySequence_List(items));
+	}
+	else items = PySequence_List(iterable);
+	if (NULL == items) return -1;
+	Py_ssize_t n = PyList_GET_SIZE(items);
+	*pairs = PyMem_Malloc((n ? n : 1) * sizeof(**pairs));
+	if (NULL == *pairs) {
+		Py_DECREF(items);
+		PyErr_NoMemory();
+		return -1;
+	}
+	for (Py_ssize_t i = 0; i < n; i++) {
+		PyObject* item = PyList_GET_ITEM(items, i);
+		if (!self->map) {
+			(*pairs)[i].key = item;
+			(*pairs)[i].value = NULL;
+		}
+		else if (PyTuple_Check(item) && 2 == PyTuple_GET_SIZE(item)) {
+			(*pairs)[i].key = PyTuple_GET_ITEM(item, 0);
+			(*pairs)[i].value = PyTuple_GET_ITEM(item, 1);
+		}
+		else {
+			PyErr_SetString(PyExc_TypeError,
+				"SortedDict.update expects a mapping or (key, value) pairs");
+			PyMem_Free(*pairs);
+			Py_DECREF(items);
+			return -1;
+		}
+	}
+	*owner = items;
+	return n;
+}
+
+/*
+ * Adds a batch of keys or pairs. The batch is sorted first, so that either
+ * its elements are inserted in key order, or if they are many compared to
+ * the size of the tree, the tree is rebuilt from the merge of both.
+ */
+static int update(Container* self, PyObject* iterable) {
+	struct pair* pairs;
+	PyObject* owner;
+	Py_ssize_t n = read_pairs(self, iterable, &pairs, &owner);
+	if (n < 0) return -1;
+	// the kind of all the keys of the batch, whose abbreviated keys spare
+	// most comparisons of the sort
+	int kind = (n > 0) ? kind_of(pairs[0].key) : KIND_ANY;
+	for (Py_ssize_t i = 1; i < n && KIND_ANY != kind; i++) {
+		if (kind_of(pairs[i].key) != kind) kind = KIND_ANY;
+	}
+	// the abbreviated keys of the numbers are exact unless some ints are too
+	// large for a double
+	int exact = (KIND_NUMBER == kind);
+	for (Py_ssize_t i = 0; i < n; i++) {
+		pairs[i].prefix = (KIND_NUMBER == kind) ? number_prefix(pairs[i].key)
+			: (KIND_STR == kind) ? str_prefix(pairs[i].key) : 0;
+		if (exact && !exact_number(pairs[i].key)) exact = 0;
+	}
+	int cr = 0;
+	n = sort_unique(pairs, (size_t)n, exact);
+	if (n < 0) cr = -1;
+	else if ((size_t)n * (1 + self->tree.black_depth) > self->tree.count) {
+		if (NULL != self->tree.root && kind != self->kind) kind = KIND_ANY;
+		cr = rebuild(self, pairs, (size_t)n, kind);
+	}
+	else {
+		for (Py_ssize_t i = 0; i < n && 0 == cr; i++) {
+			cr = put(self, pairs[i].key, pairs[i].value);
+		}
+	}
+	PyMem_Free(pairs);
+	Py_DECREF(owner);
+	return cr;
+}
+
+static int container_init(Container* self, PyObject* args, PyObject* kwds) {
+	static char* kwlist[] = { "iterable", NULL };
+	PyObject* iterable = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &iterable)) {
+		return -1;
+	}
+	if (NULL != self->tree.root) clear(self);
+	return (NULL == iterable) ? 0 : update(self, iterable);
+}
+
+static PyObject* container_update(Container* self, PyObject* iterable) {
+	if (update(self, iterable)) return NULL;
+	Py_RETURN_NONE;
+}
+
+// Gives the bytes of a container and of its tree, without the keys and values
+static PyObject* container_sizeof(Container* self, PyObject* unused) {
+	(void)unused;
+	RBMemory usage;
+	RBmemory_usage(&self->tree, &usage);
+	return PyLong_FromSize_t(Py_TYPE(self)->tp_basicsize + usage.nodes
+		+ usage.overhead);
+}
+
+static PyObject* container_clear_method(Container* self, PyObject* unused) {
+	(void)unused;
+	clear(self);
+	Py_RETURN_NONE;
+}
+
+/* Ranges */
+
+// Translates None to no bound
+static PyObject* bound(PyObject* key) {
+	return (NULL == key || Py_None == key) ? NULL : key;
+}
+
+/*
+ * Creates an iterator from lo to hi. The keys are read in batches, each one
+ * with a single walk of the tree, which ends at the first key from hi: that
+ * key is recognized by its address while the tree does not change, so that
+ * the bounds are only compared once per batch. The batches grow from a few
+ * keys, as many iterations stop early.
+ */
+static PyObject* iterator_new(Container* owner, PyObject* lo, PyObject* hi) {
+	PyObject* stop = NULL;
+	if (NULL != hi && first_from(&owner->tree, hi, &stop)) return NULL;
+	int err = 0;
+	int empty = NULL != lo && NULL != hi && compare_keys(lo, hi, &err) >= 0;
+	if (err) return NULL;
+	Iterator* it = PyObject_New(Iterator, &IteratorType);
+	if (NULL == it) return NULL;
+	Py_INCREF(owner);
+	it->owner = owner;
+	it->next_iter = NULL;
+	it->prev_iter = NULL;
+	Py_XINCREF(lo);
+	it->lo = lo;
+	Py_XINCREF(hi);
+	it->hi = hi;
+	it->stop = stop;
+	it->pinned = NULL;
+	it->mods = owner->tree.mods;
+	it->end = 0;
+	it->size = 8;
+	it->n = -1;
+	it->pos = 0;
+	it->next = -1;
+	if (!empty) {
+		it->n = 0;
+		it->next_iter = owner->iters;
+		if (NULL != owner->iters) owner->iters->prev_iter = &it->next_iter;
+		it->prev_iter = &owner->iters;
+		owner->iters = it;
+	}
+	return (PyObject*)it;
+}
+
+static PyObject* container_iter(Container* self) {
+	return iterator_new(self, NULL, NULL);
+}
+
+static PyObject* container_irange(Container* self, PyObject* args,
+		PyObject* kwds) {
+	static char* kwlist[] = { "lo", "hi", NULL };
+	PyObject* lo = NULL;
+	PyObject* hi = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO", kwlist, &lo, &hi)) {
+		return NULL;
+	}
+	return iterator_new(self, bound(lo), bound(hi));
+}
+
+// Ends an iteration, which no longer needs its owner to pin its keys
+static void iterator_end(Iterator* it) {
+	it->n = -1;
+	if (NULL != it->prev_iter) {
+		*it->prev_iter = it->next_iter;
+		if (NULL != it->next_iter) it->next_iter->prev_iter = it->prev_iter;
+		it->prev_iter = NULL;
+	}
+	Py_CLEAR(it->pinned);
+}
+
+static void iterator_dealloc(Iterator* it) {
+	iterator_end(it);
+	Py_XDECREF(it->lo);
+	Py_XDECREF(it->hi);
+	Py_DECREF(it->owner);
+	PyObject_Free(it);
+}
+
+struct batch_ctx {
+	Iterator* it;
+	PyObject* after;	// the last returned key, skipped if still there
+	int err;
+};
+
+static int batch_key(void* data, void* ctx) {
+	struct batch_ctx* b = ctx;
+	Iterator* it = b->it;
+	if (data == it->stop) {
+		it->end = 1;
+		return 1;
+	}
+	if (NULL != b->after) {
+		// only the first key of the walk may be equal to it
+		PyObject* after = b->after;
+		b->after = NULL;
+		if (0 == compare_keys(data, after, &b->err) || b->err) return b->err;
+	}
+	// the key is read by next, once the whole batch is read
+	PREFETCH(data);
+	it->keys[it->n++] = data;
+	return it->size == it->n;
+}
+
+/*
+ * Copies the next batch of an iterator from the sorted keys of its owner,
+ * from an index, up to its stop.
+ */
+static void sorted_batch(Iterator* it, size_t next) {
+	Container* owner = it->owner;
+	size_t count = owner->tree.count;
+	while (it->n < it->size && next < count
+		&& owner->sorted[next] != it->stop) {
+		PREFETCH(owner->sorted[next]);
+		it->keys[it->n++] = owner->sorted[next++];
+	}
+	it->end = (next == count || owner->sorted[next] == it->stop);
+	it->next = (Py_ssize_t)next;
+}
+
+/*
+ * Reads the next batch of an iterator, after the last returned key, or from
+ * lo for the first batch: from the sorted keys of its owner if they are
+ * those of the tree, where the batch follows the previous one while the tree
+ * is unchanged, or with a walk of the tree.
+ * Returns 0 or -1 if a comparison raised an exception.
+ */
+static int iterator_read(Iterator* it) {
+	RBTree* tree = &it->owner->tree;
+	PyObject* from = it->pinned;
+	if (NULL == from && it->pos > 0) from = it->keys[it->pos - 1];
+	struct batch_ctx b = { it, from, 0 };
+	if (NULL == from) from = it->lo;
+	lay_out(it->owner);
+	Py_ssize_t next = (it->mods == tree->mods) ? it->next : -1;
+	int cr = 0;
+	if (NULL != it->hi && it->mods != tree->mods) {
+		// the previous stop may have been removed
+		cr = first_from(tree, it->hi, &it->stop);
+	}
+	if (it->n > 0 && it->size < ITER_BATCH) it->size *= 2;
+	it->n = it->pos = 0;
+	it->mods = tree->mods;
+	it->end = 0;
+	it->next = -1;
+	if (0 == cr && sorted_valid(it->owner)) {
+		if (next < 0) {
+			next = (NULL == from) ? 0
+				: sorted_from(it->owner, from, NULL != b.after);
+		}
+		if (next < 0) cr = -1;
+		else sorted_batch(it, (size_t)next);
+	}
+	else if (0 == cr) {
+		cr = RBforeach_range(tree, from, NULL, batch_key, &b);
+		// the walk ended before the batch was full
+		if (0 == cr) it->end = 1;
+		it->owner->walked += it->n;
+	}
+	Py_CLEAR(it->pinned);
+	return (b.err || cr < 0) ? -1 : 0;
+}
+
+static PyObject* iterator_next(Iterator* it) {
+	if (it->n < 0) return NULL;
+	// a batch read before the tree changed may hold removed keys
+	if (it->pos == it->n || it->mods != it->owner->tree.mods) {
+		if ((it->pos == it->n && it->end && it->mods == it->owner->tree.mods)
+			|| iterator_read(it) || 0 == it->n) {
+			iterator_end(it);
+			return NULL;
+		}
+	}
+	PyObject* key = it->keys[it->pos++];
+	Py_INCREF(key);
+	return key;
+}
+
+// Writes a key as the i-th double of a buffer
+static void put_double(char* buf, size_t i, PyObject* key) {
+	double v = PyFloat_Check(key) ? PyFloat_AS_DOUBLE(key)
+		: PyLong_AsDouble(key);
+	memcpy(buf + i * sizeof(v), &v, sizeof(v));
+}
+
+/*
+ * Exports the keys of a range as a read only memoryview of 64 bits ints
+ * (format 'q') if they are all ints or of doubles (format 'd') if they are
+ * ints and floats. The keys are read from the sorted keys of the container
+ * if they are those of the tree, or with a walk which ends at the first key
+ * from hi, recognized by its address, and converted in a single pass.
+ */
+static PyObject* container_range_buffer(Container* self, PyObject* args,
+		PyObject* kwds) {
+	static char* kwlist[] = { "lo", "hi", NULL };
+	PyObject* lo = NULL;
+	PyObject* hi = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO", kwlist, &lo, &hi)) {
+		return NULL;
+	}
+	lo = bound(lo);
+	hi = bound(hi);
+	lay_out(self);
+	struct range_ctx r = { NULL, 0, 0, NULL };
+	PyObject** keys;
+	size_t n;
+	if (sorted_valid(self)) {
+		Py_ssize_t i = (NULL == lo) ? 0 : sorted_from(self, lo, 0);
+		Py_ssize_t j = (NULL == hi) ? (Py_ssize_t)self->tree.count
+			: sorted_from(self, hi, 0);
+		if (i < 0 || j < 0) return NULL;
+		keys = self->sorted + i;
+		n = (j > i) ? (size_t)(j - i) : 0;
+	}
+	else {
+		if (NULL != hi && first_from(&self->tree, hi, &r.stop)) return NULL;
+		if (RBforeach_range(&self->tree, lo, NULL, collect_key, &r) < 0) {
+			PyMem_Free(r.keys);
+			if (!PyErr_Occurred()) PyErr_NoMemory();
+			return NULL;
+		}
+		self->walked += r.n;
+		keys = r.keys;
+		n = r.n;
+	}
+	PyObject* bytes = PyBytes_FromStringAndSize(NULL,
+		(Py_ssize_t)(n * sizeof(int64_t)));
+	if (NULL == bytes) {
+		PyMem_Free(r.keys);
+		return NULL;
+	}
+	char* buf = PyBytes_AS_STRING(bytes);
+	int ints = 1;
+	size_t overflow = n;	// the first int too large for 64 bits
+	for (size_t i = 0; i < n && !PyErr_Occurred(); i++) {
+		if (ints && PyLong_Check(keys[i])) {
+			int o;
+			int64_t v = PyLong_AsLongLongAndOverflow(keys[i], &o);
+			if (o && overflow == n) overflow = i;
+			memcpy(buf + i * sizeof(v), &v, sizeof(v));
+		}
+		else if (!PyLong_Check(keys[i]) && !PyFloat_Check(keys[i])) {
+			PyErr_SetString(PyExc_TypeError,
+				"only int and float keys can be exported");
+		}
+		else {
+			// the ints before the first float become doubles too
+			for (size_t j = 0; j < i && ints; j++) put_double(buf, j, keys[j]);
+			ints = 0;
+			put_double(buf, i, keys[i]);
+		}
+	}
+	// raises the OverflowError of the int
+	if (!PyErr_Occurred() && ints && overflow < n) {
+		PyLong_AsLongLong(keys[overflow]);
+	}
+	PyMem_Free(r.keys);
+	if (PyErr_Occurred()) {
+		Py_DECREF(bytes);
+		return NULL;
+	}
+	PyObject* view = PyMemoryView_FromObject(bytes);
+	Py_DECREF(bytes);
+	if (NULL == view) return NULL;
+	PyObject* typed = PyObject_CallMethod(view, "cast", "s", ints ? "q" : "d");
+	Py_DECREF(view);
+	return typed;
+}
+
+/* SortedSet */
+
+static PyObject* set_add(Container* self, PyObject* key) {
+	if (put(self, key, NULL)) return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject* set_discard(Container* self, PyObject* key) {
+	PyObject* old;
+	int cr = take(self, key, &old);
+	if (cr < 0) return NULL;
+	if (cr > 0) Py_DECREF(old);
+	Py_RETURN_NONE;
+}
+
+static PyObject* set_remove(Container* self, PyObject* key) {
+	PyObject* old;
+	int cr = take(self, key, &old);
+	if (cr < 0) return NULL;
+	if (0 == cr) {
+		PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+	Py_DECREF(old);
+	Py_RETURN_NONE;
+}
+
+// Tells for every key of an iterable whether it is in the set
+static PyObject* set_find_many(Container* self, PyObject* keys) {
+	PyObject* seq = PySequence_Fast(keys, "find_many expects an iterable");
+	if (NULL == seq) return NULL;
+	Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+	PyObject* result = PyList_New(n);
+	for (Py_ssize_t i = 0; NULL != result && i < n; i++) {
+		PyObject* key = PySequence_Fast_GET_ITEM(seq, i);
+		int in = container_contains(self, key);
+		if (in < 0) Py_CLEAR(result);
+		else PyList_SET_ITEM(result, i, PyBool_FromLong(in));
+	}
+	Py_DECREF(seq);
+	return result;
+}
+
+static PyObject* container_repr(Container* self) {
+	const char* name = Py_TYPE(self)->tp_name;
+	const char* dot = strrchr(name, '.');
+	if (NULL != dot) name = dot + 1;
+	int rec = Py_ReprEnter((PyObject*)self);
+	if (rec) return (rec > 0) ? PyUnicode_FromFormat("%s(...)", name) : NULL;
+	PyObject* content;
+	if (self->map) {
+		PyObject* dict = PyDict_New();
+		PyObject* items = NULL;
+		if (NULL != dict) {
+			items = PyObject_CallMethod((PyObject*)self, "items", NULL);
+		}
+		content = NULL;
+		if (NULL != items && 0 == PyDict_MergeFromSeq2(dict, items, 1)) {
+			content = PyObject_Repr(dict);
+		}
+		Py_XDECREF(items);
+		Py_XDECREF(dict);
+	}
+	else {
+		PyObject* list = PySequence_List((PyObject*)self);
+		content = (NULL == list) ? NULL : PyObject_Repr(list);
+		Py_XDECREF(list);
+	}
+	Py_ReprLeave((PyObject*)self);
+	if (NULL == content) return NULL;
+	PyObject* repr = PyUnicode_FromFormat("%s(%U)", name, content);
+	Py_DECREF(content);
+	return repr;
+}
+
+static PySequenceMethods set_as_sequence = {
+	.sq_length = (lenfunc)container_len,
+	.sq_contains = (objobjproc)container_contains,
+};
+
+static PyMethodDef set_methods[] = {
+	{ "add", (PyCFunction)set_add, METH_O, "Adds a key." },
+	{ "discard", (PyCFunction)set_discard, METH_O,
+		"Removes a key if it is there." },
+	{ "remove", (PyCFunction)set_remove, METH_O,
+		"Removes a key, raising KeyError if it is not there." },
+	{ "clear", (PyCFunction)container_clear_method, METH_NOARGS,
+		"Removes all the keys." },
+	{ "update", (PyCFunction)container_update, METH_O,
+		"Adds the keys of an iterable in a single batch." },
+	{ "find_many", (PyCFunction)set_find_many, METH_O,
+		"Tells for every key of an iterable whether it is in the set." },
+	{ "irange", (PyCFunction)(void (*)(void))container_irange,
+		METH_VARARGS | METH_KEYWORDS,
+		"Iterates in order over the keys k with lo <= k < hi." },
+	{ "range_buffer", (PyCFunction)(void (*)(void))container_range_buffer,
+		METH_VARARGS | METH_KEYWORDS,
+		"Exports the keys k with lo <= k < hi as a memoryview of int64 "
+		"('q') or double ('d')." },
+	{ "__sizeof__", (PyCFunction)container_sizeof, METH_NOARGS,
+		"Gives the bytes used by the container, without its keys and "
+		"values." },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyTypeObject SortedSetType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "crbtree.SortedSet",
+	.tp_doc = "SortedSet(iterable=None): a set iterated in key order.",
+	.tp_basicsize = sizeof(Container),
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+	.tp_new = container_new,
+	.tp_init = (initproc)container_init,
+	.tp_dealloc = (destructor)container_dealloc,
+	.tp_traverse = (traverseproc)container_traverse,
+	.tp_clear = (inquiry)container_clear,
+	.tp_hash = PyObject_HashNotImplemented,
+	.tp_repr = (reprfunc)container_repr,
+	.tp_iter = (getiterfunc)container_iter,
+	.tp_as_sequence = &set_as_sequence,
+	.tp_methods = set_methods,
+};
+
+/* SortedDict */
+
+static PyObject* dict_subscript(Container* self, PyObject* key) {
+	void** slot = find_slot(self, key);
+	if (NULL == slot) {
+		if (!PyErr_Occurred()) PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+	Py_INCREF((PyObject*)*slot);
+	return *slot;
+}
+
+static int dict_ass_subscript(Container* self, PyObject* key,
+		PyObject* value) {
+	if (NULL != value) return put(self, key, value);
+	PyObject* old;
+	int cr = take(self, key, &old);
+	if (0 == cr) PyErr_SetObject(PyExc_KeyError, key);
+	if (cr <= 0) return -1;
+	Py_DECREF(old);
+	return 0;
+}
+
+/*
+ * Checks the arguments of a method taking a key and an optional default,
+ * which are passed without a tuple (METH_FASTCALL) as it is called often.
+ * Returns 0 or -1 with an exception.
+ */
+static int key_args(const char* name, Py_ssize_t nargs) {
+	if (1 == nargs || 2 == nargs) return 0;
+	PyErr_Format(PyExc_TypeError, "%s expected 1 or 2 arguments, got %zd",
+		name, nargs);
+	return -1;
+}
+
+static PyObject* dict_get(Container* self, PyObject* const* args,
+		Py_ssize_t nargs) {
+	if (key_args("get", nargs)) return NULL;
+	PyObject* key = args[0];
+	PyObject* dflt = (2 == nargs) ? args[1] : Py_None;
+	void** slot = find_slot(self, key);
+	if (NULL == slot && PyErr_Occurred()) return NULL;
+	PyObject* value = (NULL == slot) ? dflt : *slot;
+	Py_INCREF(value);
+	return value;
+}
+
+static PyObject* dict_pop(Container* self, PyObject* const* args,
+		Py_ssize_t nargs) {
+	if (key_args("pop", nargs)) return NULL;
+	PyObject* key = args[0];
+	PyObject* dflt = (2 == nargs) ? args[1] : NULL;
+	PyObject* value;
+	int cr = take(self, key, &value);
+	if (cr < 0) return NULL;
+	if (cr > 0) return value;
+	if (NULL == dflt) {
+		PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+	Py_INCREF(dflt);
+	return dflt;
+}
+
+// Gives the values of the keys of an iterable, or default for missing keys
+static PyObject* dict_find_many(Container* self, PyObject* args) {
+	PyObject* keys;
+	PyObject* dflt = Py_None;
+	if (!PyArg_UnpackTuple(args, "find_many", 1, 2, &keys, &dflt)) {
+		return NULL;
+	}
+	PyObject* seq = PySequence_Fast(keys, "find_many expects an iterable");
+	if (NULL == seq) return NULL;
+	Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+	PyObject* result = PyList_New(n);
+	for (Py_ssize_t i = 0; NULL != result && i < n; i++) {
+		PyObject* key = PySequence_Fast_GET_ITEM(seq, i);
+		void** slot = find_slot(self, key);
+		if (NULL == slot && PyErr_Occurred()) {
+			Py_CLEAR(result);
+			break;
+		}
+		PyObject* value = (NULL == slot) ? dflt : *slot;
+		Py_INCREF(value);
+		PyList_SET_ITEM(result, i, value);
+	}
+	Py_DECREF(seq);
+	return result;
+}
+
+// What the nodes give to the lists of keys, values or items
+enum { LIST_KEYS, LIST_VALUES, LIST_ITEMS };
+
+struct list_ctx {
+	PyObject* list;
+	Py_ssize_t n;
+	int what;
+};
+
+static int list_node(void* data, void** slot, void* ctx) {
+	struct list_ctx* l = ctx;
+	PyObject* key = data;
+	PyObject* value = *slot;
+	PyObject* item;
+	if (LIST_ITEMS == l->what) {
+		item = PyTuple_Pack(2, key, value);
+		if (NULL == item) return -1;
+	}
+	else {
+		item = (LIST_KEYS == l->what) ? key : value;
+		Py_INCREF(item);
+	}
+	PyList_SET_ITEM(l->list, l->n++, item);
+	return 0;
+}
+
+static PyObject* dict_list(Container* self, int what) {
+	struct list_ctx l = { PyList_New((Py_ssize_t)self->tree.count), 0, what };
+	if (NULL == l.list) return NULL;
+	if (RBforeach_kv(&self->tree, list_node, &l)) Py_CLEAR(l.list);
+	return l.list;
+}
+
+static PyObject* dict_keys(Container* self, PyObject* unused) {
+	(void)unused;
+	return dict_list(self, LIST_KEYS);
+}
+
+static PyObject* dict_values(Container* self, PyObject* unused) {
+	(void)unused;
+	return dict_list(self, LIST_VALUES);
+}
+
+static PyObject* dict_items(Container* self, PyObject* unused) {
+	(void)unused;
+	return dict_list(self, LIST_ITEMS);
+}
+
+static PyMappingMethods dict_as_mapping = {
+	.mp_length = (lenfunc)container_len,
+	.mp_subscript = (binaryfunc)dict_subscript,
+	.mp_ass_subscript = (objobjargproc)dict_ass_subscript,
+};
+
+static PySequenceMethods dict_as_sequence = {
+	.sq_contains = (objobjproc)container_contains,
+};
+
+static PyMethodDef dict_methods[] = {
+	{ "get", (PyCFunction)(void (*)(void))dict_get, METH_FASTCALL,
+		"Gives the value of a key or default if it is not there." },
+	{ "pop", (PyCFunction)(void (*)(void))dict_pop, METH_FASTCALL,
+		"Removes a key and gives its value or default if it is not there." },
+	{ "clear", (PyCFunction)container_clear_method, METH_NOARGS,
+		"Removes all the keys." },
+	{ "update", (PyCFunction)container_update, METH_O,
+		"Sets the keys of a mapping or of (key, value) pairs in a single "
+		"batch." },
+	{ "find_many", (PyCFunction)dict_find_many, METH_VARARGS,
+		"Gives the values of the keys of an iterable, or default for the "
+		"missing ones." },
+	{ "keys", (PyCFunction)dict_keys, METH_NOARGS,
+		"Gives the list of the keys in order." },
+	{ "values", (PyCFunction)dict_values, METH_NOARGS,
+		"Gives the list of the values in key order." },
+	{ "items", (PyCFunction)dict_items, METH_NOARGS,
+		"Gives the list of the (key, value) pairs in key order." },
+	{ "irange", (PyCFunction)(void (*)(void))container_irange,
+		METH_VARARGS | METH_KEYWORDS,
+		"Iterates in order over the keys k with lo <= k < hi." },
+	{ "range_buffer", (PyCFunction)(void (*)(void))container_range_buffer,
+		METH_VARARGS | METH_KEYWORDS,
+		"Exports the keys k with lo <= k < hi as a memoryview of int64 "
+		"('q') or double ('d')." },
+	{ "__sizeof__", (PyCFunction)container_sizeof, METH_NOARGS,
+		"Gives the bytes used by the container, without its keys and "
+		"values." },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyTypeObject SortedDictType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "crbtree.SortedDict",
+	.tp_doc = "SortedDict(iterable=None): a dict iterated in key order.",
+	.tp_basicsize = sizeof(Container),
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+	.tp_new = container_new,
+	.tp_init = (initproc)container_init,
+	.tp_dealloc = (destructor)container_dealloc,
+	.tp_traverse = (traverseproc)container_traverse,
+	.tp_clear = (inquiry)container_clear,
+	.tp_hash = PyObject_HashNotImplemented,
+	.tp_repr = (reprfunc)container_repr,
+	.tp_iter = (getiterfunc)container_iter,
+	.tp_as_mapping = &dict_as_mapping,
+	.tp_as_sequence = &dict_as_sequence,
+	.tp_methods = dict_methods,
+};
+
+static PyTypeObject IteratorType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "crbtree.Iterator",
+	.tp_doc = "Iterator over the keys of a SortedSet or SortedDict, which "
+		"goes on after the container changed.",
+	.tp_basicsize = sizeof(Iterator),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc = (destructor)iterator_dealloc,
+	.tp_iter = PyObject_SelfIter,
+	.tp_iternext = (iternextfunc)iterator_next,
+};
+
+static PyObject* version(PyObject* module, PyObject* unused) {
+	(void)module;
+	(void)unused;
+	const unsigned char* v = RBversion();
+	return PyUnicode_FromFormat("%d.%d.%d", v[0], v[1], v[2]);
+}
+
+static PyMethodDef module_methods[] = {
+	{ "version", version, METH_NOARGS, "Gives the version of the library." },
+	{ NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "crbtree",
+	.m_doc = "Sorted containers built on the CRBTree library.",
+	.m_size = -1,
+	.m_methods = module_methods,
+};
+
+PyMODINIT_FUNC PyInit_crbtree(void) {
+	if (PyType_Ready(&SortedSetType) || PyType_Ready(&SortedDictType)
+		|| PyType_Ready(&IteratorType)) {
+		return NULL;
+	}
+	PyObject* m = PyModule_Create(&module);
+	if (NULL == m) return NULL;
+	Py_INCREF(&SortedSetType);
+	Py_INCREF(&SortedDictType);
+	if (PyModule_AddObject(m, "SortedSet", (PyObject*)&SortedSetType)
+		|| PyModule_AddObject(m, "SortedDict", (PyObject*)&SortedDictType)) {
+		Py_DECREF(&SortedSetType);
+		Py_DECREF(&SortedDictType);
+		Py_DECREF(m);
+		return NULL;
+	}
+	return m;
+}
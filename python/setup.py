@@ -0,0 +1,24 @@
+"""Builds the crbtree extension: python setup.py build_ext --inplace"""
+
+import glob
+import os
+
+from setuptools import Extension, setup
+
+here = os.path.dirname(os.path.abspath(__file__))
+lib = os.path.join(os.path.dirname(here), "rbtree")
+
+setup(
+	name="crbtree",
+	version="1.0",
+	description="Sorted containers built on the CRBTree library",
+	ext_modules=[
+		Extension(
+			"crbtree",
+			sources=["crbtree.c"] + sorted(
+				os.path.relpath(f, here) for f in glob.glob(os.path.join(lib, "*.c"))),
+			include_dirs=[lib],
+			define_macros=[("RBTREE_STATIC", None)],
+		)
+	],
+)
@@ -0,0 +1,328 @@
+"""Tests of the crbtree extension against the builtin set and dict."""
+
+import gc
+import random
+import sys
+import weakref
+
+import pytest
+
+import crbtree
+from crbtree import SortedDict, SortedSet
+
+
+class Key:
+	"""A key compared through Python, without any fast path"""
+
+	def __init__(self, k):
+		self.k = k
+
+	def __lt__(self, other):
+		return self.k < other.k
+
+	def __gt__(self, other):
+		return self.k > other.k
+
+	def __eq__(self, other):
+		return self.k == other.k
+
+	def __hash__(self):
+		return hash(self.k)
+
+
+def test_version():
+	assert crbtree.version().count(".") == 2
+
+
+@pytest.mark.parametrize("make", [int, float, str, Key, lambda k: (k % 7, k)])
+def test_set_random(make):
+	rg = random.Random(0)
+	s, ref = SortedSet(), set()
+	for _ in range(5000):
+		k = make(rg.randrange(300))
+		op = rg.randrange(3)
+		if op == 0:
+			s.add(k)
+			ref.add(k)
+		elif op == 1:
+			s.discard(k)
+			ref.discard(k)
+		else:
+			assert (k in s) == (k in ref)
+	assert len(s) == len(ref)
+	assert list(s) == sorted(ref)
+
+
+@pytest.mark.parametrize("make", [int, float, str, Key])
+def test_dict_random(make):
+	rg = random.Random(1)
+	d, ref = SortedDict(), {}
+	for i in range(5000):
+		k = make(rg.randrange(300))
+		op = rg.randrange(4)
+		if op == 0:
+			d[k] = ref[k] = i
+		elif op == 1:
+			assert d.pop(k, None) == ref.pop(k, None)
+		elif op == 2:
+			assert d.get(k) == ref.get(k)
+		else:
+			assert (k in d) == (k in ref)
+	assert len(d) == len(ref)
+	assert d.items() == sorted(ref.items())
+	assert d.keys() == sorted(ref)
+	assert d.values() == [v for _, v in sorted(ref.items())]
+
+
+def test_mixed_numbers():
+	s = SortedSet([2**70, -(2**70), 1.5, 1, True, -0.0, 0])
+	assert list(s) == [-(2**70), -0.0, 1, 1.5, 2**70]
+	assert 1.0 in s and 0 in s
+
+
+def test_kinds():
+	# the abbreviated keys order the strs like their code points
+	words = ["", "a", "a\0", "ab", "é", "\uffff", "\U0001f600", "abcdefghij",
+		"abcdefghik", "abcdefgh"]
+	s = SortedSet(words)
+	assert list(s) == sorted(words)
+	for w in words:
+		assert w in s
+	# keys of another kind drop the abbreviated keys
+	d = SortedDict((k, k) for k in range(100))
+	d[True] = "t"
+	d[2**70] = 0
+	assert d[1] == "t" and len(d) == 101
+	assert d.keys() == sorted(list(range(100)) + [2**70])
+	n = SortedSet([0.5, 2, -0.0])
+	assert 0 in n and float("-inf") not in n
+	n.update([1.5, 2**64, 3])
+	assert list(n) == [-0.0, 0.5, 1.5, 2, 3, 2**64]
+	n.clear()
+	n.update(["b", "a"])
+	assert list(n) == ["a", "b"]
+
+
+def test_errors():
+	s = SortedSet([1, 2])
+	with pytest.raises(TypeError):
+		s.add("a")
+	with pytest.raises(TypeError):
+		"a" in s
+	with pytest.raises(KeyError):
+		s.remove(3)
+	assert list(s) == [1, 2]
+	d = SortedDict({1: 1})
+	with pytest.raises(KeyError):
+		d[2]
+	with pytest.raises(KeyError):
+		del d[2]
+	with pytest.raises(TypeError):
+		d["a"] = 1
+	with pytest.raises(TypeError):
+		d.update([1, 2])
+	with pytest.raises(TypeError):
+		hash(s)
+	assert d.items() == [(1, 1)]
+
+
+def test_existing_key_kept():
+	a, b = Key(1), Key(1)
+	s = SortedSet([a])
+	s.add(b)
+	assert next(iter(s)) is a
+	d = SortedDict()
+	d[a] = 1
+	d[b] = 2
+	assert d.keys()[0] is a and d[a] == 2
+
+
+@pytest.mark.parametrize("size", [0, 10, 10000])
+@pytest.mark.parametrize("batch", [1, 50, 20000])
+def test_update(size, batch):
+	rg = random.Random(size + batch)
+	d, ref = SortedDict(), {}
+	for k in rg.sample(range(50000), size):
+		d[k] = ref[k] = "old"
+	pairs = [(rg.randrange(50000), i) for i in range(batch)]
+	d.update(pairs)
+	ref.update(pairs)
+	assert d.items() == sorted(ref.items())
+	d.update({k: v for k, v in pairs})
+	assert d.items() == sorted(ref.items())
+	s = SortedSet(ref)
+	keys = [k for k, _ in pairs]
+	s.update(keys)
+	assert list(s) == sorted(ref)
+
+
+def test_find_many():
+	s = SortedSet(range(0, 100, 2))
+	assert s.find_many([0, 1, 98, 99]) == [True, False, True, False]
+	d = SortedDict((k, str(k)) for k in range(10))
+	assert d.find_many([3, 11, 5]) == ["3", None, "5"]
+	assert d.find_many([11], 0) == [0]
+	with pytest.raises(TypeError):
+		d.find_many(["a"])
+
+
+def test_lookups_leave_tree():
+	# keys of another kind are searched without rebuilding the tree
+	s = SortedSet(range(100))
+	d = SortedDict((k, str(k)) for k in range(100))
+	sizes = sys.getsizeof(s), sys.getsizeof(d)
+	nan = float("nan")
+	assert True in s and 2**70 not in s and nan not in s
+	assert s.find_many([True, 2**70, 5]) == [True, False, True]
+	with pytest.raises(TypeError):
+		"x" in s
+	assert d.get(True) == "1" and d.get(2**70) is None and d.get(nan) is None
+	assert d[True] == "1" and d.find_many([2**70, 3]) == [None, "3"]
+	assert list(s.irange(True, 2**70)) == list(range(1, 100))
+	s.discard(2**70)
+	d.pop(nan, None)
+	assert (sys.getsizeof(s), sys.getsizeof(d)) == sizes
+	# the key equal to a key of another kind is removed
+	s.discard(True)
+	assert 1 not in s and len(s) == 99
+	assert d.pop(True) == "1" and 1 not in d
+
+
+def test_exact_batches():
+	# the ints too large for a double are sorted by comparison
+	s = SortedSet([2**53 + 1, 2**53, 2**53 + 1, 0.5, 2**53])
+	assert list(s) == [0.5, 2**53, 2**53 + 1]
+	d = SortedDict([(0, "a"), (-0.0, "b"), (1.0, "c"), (1, "d")])
+	assert d.items() == [(0, "b"), (1.0, "d")]
+	assert type(d.keys()[0]) is int
+
+
+def test_irange():
+	s = SortedSet(range(0, 100, 3))
+	assert list(s.irange(10, 20)) == [12, 15, 18]
+	assert list(s.irange(hi=7)) == [0, 3, 6]
+	assert list(s.irange(lo=95)) == [96, 99]
+	assert list(s.irange(50, 10)) == []
+	assert list(s.irange(200)) == []
+	# the first key from hi may change during the iteration
+	it = s.irange(10, 20)
+	assert next(it) == 12
+	s.discard(21)
+	s.add(19.5)
+	assert list(it) == [15, 18, 19.5]
+	s.add(20)
+	assert list(s.irange(19, 20)) == [19.5]
+	d = SortedDict((k, 0) for k in range(5))
+	assert list(d.irange(None, 3)) == [0, 1, 2]
+
+
+def test_iteration_during_changes():
+	s = SortedSet(range(0, 1000, 2))
+	seen = []
+	for k in s:
+		seen.append(k)
+		if k % 10 == 0:
+			s.discard(k + 2)
+			s.add(k + 3)
+	assert seen == sorted(seen)
+	assert 2 not in seen and 3 in seen
+	d = SortedDict((k, k) for k in range(10))
+	it = iter(d)
+	assert next(it) == 0
+	d.clear()
+	d[5] = 5
+	assert list(it) == [5]
+
+
+def test_range_buffer():
+	s = SortedSet([5, -3, 2**40, 7])
+	view = s.range_buffer()
+	assert view.format == "q" and view.readonly
+	assert view.tolist() == [-3, 5, 7, 2**40]
+	assert s.range_buffer(0, 7).tolist() == [5]
+	f = SortedSet([1, 0.5])
+	assert f.range_buffer().format == "d"
+	assert f.range_buffer().tolist() == [0.5, 1.0]
+	with pytest.raises(TypeError):
+		SortedSet(["a"]).range_buffer()
+	with pytest.raises(OverflowError):
+		SortedSet([2**70]).range_buffer()
+	assert SortedSet([2**70, 0.5]).range_buffer().tolist() == [0.5, 2.0**70]
+
+
+def test_repeated_walks():
+	# the walks of a large container end up reading a sorted copy of its keys
+	rg = random.Random(3)
+	keys = rg.sample(range(100000), 5000)
+	s = SortedSet()
+	for k in keys:
+		s.add(k)
+	expected = sorted(keys)
+	for _ in range(3):
+		assert list(s) == expected
+		assert list(s.irange(20000, 60000)) == [
+			k for k in expected if 20000 <= k < 60000]
+		assert s.range_buffer(None, 50000).tolist() == [
+			k for k in expected if k < 50000]
+	# the copy is dropped once the container changes, even in an iteration
+	removed, added = expected[101], expected[102] + 1
+	seen = []
+	for k in s:
+		seen.append(k)
+		if k == expected[100]:
+			s.discard(removed)
+			s.add(added)
+	assert seen == sorted(seen)
+	assert removed not in seen and added in seen
+	assert list(s) == sorted(set(expected) - {removed} | {added})
+	with pytest.raises(TypeError):
+		next(s.irange("a"))
+
+
+def test_refcounts():
+	key, value = Key(0), object()
+	k0, v0 = sys.getrefcount(key), sys.getrefcount(value)
+	d = SortedDict()
+	d.update([(Key(1), value)])
+	s = SortedSet()
+	s.add(key)
+	d[Key(2)] = value
+	d[Key(2)] = value
+	assert sys.getrefcount(value) == v0 + 2
+	assert sys.getrefcount(key) == k0 + 1
+	d.update([(Key(1), key), (Key(3), key)])
+	assert sys.getrefcount(value) == v0 + 1
+	del d[Key(2)]
+	assert sys.getrefcount(value) == v0
+	s.discard(key)
+	d.clear()
+	assert sys.getrefcount(key) == k0
+
+
+def test_cycles():
+	class Value:
+		pass
+
+	d = SortedDict()
+	v = Value()
+	v.d = d
+	d[1] = v
+	ref = weakref.ref(v)
+	del d, v
+	gc.collect()
+	assert ref() is None
+
+
+def test_repr():
+	assert repr(SortedSet([2, 1])) == "SortedSet([1, 2])"
+	d = SortedDict()
+	d[1] = d
+	assert repr(d) == "SortedDict({1: SortedDict(...)})"
+
+
+def test_subclass():
+	class Dict(SortedDict):
+		pass
+
+	d = Dict([(2, "b"), (1, "a")])
+	assert d.keys() == [1, 2] and d[1] == "a"
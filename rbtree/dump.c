@@ -1,5 +1,5 @@
-#ifndef EXPORT
-#define EXPORT __declspec(dllexport)
+#ifndef RBTREE_BUILD
+#define RBTREE_BUILD
 #endif
 
 #include <stdio.h>
@@ -74,7 +74,7 @@ int RBdump(RBTree* tree, size_t elt_width, void(*dump)(void*, char*)) {
 	qsort(list.elt, list.count,
 		sizeof(*list.elt), cmp);
 	size_t depth = -1;
-	int curpos;
+	int curpos = 0;
 	for (size_t i = 0; i < list.count; i++) {
 		if (list.elt[i].depth != depth) {
 			fprintf(stderr, "\n");
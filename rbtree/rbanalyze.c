@@ -0,0 +1,166 @@
+#ifndef RBTREE_BUILD
+#define RBTREE_BUILD
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rbtree.h"
+#include "rbinternal.h"
+
+#define LABEL_SIZE 256
+#define CACHE_LINE 64
+#define PAGE_SIZE 4096
+
+struct frame {
+	const RBNode* node;
+	int depth;
+	int side;	// next child to visit, 2 once both are
+	size_t id;	// preorder rank, naming the node in the DOT output
+};
+
+// Writes a label as a quoted string, escaped for both DOT and JSON
+static void write_label(FILE* out, const char* label) {
+	fputc('"', out);
+	for (const unsigned char* c = (const unsigned char*)label; *c; c++) {
+		if ('"' == *c || '\\' == *c) fprintf(out, "\\%c", *c);
+		else if (*c < 0x20) fprintf(out, "\\u%04x", *c);
+		else fputc(*c, out);
+	}
+	fputc('"', out);
+}
+
+static void write_node(const RBTree* tree, FILE* out, int format,
+		const RBNode* node, size_t id,
+		void (*label)(const void*, char*, size_t)) {
+	char buf[LABEL_SIZE];
+	if (NULL != label) {
+		label(node->data, buf, sizeof(buf));
+		buf[sizeof(buf) - 1] = '\0';
+	}
+	else snprintf(buf, sizeof(buf), "%p", node->data);
+	// the nodes of the other trees hold a rank instead of a color
+	int red = (RB_BALANCE_RB == tree->balance) && node->red;
+	if (RB_ANALYZE_DOT == format) {
+		fprintf(out, "\tn%zu [label=", id);
+		write_label(out, buf);
+		fprintf(out, ", fillcolor=%s", red ? "red" : "black");
+		if (RB_BALANCE_RB != tree->balance) {
+			fprintf(out, ", xlabel=%d", node->red);
+		}
+		fprintf(out, "%s];\n",
+			node->dead ? ", style=\"filled,dashed\", fontcolor=gray" : "");
+	}
+	else {
+		fputs("{\"label\": ", out);
+		write_label(out, buf);
+		if (RB_BALANCE_RB != tree->balance) {
+			fprintf(out, ", \"rank\": %d", node->red);
+		}
+		else fprintf(out, ", \"red\": %s", red ? "true" : "false");
+		fprintf(out, ", \"dead\": %s", node->dead ? "true" : "false");
+	}
+}
+
+// Accounts for a node at depth and for the link from its parent
+static void account(const RBTree* tree, RBReport* report, const RBNode* node,
+		int depth, const RBNode* parent) {
+	report->nodes += 1;
+	report->red += (RB_BALANCE_RB == tree->balance && node->red) ? 1 : 0;
+	report->dead += node->dead ? 1 : 0;
+	if (depth + 1 > report->height) report->height = depth + 1;
+	report->levels[depth < RB_REPORT_LEVELS ? depth : RB_REPORT_LEVELS - 1]
+		+= 1;
+	report->avg_path += depth + 1;
+	if (NULL == parent) return;
+	uintptr_t a = (uintptr_t)parent, b = (uintptr_t)node;
+	uintptr_t distance = (a > b) ? a - b : b - a;
+	int log = 0;
+	while (distance >> (log + 1)) log += 1;
+	report->distances[log] += 1;
+	if (a / CACHE_LINE == b / CACHE_LINE) report->same_line += 1;
+	if (a / PAGE_SIZE == b / PAGE_SIZE) report->same_page += 1;
+}
+
+/**
+ * @brief Reports the shape and memory locality of a tree.
+ *
+ * A single depth first walk, using no memory beyond a fixed stack, counts
+ * the nodes per depth and their colors, and compares the average and
+ * longest search paths with those of a perfectly balanced tree. The memory
+ * locality is given by the distribution of the distances between the
+ * addresses of parents and children: links spanning pages cost a cache and
+ * often a TLB miss to every search going through them, which tells when
+ * RBcompact is worth it. The same walk can write the tree to out, either as
+ * a Graphviz digraph or as nested JSON objects with the members label, red
+ * (rank for AVL and WAVL trees), dead, left and right, without holding it in
+ * memory.
+ *
+ * @param tree : the tree to analyze
+ * @param report : the structure receiving the figures
+ * @param out : an optional stream receiving the tree
+ * @param format : RB_ANALYZE_DOT or RB_ANALYZE_JSON if out is not NULL
+ * @param label : an optional function writing the label of an element as
+ *                label(element, buffer, size), the address of the element
+ *                being used otherwise (labels are truncated to 255 bytes)
+ * @return : 0 on success or -1 if format is invalid or out had an error
+*/
+int RBanalyze(RBTree* tree, RBReport* report, FILE* out, int format,
+		void (*label)(const void*, char*, size_t)) {
+	if (NULL != out && RB_ANALYZE_DOT != format && RB_ANALYZE_JSON != format) {
+		return -1;
+	}
+	memset(report, 0, sizeof(*report));
+	struct frame stack[RB_MAX_DEPTH];
+	int depth = 0;
+	size_t id = 0;
+	if (NULL != out && RB_ANALYZE_DOT == format) {
+		fputs("digraph rbtree {\n\tnode [style=filled, fontcolor=white];\n",
+			out);
+	}
+	if (NULL != tree->root) {
+		account(tree, report, tree->root, 0, NULL);
+		if (NULL != out) write_node(tree, out, format, tree->root, id, label);
+		stack[depth++] = (struct frame){ tree->root, 0, 0, id++ };
+	}
+	else if (NULL != out && RB_ANALYZE_JSON == format) fputs("null", out);
+	while (depth > 0) {
+		struct frame* top = stack + depth - 1;
+		if (2 == top->side) {
+			if (NULL != out && RB_ANALYZE_JSON == format) fputc('}', out);
+			depth -= 1;
+			continue;
+		}
+		int side = top->side++;
+		const RBNode* child = top->node->child[side];
+		if (NULL != out && RB_ANALYZE_JSON == format) {
+			fputs(side ? ", \"right\": " : ", \"left\": ", out);
+			if (NULL == child) fputs("null", out);
+		}
+		if (NULL == child) continue;
+		account(tree, report, child, top->depth + 1, top->node);
+		if (NULL != out) {
+			if (RB_ANALYZE_DOT == format) {
+				fprintf(out, "\tn%zu -> n%zu [label=%s];\n", top->id, id,
+					side ? "R" : "L");
+			}
+			write_node(tree, out, format, child, id, label);
+		}
+		stack[depth++] = (struct frame){ child, top->depth + 1, 0, id++ };
+	}
+	if (NULL != out) fputs(RB_ANALYZE_DOT == format ? "}\n" : "\n", out);
+	if (report->nodes > 0) report->avg_path /= report->nodes;
+	// a perfectly balanced tree fills its levels one after the other
+	size_t left = report->nodes, width = 1;
+	while (left > 0) {
+		size_t n = (left < width) ? left : width;
+		report->min_height += 1;
+		report->min_avg_path += (double)n * report->min_height;
+		left -= n;
+		width *= 2;
+	}
+	if (report->nodes > 0) report->min_avg_path /= report->nodes;
+	return (NULL != out && ferror(out)) ? -1 : 0;
+}
@@ -0,0 +1,157 @@
+#ifndef RBTREE_BUILD
+#define RBTREE_BUILD
+#endif
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "rbtree.h"
+#include "rbinternal.h"
+
+/**
+ * @brief Augments an empty tree with an aggregate kept in every node.
+ *
+ * Every node then stores size bytes holding the aggregate of its subtree,
+ * computed by combine(aug, element, left, right, ctx) where left and right
+ * are the aggregates of the children or NULL for a missing child. combine
+ * must write the aggregate of the sequence left, element, right into aug,
+ * and should be associative (sum, min, max, count...) for RBaggregate_range
+ * to be meaningful. The aggregates are maintained by every operation
+ * changing the tree, at the price of a call of combine for every node on
+ * the path of an insertion or removal and 2 per rotation.
+ *
+ * @param tree : an empty tree initialized with RBinit or RBinit2
+ * @param size : the size of the aggregate stored in every node
+ * @param combine : the function computing the aggregate of a subtree
+ * @param ctx : an opaque pointer passed to every combine call
+ * @return : 0 on success or -1 if the tree is not empty or is intrusive
+*/
+int RBaugment(RBTree* tree, size_t size, void (*combine)(void*, const void*,
+		const void*, const void*, const void*), const void* ctx) {
+	if (NULL != tree->root || tree->intrusive) return -1;
+	tree->augsize = size;
+	tree->combine = combine;
+	tree->augctx = ctx;
+	return 0;
+}
+
+/*
+ * Folds, from the deepest one, the nodes of a path that are in a range
+ * bounded on one side: a node is combined with the fold of the nodes below
+ * it and, on the side of the range, the aggregate of its whole child.
+ * Returns the buffer holding the result or NULL if there is no node.
+ */
+static void* fold(const RBTree* tree, RBNode** nodes, int n, int side,
+		unsigned char* buf) {
+	void* acc = NULL;
+	for (int i = n - 1; i >= 0; i--) {
+		RBNode* node = nodes[i];
+		const void* whole = node->child[side] ? NODE_AUG(node->child[side])
+			: NULL;
+		void* out = buf + ((n - i) & 1) * tree->augsize;
+		if (side) tree->combine(out, node->data, acc, whole, tree->augctx);
+		else tree->combine(out, node->data, whole, acc, tree->augctx);
+		acc = out;
+	}
+	return acc;
+}
+
+/*
+ * Stacks the nodes below node that are on the in side of bound, which are
+ * the nodes of the range in that subtree which are not in a whole child.
+ * Returns their number or -1 on a comparison error.
+ */
+static int bounded_path(const RBTree* tree, RBNode* node, void* bound,
+		int in, RBNode** nodes) {
+	int n = 0, err = 0;
+	while (NULL != node) {
+		int cmp = tree->comperr(node->data, bound, &err, tree->comp);
+		STAT(comparisons, 1);
+		if (err) return -1;
+		// nodes with key >= lo (in = 1) or key < hi (in = 0) are in range
+		if ((cmp >= 0) == in) {
+			nodes[n++] = node;
+			node = node->child[!in];
+		}
+		else node = node->child[in];
+	}
+	return n;
+}
+
+/**
+ * @brief Computes the aggregate of the elements of a range of keys.
+ *
+ * The range contains the elements whose key is greater or equal to lo and
+ * lower than hi, a NULL lo (resp. hi) leaving it open at the beginning
+ * (resp. the end). Thanks to the aggregates kept in the nodes, the result
+ * is computed in O(log n) calls of combine, whatever the size of the range.
+ *
+ * @param tree : a tree augmented with RBaugment
+ * @param lo : the first key of the range or NULL
+ * @param hi : the key ending the range (excluded) or NULL
+ * @param out : a buffer receiving the aggregate of the range
+ * @return : 0 if out was set, 1 if the range is empty or -1 if the tree is
+ *           not augmented or the comparison function reported an error
+*/
+int RBaggregate_range(RBTree* tree, void* lo, void* hi, void* out) {
+	if (NULL == tree->combine) return -1;
+	RBNode* split = tree->root;
+	int err = 0;
+	// the highest node in the range splits it between its 2 subtrees
+	while (NULL != split) {
+		int side = -1;
+		if (NULL != lo) {
+			STAT(comparisons, 1);
+			if (tree->comperr(split->data, lo, &err, tree->comp) < 0) side = 1;
+		}
+		if (side < 0 && 0 == err && NULL != hi) {
+			STAT(comparisons, 1);
+			if (tree->comperr(split->data, hi, &err, tree->comp) >= 0) side = 0;
+		}
+		if (err) {
+			STAT_FLUSH(tree);
+			return -1;
+		}
+		if (side < 0) break;
+		split = split->child[side];
+	}
+	if (NULL == split) {
+		STAT_FLUSH(tree);
+		return 1;
+	}
+	RBNode* nodes[2][RB_MAX_DEPTH];
+	int n[2] = { 0, 0 };
+	const void* parts[2];
+	for (int i = 0; i < 2; i++) {
+		void* bound = i ? hi : lo;
+		if (NULL == bound) {
+			parts[i] = split->child[i] ? NODE_AUG(split->child[i]) : NULL;
+			continue;
+		}
+		n[i] = bounded_path(tree, split->child[i], bound, !i, nodes[i]);
+		if (n[i] < 0) {
+			STAT_FLUSH(tree);
+			return -1;
+		}
+	}
+	// 2 buffers per side for the partial folds
+	max_align_t local[16];
+	unsigned char* buf = (unsigned char*)local;
+	if (4 * tree->augsize > sizeof(local)) {
+		buf = malloc(4 * tree->augsize);
+		if (NULL == buf) {
+			STAT_FLUSH(tree);
+			return -1;
+		}
+	}
+	for (int i = 0; i < 2; i++) {
+		if (NULL != (i ? hi : lo)) {
+			parts[i] = fold(tree, nodes[i], n[i], !i,
+				buf + 2 * i * tree->augsize);
+		}
+	}
+	tree->combine(out, split->data, parts[0], parts[1], tree->augctx);
+	if (buf != (unsigned char*)local) free(buf);
+	STAT_FLUSH(tree);
+	return 0;
+}
@@ -0,0 +1,170 @@
+#ifndef RBTREE_BUILD
+#define RBTREE_BUILD
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rbtree.h"
+#include "rbinternal.h"
+
+// Levels laid out breadth first at the beginning of the block: every search
+// goes through them, so they share a few cache lines
+#define BFS_LEVELS 6
+
+/*
+ * Copies a node into the next slot of a block. The data of the old node is
+ * then replaced with the address of its copy, which allows the copies to be
+ * relinked once all nodes are copied.
+ */
+static void copy_node(const RBTree* tree, RBNode* node, unsigned char* base,
+		size_t* n) {
+	RBNode* copy = (RBNode*)(base + (*n)++ * SLOT_SIZE(tree));
+	memcpy(copy, node, NODE_SIZE(tree));
+	node->data = copy;
+}
+
+// Releases an old node once its copy is linked
+static void release(const RBTree* tree, const RBPool* pool, RBNode* node) {
+	if (NULL == pool || !IN_POOL(tree, pool, node)) {
+		free(node);
+		STAT(frees, 1);
+	}
+}
+
+/**
+ * @brief Moves the nodes of a tree into a contiguous block.
+ *
+ * After many insertions and removals, the nodes of a tree are scattered in
+ * the heap and every step of a search or of an iteration is likely to miss
+ * the cache. RBcompact copies them into a single new block: the 6 top levels
+ * first, breadth first, as every search goes through them, then every
+ * subtree below in key order, so that iterations read the block
+ * sequentially. The previous nodes are released and the nodes of a later
+ * removal are reused by the next insertions. The block of a tree with an
+ * arena (see RBpool) is a new arena with the same options, and the chunks
+ * of the previous one are released. Iterators on the tree become invalid.
+ * The expiry index, if any, is compacted too.
+ *
+ * @param tree : the tree to compact
+ * @return : 0 on success or -1 if the tree is intrusive or memory could not
+ *           be allocated, in which case the tree is unchanged
+*/
+int RBcompact(RBTree* tree) {
+	if (tree->intrusive) return -1;
+	if (NULL != tree->expiry && RBcompact(tree->expiry)) return -1;
+	size_t total = (size_t)tree->count + tree->dead;
+	// the block of a tree with an arena is cut from a new arena
+	int arena = NULL != tree->pool && tree->pool->arena;
+	RBPool* pool = arena
+		? pool_new(1, tree->pool->flags, tree->pool->nodes)
+		: pool_new(0, 0, 0);
+	if (NULL == pool) return -1;
+	unsigned char* base = NULL;
+	if (arena) base = pool_reserve(tree, pool, total);
+	else if (NULL != (base = malloc((total ? total : 1) * SLOT_SIZE(tree)))) {
+		pool->base = base;
+		pool->size = total;
+		STAT(allocs, 1);
+	}
+	if (NULL == base) {
+		pool_free(pool);
+		return -1;
+	}
+	size_t n = 0;
+	RBNode* level[2][1 << BFS_LEVELS];
+	int width = 0;
+	if (NULL != tree->root) level[0][width++] = tree->root;
+	for (int depth = 0; depth < BFS_LEVELS && width > 0; depth++) {
+		int next = 0;
+		for (int i = 0; i < width; i++) {
+			RBNode* node = level[depth & 1][i];
+			copy_node(tree, node, base, &n);
+			for (int side = 0; side < 2; side++) {
+				if (NULL != node->child[side]) {
+					level[!(depth & 1)][next++] = node->child[side];
+				}
+			}
+		}
+		width = next;
+	}
+	// the subtrees below the top levels are in key order from left to right
+	RBNode* stack[RB_MAX_DEPTH];
+	for (int i = 0; i < width; i++) {
+		RBNode* node = level[BFS_LEVELS & 1][i];
+		int depth = 0;
+		while (NULL != node || depth > 0) {
+			if (NULL != node) {
+				stack[depth++] = node;
+				node = node->child[0];
+				continue;
+			}
+			node = stack[--depth];
+			copy_node(tree, node, base, &n);
+			node = node->child[1];
+		}
+	}
+	if (NULL != tree->hash) hash_relocate(tree);
+	for (size_t i = 0; i < n; i++) {
+		RBNode* copy = (RBNode*)(base + i * SLOT_SIZE(tree));
+		for (int side = 0; side < 2; side++) {
+			RBNode* old = copy->child[side];
+			if (NULL == old) continue;
+			copy->child[side] = old->data;
+			release(tree, tree->pool, old);
+		}
+	}
+	if (NULL != tree->root) {
+		RBNode* old = tree->root;
+		tree->root = old->data;
+		release(tree, tree->pool, old);
+	}
+	pool_free(tree->pool);
+	tree->pool = pool;
+	tree->mods += 1;
+	STAT_FLUSH(tree);
+	return 0;
+}
+
+/**
+ * @brief Reports the memory used by the nodes of a tree.
+ *
+ * Comparing pooled with nodes tells how much of the tree has been allocated
+ * since the last RBcompact. The allocator headers are estimated as one size_t
+ * per node rounded up to the usual 2 pointers alignment. All the nodes of a
+ * tree with an arena (see RBpool) are pooled.
+ *
+ * @param tree : the tree
+ * @param usage : the structure receiving the figures, in bytes
+*/
+void RBmemory_usage(const RBTree* tree, RBMemory* usage) {
+	size_t total = (size_t)tree->count + tree->dead;
+	size_t align = 2 * sizeof(void*);
+	usage->node_size = NODE_SIZE(tree);
+	usage->nodes = tree->intrusive ? 0 : total * usage->node_size;
+	usage->pooled = 0;
+	usage->overhead = 0;
+	const RBPool* pool = tree->pool;
+	if (NULL != pool && pool->arena) {
+		// the unused part of the chunks is overhead too
+		usage->pooled = usage->nodes;
+		usage->overhead += sizeof(RBPool) + pool->mapped - usage->nodes;
+	}
+	else if (NULL != pool) {
+		usage->pooled = (pool->size - pool->nfree) * usage->node_size;
+		usage->overhead += sizeof(RBPool) + pool->size * SLOT_SIZE(tree)
+			- usage->pooled;
+	}
+	size_t header = (usage->node_size + sizeof(size_t) + align - 1)
+		/ align * align - usage->node_size;
+	usage->overhead += (usage->nodes - usage->pooled) / usage->node_size
+		* header;
+	if (NULL != tree->hash) usage->overhead += hash_memory(tree);
+	if (NULL != tree->expiry) {
+		RBMemory index;
+		RBmemory_usage(tree->expiry, &index);
+		usage->overhead += sizeof(RBTree) + index.nodes + index.overhead;
+	}
+}
@@ -0,0 +1,86 @@
+#ifndef RBTREE_BUILD
+#define RBTREE_BUILD
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "rbtree.h"
+#include "rbinternal.h"
+
+/*
+ * The expiry index of a tree is a second tree holding the same elements
+ * ordered by deadline (its deadline function, see key_comp), then by address
+ * so that elements sharing a deadline remain distinct.
+ */
+
+static int address_comp(const void* a, const void* b, int* err,
+		int (*comp)()) {
+	(void)err;
+	(void)comp;
+	if (a == b) return 0;
+	return ((uintptr_t)a > (uintptr_t)b) ? 1 : -1;
+}
+
+static RBTree* new_index(int64_t (*deadline)(const void*)) {
+	RBTree* index = malloc(sizeof(*index));
+	if (NULL != index) {
+		RBinit(index, NULL);
+		index->comperr = address_comp;
+		index->deadline = deadline;
+	}
+	return index;
+}
+
+/**
+ * @brief Gives deadlines to the elements of an empty tree.
+ *
+ * The elements are then also kept in an index ordered by their deadline,
+ * given by the deadline function, so that RBexpire can remove the expired
+ * ones without scanning the tree. Elements with a negative deadline never
+ * expire and are not indexed. The deadline of an element must not change
+ * while it is in the tree: to postpone it, insert a new element with the
+ * same key. Every insertion and removal then also updates the index, in
+ * O(log n) time and at the price of one more node per indexed element.
+ *
+ * @param tree : an empty tree initialized with RBinit or RBinit2
+ * @param deadline : the function giving the deadline of an element
+ * @return : 0 on success or -1 if the tree is not empty or memory could not
+ *           be allocated
+*/
+int RBexpiry(RBTree* tree, int64_t (*deadline)(const void*)) {
+	if (NULL != tree->root || NULL != tree->expiry) return -1;
+	tree->expiry = new_index(deadline);
+	return (NULL == tree->expiry) ? -1 : 0;
+}
+
+/**
+ * @brief Removes the elements whose deadline has passed.
+ *
+ * The elements whose deadline is lower or equal to now are removed in
+ * deadline order, each one in O(log n) time, and passed to dele if it is
+ * not NULL. Removals made this way are not recorded in a journal.
+ *
+ * @param tree : a tree with deadlines (see RBexpiry)
+ * @param now : the current time, in the unit of the deadlines
+ * @param dele : an optional function to release the expired elements
+ * @return : the number of expired elements or -1 if the tree has no
+ *           deadlines or on comparison error
+*/
+long RBexpire(RBTree* tree, int64_t now, void (*dele)(const void*)) {
+	RBTree* index = tree->expiry;
+	if (NULL == index) return -1;
+	long n = 0;
+	while (NULL != index->root) {
+		RBNode* node = index->root;
+		while (NULL != node->child[0]) node = node->child[0];
+		void* data = node->data;
+		if (DEADLINE(index, data) > now) break;
+		// removes it from the index too
+		if (RBremove(tree, data) != data) return -1;
+		if (dele) dele(data);
+		n += 1;
+	}
+	return n;
+}
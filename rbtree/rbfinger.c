@@ -0,0 +1,196 @@
+#ifndef RBTREE_BUILD
+#define RBTREE_BUILD
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "rbtree.h"
+#include "rbinternal.h"
+
+/*
+ * A finger keeps the path of its last search. The nodes bounding the subtree
+ * of each node of the path are the ancestors where the path last turned
+ * right (lower bound) and left (upper bound), and are kept as levels of the
+ * path, -1 standing for no bound.
+ */
+struct _RBFinger {
+	RBTree* tree;
+	unsigned long mods;	// value of tree->mods when the path was recorded
+	int depth;	// number of nodes in the path, 0 for none
+	int how;	// where the key of the last search is compared to the last node
+	RBNode* path[RB_MAX_DEPTH];
+	int_fast8_t side[RB_MAX_DEPTH];
+	signed char lo[RB_MAX_DEPTH];
+	signed char hi[RB_MAX_DEPTH];
+};
+
+/**
+ * @brief Creates a finger remembering the path of the last search in a tree.
+ *
+ * Searches through a finger start from the lowest node of the previous path
+ * whose subtree can hold the key, instead of the root, so that a sequence
+ * of nearby keys only walks the few levels separating them. A finger belongs
+ * to a single caller and is invalidated by any change of the structure of
+ * the tree, after which the next search simply starts again from the root.
+ *
+ * @param tree : the tree to search
+ * @return : a new finger or NULL if memory could not be allocated
+*/
+RBFinger* RBfinger_open(RBTree* tree) {
+	RBFinger* finger = malloc(sizeof(*finger));
+	if (NULL == finger) return NULL;
+	finger->tree = tree;
+	finger->mods = tree->mods;
+	finger->depth = 0;
+	finger->how = 0;
+	return finger;
+}
+
+/**
+ * @brief Releases a finger.
+ *
+ * @param finger : the finger to release or NULL
+*/
+void RBfinger_close(RBFinger* finger) {
+	free(finger);
+}
+
+/*
+ * Tells whether the subtree of the node at level i of the path can hold a key,
+ * or else gives the level where to go on looking for it in *up. The key is
+ * found at the bounding ancestor when it compares equal (*how is then 0).
+ * Returns 1 if it can, 0 if not and -1 on comparison error.
+ */
+static int within(RBFinger* finger, int i, void* key, uint64_t kp, int* up,
+		int* how) {
+	const RBTree* tree = finger->tree;
+	int err = 0;
+	for (int side = 0; side < 2; side++) {
+		int bound = side ? finger->hi[i] : finger->lo[i];
+		if (bound < 0) continue;
+		int cmp = key_comp(tree, key, kp, finger->path[bound], &err);
+		if (err) return -1;
+		if (side ? cmp < 0 : cmp > 0) continue;
+		*up = bound;
+		*how = cmp;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Searches the tree of a finger for a key from the lowest node of the last
+ * path whose subtree can hold it, and records the new path.
+ * Returns 0 on success or -1 on comparison error or for an empty tree, in
+ * which case the path is dropped.
+ */
+static int finger_search(RBFinger* finger, void* key) {
+	RBTree* tree = finger->tree;
+	int err = 0;
+	uint64_t kp = KEY_PREFIX(tree, key);
+	int i = 0;
+	if (NULL == tree->root) {
+		finger->depth = 0;
+		return -1;
+	}
+	if (finger->mods != tree->mods || 0 == finger->depth) {
+		finger->mods = tree->mods;
+		finger->path[0] = tree->root;
+		finger->side[0] = 0;
+		finger->lo[0] = -1;
+		finger->hi[0] = -1;
+	}
+	else {
+		i = finger->depth - 1;
+		while (i > 0) {
+			int up, how;
+			int in = within(finger, i, key, kp, &up, &how);
+			if (in < 0) {
+				finger->depth = 0;
+				STAT_FLUSH(tree);
+				return -1;
+			}
+			if (in) break;
+			i = up;
+			if (0 == how) {
+				// the key is the one of the bounding ancestor
+				finger->depth = i + 1;
+				finger->how = 0;
+				STAT_DEPTH(i);
+				STAT_FLUSH(tree);
+				return 0;
+			}
+		}
+	}
+	for (;;) {
+		RBNode* node = finger->path[i];
+		int cmp = key_comp(tree, key, kp, node, &err);
+		if (err) {
+			finger->depth = 0;
+			STAT_FLUSH(tree);
+			return -1;
+		}
+		int side = (cmp > 0);
+		if (0 == cmp || NULL == node->child[side]) {
+			finger->depth = i + 1;
+			finger->how = (0 == cmp) ? 0 : (side ? 1 : -1);
+			break;
+		}
+		finger->path[i + 1] = node->child[side];
+		finger->side[i + 1] = side;
+		finger->lo[i + 1] = side ? i : finger->lo[i];
+		finger->hi[i + 1] = side ? finger->hi[i] : i;
+		i += 1;
+	}
+	STAT_DEPTH(i);
+	STAT_FLUSH(tree);
+	return 0;
+}
+
+/**
+ * @brief Same as RBfind, starting from the last search of a finger.
+ *
+ * A tree with a hash index (see RBhash) is searched through the index and
+ * the finger is left untouched.
+ *
+ * @param finger : the finger of the tree where the key is searched
+ * @param key : the key to be searched
+ * @return : the element for that key or NULL if not found
+*/
+void* RBfinger_find(RBFinger* finger, void* key) {
+	if (NULL != finger->tree->hash) return hash_find(finger->tree, key);
+	if (finger_search(finger, key) || 0 != finger->how) return NULL;
+	RBNode* node = finger->path[finger->depth - 1];
+	return node->dead ? NULL : node->data;
+}
+
+/**
+ * @brief Same as RBsearch, starting from the last search of a finger.
+ *
+ * @param finger : the finger of the tree where the key is searched
+ * @param key : the key to be searched
+ * @return : an iterator positioned at that key, to be released with
+ *           RBiter_release, or NULL if the tree is empty, memory could not
+ *           be allocated or on comparison error
+*/
+RBIter* RBfinger_search(RBFinger* finger, void* key) {
+	if (finger_search(finger, key)) return NULL;
+	int md = 1 + 2 * finger->tree->black_depth;
+	RBIter* iter = malloc(sizeof(RBIter) + md * sizeof(struct iter_elt));
+	if (NULL == iter) return NULL;
+	STAT(iterators, 1);
+	iter->tree = NULL;
+	for (int i = 0; i < finger->depth; i++) {
+		iter->elt[i].node = finger->path[i];
+		iter->elt[i].right = finger->side[i];
+	}
+	iter->curdepth = finger->depth - 1;
+	// a missing key stops after its predecessor: the iterator goes up to the
+	// successor, like RBsearch
+	if (finger->how > 0) {
+		while (iter->elt[iter->curdepth--].right);
+	}
+	STAT_FLUSH(finger->tree);
+	return iter;
+}
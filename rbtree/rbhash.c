@@ -0,0 +1,346 @@
+#ifndef RBTREE_BUILD
+#define RBTREE_BUILD
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "rbtree.h"
+#include "rbinternal.h"
+
+/*
+ * The hash index of a tree is an open addressing table of its live elements
+ * with linear probing. Every slot caches the hash of its element, so that
+ * probing and resizing only compare elements with the same hash. Removals
+ * shift the following slots back instead of leaving tombstones, and the
+ * capacity (a power of 2) doubles above 3/4 of load and halves below 1/8.
+ * The index of a map (see RBmap) also keeps the node of every element in a
+ * parallel array, which gives RBfind_slot the value of a key.
+ */
+
+#define MIN_CAPACITY 16
+
+struct slot {
+	size_t hash;
+	void* data;	// NULL for an empty slot
+};
+
+struct _RBHash {
+	size_t (*hash)(const void*);
+	size_t used;
+	size_t mask;	// capacity - 1
+	int shift;	// 64 - log2(capacity)
+	struct slot* slots;
+	RBNode** nodes;	// node of the element of every slot in a map, or NULL
+};
+
+// Fibonacci hashing spreads poor hashes (like small integers) on the table
+static size_t home(const RBHash* index, size_t hash) {
+	return (size_t)(((uint64_t)hash * 0x9E3779B97F4A7C15ull) >> index->shift);
+}
+
+static int resize(RBHash* index, size_t capacity, int map) {
+	struct slot* slots = calloc(capacity, sizeof(*slots));
+	if (NULL == slots) return -1;
+	RBNode** nodes = NULL;
+	if (map && NULL == (nodes = malloc(capacity * sizeof(*nodes)))) {
+		free(slots);
+		return -1;
+	}
+	struct slot* old = index->slots;
+	RBNode** oldnodes = index->nodes;
+	size_t size = (NULL == old) ? 0 : index->mask + 1;
+	index->slots = slots;
+	index->nodes = nodes;
+	index->mask = capacity - 1;
+	index->shift = 64;
+	while (capacity > 1) {
+		capacity >>= 1;
+		index->shift -= 1;
+	}
+	for (size_t i = 0; i < size; i++) {
+		if (NULL == old[i].data) continue;
+		size_t j = home(index, old[i].hash);
+		while (NULL != slots[j].data) j = (j + 1) & index->mask;
+		slots[j] = old[i];
+		if (NULL != nodes) nodes[j] = oldnodes[i];
+	}
+	free(old);
+	free(oldnodes);
+	return 0;
+}
+
+// Gives the capacity of an index a new size, keeping its map nodes
+#define RESIZE(index, capacity) resize(index, capacity, NULL != (index)->nodes)
+
+static RBHash* new_index(size_t (*hash)(const void*), int map) {
+	RBHash* index = malloc(sizeof(*index));
+	if (NULL == index) return NULL;
+	index->hash = hash;
+	index->used = 0;
+	index->slots = NULL;
+	index->nodes = NULL;
+	if (resize(index, MIN_CAPACITY, map)) {
+		free(index);
+		return NULL;
+	}
+	return index;
+}
+
+/**
+ * @brief Adds a hash index to an empty tree for exact match lookups.
+ *
+ * The live elements of the tree are then also kept in a hash table, which
+ * RBinsert, RBremove and the other operations changing the tree maintain
+ * and which RBfind uses instead of the tree, in O(1) expected time. Ordered
+ * operations (RBsearch, iterators, ranges) still use the tree. Elements with
+ * equal keys must have the same hash. The table grows and shrinks with the
+ * number of elements, from 16 slots of 2 pointers each (3 in a map, where
+ * RBfind_slot also uses it).
+ *
+ * @param tree : an empty tree initialized with RBinit or RBinit2
+ * @param hash : the function giving the hash of an element or key
+ * @return : 0 on success or -1 if the tree is not empty or memory could not
+ *           be allocated
+*/
+int RBhash(RBTree* tree, size_t (*hash)(const void*)) {
+	if (NULL != tree->root || NULL != tree->hash) return -1;
+	tree->hash = new_index(hash, tree->map);
+	return (NULL == tree->hash) ? -1 : 0;
+}
+
+/*
+ * Makes the empty hash index of a tree becoming a map keep the nodes.
+ * Returns 0 on success or -1 if memory could not be allocated.
+ */
+int hash_map(RBTree* tree) {
+	return resize(tree->hash, tree->hash->mask + 1, 1);
+}
+
+/*
+ * Makes room in the hash index of a tree for n more elements, so that the
+ * next n hash_put cannot fail.
+ * Returns 0 on success or -1 if memory could not be allocated.
+ */
+int hash_reserve_n(RBTree* tree, size_t n) {
+	RBHash* index = tree->hash;
+	size_t capacity = index->mask + 1;
+	while (4 * (index->used + n) > 3 * capacity) capacity *= 2;
+	return (capacity == index->mask + 1) ? 0 : RESIZE(index, capacity);
+}
+
+/*
+ * Makes room in the hash index of a tree for one more element, so that
+ * the next hash_put cannot fail.
+ * Returns 0 on success or -1 if memory could not be allocated.
+ */
+int hash_reserve(RBTree* tree) {
+	return hash_reserve_n(tree, 1);
+}
+
+// Finds the slot of an element of the index, or NULL
+static struct slot* slot_of(RBHash* index, const void* data) {
+	size_t hash = index->hash(data);
+	for (size_t i = home(index, hash); NULL != index->slots[i].data;
+			i = (i + 1) & index->mask) {
+		if (index->slots[i].data == data) return index->slots + i;
+	}
+	return NULL;
+}
+
+/*
+ * Adds an element to the hash index of a tree, in place of old (the element
+ * it replaced in the tree) if it is indexed, with node, the node where it
+ * now is. Room must have been reserved.
+ */
+void hash_put(RBTree* tree, void* data, void* old, RBNode* node) {
+	RBHash* index = tree->hash;
+	struct slot* slot = (NULL == old) ? NULL : slot_of(index, old);
+	if (NULL == slot) {
+		size_t hash = index->hash(data);
+		size_t i = home(index, hash);
+		while (NULL != index->slots[i].data) i = (i + 1) & index->mask;
+		slot = index->slots + i;
+		slot->hash = hash;
+		index->used += 1;
+	}
+	slot->data = data;
+	if (NULL != index->nodes) index->nodes[slot - index->slots] = node;
+}
+
+// Removes an element from the hash index of a tree if it is there
+void hash_del(RBTree* tree, const void* data) {
+	RBHash* index = tree->hash;
+	struct slot* slot = slot_of(index, data);
+	if (NULL == slot) return;
+	// shift back the following slots which would no longer be reachable
+	size_t i = slot - index->slots;
+	for (size_t j = (i + 1) & index->mask; NULL != index->slots[j].data;
+			j = (j + 1) & index->mask) {
+		size_t k = home(index, index->slots[j].hash);
+		if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) continue;
+		index->slots[i] = index->slots[j];
+		if (NULL != index->nodes) index->nodes[i] = index->nodes[j];
+		i = j;
+	}
+	index->slots[i].data = NULL;
+	index->used -= 1;
+	// shrinking is only an optimization: a failure is ignored
+	if (index->mask + 1 > MIN_CAPACITY && 8 * index->used < index->mask + 1) {
+		RESIZE(index, (index->mask + 1) / 2);
+	}
+}
+
+// Finds the slot of the element with a key in the hash index of a tree
+static struct slot* slot_find(RBTree* tree, void* key) {
+	RBHash* index = tree->hash;
+	size_t hash = index->hash(key);
+	int err = 0;
+	struct slot* found = NULL;
+	for (size_t i = home(index, hash); NULL != index->slots[i].data;
+			i = (i + 1) & index->mask) {
+		if (index->slots[i].hash != hash) continue;
+		int cmp = tree->comperr(key, index->slots[i].data, &err, tree->comp);
+		STAT(comparisons, 1);
+		if (err) break;
+		if (0 == cmp) {
+			found = index->slots + i;
+			break;
+		}
+	}
+	STAT_FLUSH(tree);
+	return found;
+}
+
+// Finds the element with a key in the hash index of a tree
+void* hash_find(RBTree* tree, void* key) {
+	struct slot* slot = slot_find(tree, key);
+	return (NULL == slot) ? NULL : slot->data;
+}
+
+// Finds the node of a key in the hash index of a map
+RBNode* hash_find_node(RBTree* tree, void* key) {
+	struct slot* slot = slot_find(tree, key);
+	return (NULL == slot) ? NULL : tree->hash->nodes[slot - tree->hash->slots];
+}
+
+/*
+ * Follows the nodes of a map moved by RBcompact, whose old nodes hold the
+ * address of their copy in place of their element.
+ */
+void hash_relocate(RBTree* tree) {
+	RBHash* index = tree->hash;
+	if (NULL == index->nodes) return;
+	for (size_t i = 0; i <= index->mask; i++) {
+		if (NULL == index->slots[i].data) continue;
+		index->nodes[i] = index->nodes[i]->data;
+	}
+}
+
+// Gives the bytes used by the hash index of a tree
+size_t hash_memory(const RBTree* tree) {
+	RBHash* index = tree->hash;
+	return sizeof(RBHash) + (index->mask + 1) * (sizeof(struct slot)
+		+ ((NULL == index->nodes) ? 0 : sizeof(RBNode*)));
+}
+
+// Releases the hash index of a tree
+void hash_free(RBTree* tree) {
+	free(tree->hash->slots);
+	free(tree->hash->nodes);
+	free(tree->hash);
+	tree->hash = NULL;
+}
+
+// The bulk insertions sort the elements on the 10 high bits of their slots
+#define FILL_BITS 10
+
+struct entry {
+	size_t hash;
+	RBNode* node;
+};
+
+// Puts an element with its hash in the index, which has room for it
+static void put_hashed(RBHash* index, size_t hash, RBNode* node) {
+	size_t i = home(index, hash);
+	while (NULL != index->slots[i].data) i = (i + 1) & index->mask;
+	index->slots[i].hash = hash;
+	index->slots[i].data = node->data;
+	if (NULL != index->nodes) index->nodes[i] = node;
+	index->used += 1;
+}
+
+/*
+ * Puts the live elements of a tree in its empty hash index, which has room
+ * for them. Inserting them one by one would write the table at random: they
+ * are first sorted on their slots (a counting sort on the high bits), so
+ * that the table is filled from beginning to end. The hashes of the
+ * elements in key order can be given, or are computed.
+ */
+void hash_fill(RBTree* tree, const size_t* hashes) {
+	RBHash* index = tree->hash;
+	size_t n = tree->count;
+	int shift = 64 - index->shift - FILL_BITS;
+	if (shift < 0) shift = 0;
+	size_t parts = (index->mask >> shift) + 1;
+	struct entry* entries = malloc(2 * (n ? n : 1) * sizeof(*entries));
+	size_t* starts = calloc(parts + 1, sizeof(*starts));
+	RBNode* stack[RB_MAX_DEPTH];
+	int depth = 0;
+	size_t k = 0;
+	RBNode* node = tree->root;
+	while (NULL != node || depth > 0) {
+		if (NULL != node) {
+			stack[depth++] = node;
+			node = node->child[0];
+			continue;
+		}
+		node = stack[--depth];
+		if (!node->dead) {
+			size_t hash = (NULL == hashes) ? index->hash(node->data)
+				: hashes[k];
+			// the sort is only an optimization: without memory, no sort
+			if (NULL == entries || NULL == starts) {
+				put_hashed(index, hash, node);
+			}
+			else {
+				starts[(home(index, hash) >> shift) + 1] += 1;
+				entries[k].hash = hash;
+				entries[k].node = node;
+			}
+			k += 1;
+		}
+		node = node->child[1];
+	}
+	if (NULL != entries && NULL != starts) {
+		for (size_t p = 0; p < parts; p++) starts[p + 1] += starts[p];
+		struct entry* sorted = entries + n;
+		for (size_t i = 0; i < n; i++) {
+			size_t part = home(index, entries[i].hash) >> shift;
+			sorted[starts[part]++] = entries[i];
+		}
+		for (size_t i = 0; i < n; i++) {
+			put_hashed(index, sorted[i].hash, sorted[i].node);
+		}
+	}
+	free(entries);
+	free(starts);
+}
+
+// Gives the hash of an element of a tree with a hash index
+size_t hash_of(const RBTree* tree, const void* data) {
+	return tree->hash->hash(data);
+}
+
+/*
+ * Gives a clone the hash index of the original tree, rebuilt from the
+ * live nodes of the clone.
+ * Returns 0 on success or -1 if memory could not be allocated.
+ */
+int hash_clone(RBTree* tree, const RBTree* old) {
+	tree->hash = new_index(old->hash->hash, tree->map);
+	if (NULL == tree->hash || hash_reserve_n(tree, tree->count)) return -1;
+	hash_fill(tree, NULL);
+	return 0;
+}
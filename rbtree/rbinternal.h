@@ -1,15 +1,95 @@
 #ifndef RBINTERNAL_H
 #define RBINTERNAL_H
 
+#include <limits.h>
 #include <stdint.h>
 #include "rbtree.h"
 
+// As count is an unsigned, the black depth can never exceed its bit width and
+// a path from the root can never be longer than this
+#define RB_MAX_DEPTH (1 + 2 * CHAR_BIT * sizeof(unsigned))
+
 struct _RBNode {
 	void* data;
 	struct _RBNode* child[2];
-	int_fast8_t red;
+	int_fast8_t red;	// or the rank of the node (see RBbalance)
+	int_fast8_t dead;	// removed by RBremove_lazy
 };
 
+// The rank of a node of an AVL (its height) or WAVL tree, 0 for no node
+#define RANK(node) ((NULL == (node)) ? 0 : (node)->red)
+
+// The balancing policy of the new trees
+#ifndef RB_BALANCE
+#define RB_BALANCE RB_BALANCE_RB
+#endif
+
+// The node of an element of an intrusive tree is its link
+#define LINK(tree, data) ((RBNode*)((char*)(data) + (tree)->link))
+
+// The augmented value of a node (if the tree has one) follows the node
+#define NODE_AUG(node) ((void*)((node) + 1))
+
+// The abbreviated key of a node (if the tree has them, see RBprefix) follows
+// its augmented value
+#define PREFIX_OFFSET(tree) (((tree)->augsize + 7) & ~(size_t)7)
+#define NODE_PREFIX(tree, node) \
+	(*(uint64_t*)((char*)NODE_AUG(node) + PREFIX_OFFSET(tree)))
+#define KEY_PREFIX(tree, key) \
+	((NULL != (tree)->prefix) ? (tree)->prefix(key) : 0)
+
+// The size of the augmented value and abbreviated key of a node
+#define EXTRA_SIZE(tree) ((NULL == (tree)->prefix) ? (tree)->augsize \
+	: PREFIX_OFFSET(tree) + sizeof(uint64_t))
+
+// The value of a node of a map (see RBmap) ends the node
+#define VALUE_OFFSET(tree) \
+	((EXTRA_SIZE(tree) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+#define NODE_VALUE(tree, node) \
+	(*(void**)((char*)NODE_AUG(node) + VALUE_OFFSET(tree)))
+
+// The size of a node with its augmented value, abbreviated key and value
+#define NODE_SIZE(tree) (sizeof(RBNode) + ((tree)->map \
+	? VALUE_OFFSET(tree) + sizeof(void*) : EXTRA_SIZE(tree)))
+
+// The size of the slot of a node in a block of nodes, which keeps the nodes
+// aligned as malloc would
+#define SLOT_ALIGN (2 * sizeof(void*))
+#define SLOT_SIZE(tree) ((NODE_SIZE(tree) + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1))
+
+// A chunk of the arena of a pool, followed by its slots
+struct chunk {
+	struct chunk* next;
+	size_t size;	// bytes of the chunk, header included
+};
+
+// The nodes of a tree with a pool: either the contiguous block made by
+// RBcompact, or an arena holding all its nodes (see RBpool). The slots of the
+// nodes removed since are linked through child[0] and reused by the
+// insertions.
+struct _RBPool {
+	unsigned char* base;
+	size_t size;	// number of slots
+	size_t nfree;
+	RBNode* free;
+	int arena;
+	int flags;
+	unsigned long nodes;	// NUMA nodes mask
+	struct chunk* chunks;
+	unsigned char* next;	// bump allocation in the last chunk
+	unsigned char* end;
+	size_t mapped;	// bytes of all the chunks
+};
+
+#define IN_POOL(tree, pool, node) ((pool)->arena \
+	|| ((uintptr_t)(node) >= (uintptr_t)(pool)->base \
+	&& (uintptr_t)(node) < (uintptr_t)((pool)->base + (pool)->size * SLOT_SIZE(tree))))
+
+// Arena of the pools (see RBpool)
+RBPool* pool_new(int arena, int flags, unsigned long nodes);
+unsigned char* pool_reserve(const RBTree* tree, RBPool* pool, size_t n);
+void pool_free(RBPool* pool);
+
 struct iter_elt {
 	struct _RBNode* node;
 	int_fast8_t right;
@@ -17,6 +97,92 @@ struct iter_elt {
 
 struct _RBIter {
 	int curdepth;
+	RBTree* tree;	// the tree of a cursor (see RBcursor), NULL otherwise
+	unsigned long mods;	// value of tree->mods when the path was recorded
+	void* last;	// the key the cursor resumes from
+	int after;	// whether the element of that key was already returned
 	struct iter_elt elt[];
 };
+
+// Maintenance of the hash index of a tree (see RBhash)
+int hash_map(RBTree* tree);
+int hash_reserve(RBTree* tree);
+int hash_reserve_n(RBTree* tree, size_t n);
+void hash_put(RBTree* tree, void* data, void* old, RBNode* node);
+void hash_del(RBTree* tree, const void* data);
+void* hash_find(RBTree* tree, void* key);
+RBNode* hash_find_node(RBTree* tree, void* key);
+void hash_fill(RBTree* tree, const size_t* hashes);
+size_t hash_of(const RBTree* tree, const void* data);
+void hash_relocate(RBTree* tree);
+size_t hash_memory(const RBTree* tree);
+void hash_free(RBTree* tree);
+int hash_clone(RBTree* tree, const RBTree* old);
+
+// The deadline of an element of an expiry index (see RBexpiry)
+#define DEADLINE(index, data) ((index)->deadline(data))
+
+#ifdef RB_STATS
+#if defined(_MSC_VER)
+#define RB_THREAD_LOCAL __declspec(thread)
+#elif defined(__cplusplus)
+#define RB_THREAD_LOCAL thread_local
+#else
+#define RB_THREAD_LOCAL _Thread_local
+#endif
+
+// Per thread counters of the current operation, added atomically to the
+// stats of the tree once the operation ends (see stats_flush), so that the
+// comparisons and rotations do not write to memory shared between threads
+struct rb_counters {
+	unsigned long long comparisons;
+	unsigned long long rotations;
+	unsigned long long recolors;
+	unsigned long long allocs;
+	unsigned long long frees;
+	unsigned long long iterators;
+	int depth;
+};
+
+extern RB_THREAD_LOCAL struct rb_counters rb_counters;
+void stats_flush(RBStats* stats);
+
+#define STAT(field, n) (rb_counters.field += (n))
+#define STAT_DEPTH(d) (rb_counters.depth = 1 + (d))
+#define STAT_FLUSH(tree) stats_flush(&(tree)->stats)
+#define STAT_RESET() memset(&rb_counters, 0, sizeof(rb_counters))
+#else
+#define STAT(field, n) ((void)0)
+#define STAT_DEPTH(d) ((void)0)
+#define STAT_FLUSH(tree) ((void)0)
+#define STAT_RESET() ((void)0)
+#endif // RB_STATS
+
+/*
+ * Compares two elements of a tree. The elements of an expiry index (see
+ * RBexpiry) are ordered by deadline before the comparison function.
+ */
+static inline int elt_comp(const RBTree* tree, const void* a, const void* b,
+		int* err) {
+	if (NULL != tree->deadline) {
+		int64_t da = DEADLINE(tree, a), db = DEADLINE(tree, b);
+		if (da != db) return (da > db) ? 1 : -1;
+	}
+	return tree->comperr(a, b, err, tree->comp);
+}
+
+/*
+ * Compares a key of abbreviated key kp with the element of a node. In a
+ * tree with abbreviated keys (see RBprefix), the comparison function is only
+ * called when both abbreviated keys are equal.
+ */
+static inline int key_comp(const RBTree* tree, const void* key, uint64_t kp,
+		const RBNode* node, int* err) {
+	if (NULL != tree->prefix) {
+		uint64_t np = NODE_PREFIX(tree, node);
+		if (kp != np) return (kp < np) ? -1 : 1;
+	}
+	STAT(comparisons, 1);
+	return elt_comp(tree, key, node->data, err);
+}
 #endif // 
@@ -0,0 +1,116 @@
+#ifndef RBTREE_BUILD
+#define RBTREE_BUILD
+#endif
+
+#include <stddef.h>
+
+#include "rbtree.h"
+#include "rbinternal.h"
+
+/*
+ * An interval tree is ordered by the low endpoints of its elements and
+ * every node is augmented with the highest high endpoint of its subtree,
+ * which allows to skip the subtrees ending before a query.
+ */
+
+#define MAX_HIGH(node) (*(const void**)NODE_AUG(node))
+
+static void interval_combine(void* aug, const void* data, const void* left,
+		const void* right, const void* ctx) {
+	const RBInterval* interval = ctx;
+	const void* max = interval->high(data);
+	if (NULL != left && interval->comp(*(const void* const*)left, max) > 0) {
+		max = *(const void* const*)left;
+	}
+	if (NULL != right && interval->comp(*(const void* const*)right, max) > 0) {
+		max = *(const void* const*)right;
+	}
+	*(const void**)aug = max;
+}
+
+/**
+ * @brief Initializes a new interval tree.
+ *
+ * The elements of an interval tree are intervals whose endpoints are given
+ * by the functions of interval. The comparison function of the tree must
+ * order the elements by their low endpoints first, and may use anything
+ * else (for example the high endpoint) to distinguish intervals with the
+ * same low endpoint. The endpoints returned for an element must remain
+ * valid and unchanged while it is in the tree, as must the interval
+ * structure itself.
+ *
+ * @param tree : pointer to the RBTree to initialize
+ * @param comp : the comparison function of the elements
+ * @param interval : the functions giving and comparing the endpoints
+*/
+void RBinit_interval(RBTree* tree, int (*comp)(const void*, const void*),
+		const RBInterval* interval) {
+	RBinit(tree, comp);
+	RBaugment(tree, sizeof(const void*), interval_combine, interval);
+}
+
+/**
+ * @brief Calls a function in order on the intervals overlapping a range.
+ *
+ * Intervals are closed: an element is visited if its low endpoint is not
+ * greater than hi and its high endpoint is not lower than lo. Subtrees whose
+ * highest endpoint is lower than lo are never visited and the walk ends at
+ * the first element starting after hi. It stops as soon as fn returns a non
+ * zero value, which should then be positive.
+ *
+ * @param tree : an interval tree
+ * @param lo : the low endpoint of the range
+ * @param hi : the high endpoint of the range
+ * @param fn : the function called as fn(element, ctx)
+ * @param ctx : an opaque pointer passed to every fn call
+ * @return : 0 if all the overlapping elements were visited, the non zero
+ *           value returned by fn, or -1 if tree is not an interval tree
+*/
+int RBoverlaps(RBTree* tree, const void* lo, const void* hi,
+		int (*fn)(void*, void*), void* ctx) {
+	if (interval_combine != tree->combine) return -1;
+	const RBInterval* interval = tree->augctx;
+	RBNode* stack[RB_MAX_DEPTH];
+	int depth = 0;
+	RBNode* node = tree->root;
+	for (;;) {
+		while (NULL != node && interval->comp(MAX_HIGH(node), lo) >= 0) {
+			STAT(comparisons, 1);
+			stack[depth++] = node;
+			node = node->child[0];
+		}
+		STAT(comparisons, NULL != node);
+		if (0 == depth) break;
+		node = stack[--depth];
+		// following elements start even later
+		STAT(comparisons, 2);
+		if (interval->comp(interval->low(node->data), hi) > 0) break;
+		if (interval->comp(interval->high(node->data), lo) >= 0) {
+			int ret = fn(node->data, ctx);
+			if (ret) {
+				STAT_FLUSH(tree);
+				return ret;
+			}
+		}
+		node = node->child[1];
+	}
+	STAT_FLUSH(tree);
+	return 0;
+}
+
+/**
+ * @brief Calls a function in order on the intervals containing a point.
+ *
+ * Same as RBoverlaps(tree, point, point, fn, ctx).
+ *
+ * @param tree : an interval tree
+ * @param point : the point
+ * @param fn : the function called as fn(element, ctx)
+ * @param ctx : an opaque pointer passed to every fn call
+ * @return : 0 if all the elements containing point were visited, the non
+ *           zero value returned by fn, or -1 if tree is not an interval tree
+*/
+int RBstab(RBTree* tree, const void* point, int (*fn)(void*, void*),
+		void* ctx) {
+	return RBoverlaps(tree, point, point, fn, ctx);
+}
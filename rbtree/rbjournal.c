@@ -0,0 +1,356 @@
+#ifndef RBTREE_BUILD
+#define RBTREE_BUILD
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define write(fd, buf, n) _write(fd, buf, (unsigned)(n))
+#define read(fd, buf, n) _read(fd, buf, (unsigned)(n))
+#define fsync _commit
+#else
+#include <unistd.h>
+#endif
+
+#include "rbtree.h"
+#include "rbinternal.h"
+
+/*
+ * Journal format (all integers in native byte order):
+ *
+ * header:  "RBTJ", uint32 byte order mark
+ * records: uint32 payload length, uint8 operation, the serialized element
+ *          (or key for a removal), uint32 CRC-32 of the 5 + length previous
+ *          bytes.
+ *
+ * A record that is incomplete or whose CRC does not match is the torn tail
+ * of a crashed write: replay stops there.
+ */
+
+static const char MAGIC[4] = { 'R', 'B', 'T', 'J' };
+#define BYTE_ORDER_MARK 0x01020304u
+#define RECHEAD 5
+#define BUFSIZE 65536
+
+#define OP_INSERT 'I'
+#define OP_REPLACE 'R'
+#define OP_REMOVE 'D'
+
+struct _RBJournal {
+	RBTree* tree;
+	int fd;
+	unsigned batch;
+	unsigned pending;
+	int failed;
+	size_t (*serialize)(const void*, void*, size_t);
+	unsigned char* rec;
+	size_t recsize;
+	size_t used;
+	unsigned char buf[BUFSIZE];
+};
+
+static uint32_t crc32(uint32_t crc, const unsigned char* data, size_t size) {
+	static const uint32_t table[16] = {
+		0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+		0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+		0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+		0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+	};
+	crc = ~crc;
+	while (size-- > 0) {
+		crc ^= *data++;
+		crc = (crc >> 4) ^ table[crc & 15];
+		crc = (crc >> 4) ^ table[crc & 15];
+	}
+	return ~crc;
+}
+
+static int flush(RBJournal* journal) {
+	size_t done = 0;
+	while (done < journal->used) {
+		long n = (long)write(journal->fd, journal->buf + done,
+			journal->used - done);
+		if (n <= 0) return -1;
+		done += n;
+	}
+	journal->used = 0;
+	return 0;
+}
+
+static int append(RBJournal* journal, const void* data, size_t size) {
+	if (journal->used + size > BUFSIZE) {
+		if (flush(journal)) return -1;
+		if (size > BUFSIZE) {
+			// too large to be buffered: write it directly
+			for (size_t done = 0; done < size;) {
+				long n = (long)write(journal->fd,
+					(const unsigned char*)data + done, size - done);
+				if (n <= 0) return -1;
+				done += n;
+			}
+			return 0;
+		}
+	}
+	memcpy(journal->buf + journal->used, data, size);
+	journal->used += size;
+	return 0;
+}
+
+// Serializes an element into the record scratch area after the record header
+static size_t prepare(RBJournal* journal, const void* data) {
+	size_t avail = journal->recsize - RECHEAD - sizeof(uint32_t);
+	size_t size = journal->serialize(data, journal->rec + RECHEAD, avail);
+	if (size > avail) {
+		if (size > UINT32_MAX - RECHEAD) return (size_t)-1;
+		unsigned char* rec = realloc(journal->rec,
+			size + RECHEAD + sizeof(uint32_t));
+		if (NULL == rec) return (size_t)-1;
+		journal->rec = rec;
+		journal->recsize = size + RECHEAD + sizeof(uint32_t);
+		if (journal->serialize(data, journal->rec + RECHEAD, size) != size) {
+			return (size_t)-1;
+		}
+	}
+	return size;
+}
+
+static int log_record(RBJournal* journal, int op, size_t size) {
+	uint32_t len = (uint32_t)size;
+	memcpy(journal->rec, &len, sizeof(len));
+	journal->rec[sizeof(len)] = (unsigned char)op;
+	uint32_t crc = crc32(0, journal->rec, RECHEAD + size);
+	memcpy(journal->rec + RECHEAD + size, &crc, sizeof(crc));
+	if (append(journal, journal->rec, RECHEAD + size + sizeof(crc))) {
+		journal->failed = 1;
+		return -1;
+	}
+	journal->pending += 1;
+	if (journal->batch > 0 && journal->pending >= journal->batch) {
+		return RBjournal_commit(journal);
+	}
+	return 0;
+}
+
+static int start(RBJournal* journal, int fd) {
+	uint32_t bom = BYTE_ORDER_MARK;
+	journal->fd = fd;
+	journal->used = 0;
+	journal->pending = 0;
+	journal->failed = 0;
+	if (append(journal, MAGIC, sizeof(MAGIC))
+		|| append(journal, &bom, sizeof(bom))) return -1;
+	return RBjournal_commit(journal);
+}
+
+/**
+ * @brief Starts journaling the changes of a tree into an empty log.
+ *
+ * Changes made through RBjournal_insert and RBjournal_remove are applied
+ * to the tree and recorded in a memory buffer. The buffer is written and
+ * synced (group commit) by RBjournal_commit, or automatically every batch
+ * operations if batch is not 0.
+ *
+ * @param tree : the tree to journal
+ * @param fd : a file descriptor open for writing on an empty log
+ * @param serialize : the function converting an element to bytes (see RBsave)
+ * @param batch : number of operations between automatic commits or 0
+ * @return : a new journal or NULL on error
+*/
+RBJournal* RBjournal_open(RBTree* tree, int fd,
+		size_t (*serialize)(const void*, void*, size_t), unsigned batch) {
+	RBJournal* journal = malloc(sizeof(*journal));
+	if (NULL == journal) return NULL;
+	journal->tree = tree;
+	journal->batch = batch;
+	journal->serialize = serialize;
+	journal->recsize = 256;
+	journal->rec = malloc(journal->recsize);
+	if (NULL == journal->rec || start(journal, fd)) {
+		free(journal->rec);
+		free(journal);
+		return NULL;
+	}
+	return journal;
+}
+
+/**
+ * @brief Writes and syncs the buffered records of a journal.
+ *
+ * Once a record could not be written, the log is no longer consistent with
+ * the tree and every following commit fails until a checkpoint.
+ *
+ * @param journal : the journal
+ * @return : 0 on success or -1 if an error occurred
+*/
+int RBjournal_commit(RBJournal* journal) {
+	if (journal->failed || flush(journal) || fsync(journal->fd)) {
+		journal->failed = 1;
+		return -1;
+	}
+	journal->pending = 0;
+	return 0;
+}
+
+/**
+ * @brief Inserts an element into a journaled tree.
+ *
+ * Same as RBinsert, but the insertion (or the replacement) is recorded in
+ * the journal. error is also set if the record could not be written.
+ *
+ * @param journal : the journal of the tree
+ * @param data : the element to insert
+ * @param error : a pointer to an int variable which if not NULL
+ *  will be set to 0 if no error and a non zero value if error
+ * @return : the previous element with same key if any or NULL
+*/
+void* RBjournal_insert(RBJournal* journal, void* data, int* error) {
+	int err;
+	size_t size = prepare(journal, data);
+	if ((size_t)-1 == size) {
+		if (error) *error = 1;
+		return NULL;
+	}
+	void* old = RBinsert(journal->tree, data, &err);
+	if (0 == err) {
+		err = log_record(journal, old ? OP_REPLACE : OP_INSERT, size);
+	}
+	if (error) *error = err;
+	return old;
+}
+
+/**
+ * @brief Removes an element from a journaled tree and returns it.
+ *
+ * Same as RBremove, but an actual removal is recorded in the journal. A
+ * failure to record it is reported by the next RBjournal_commit.
+ *
+ * @param journal : the journal of the tree
+ * @param key : the key for which an element is to be removed
+ * @return : NULL if the key could not be found or the removed element
+*/
+void* RBjournal_remove(RBJournal* journal, void* key) {
+	size_t size = prepare(journal, key);
+	if ((size_t)-1 == size) return NULL;
+	void* data = RBremove(journal->tree, key);
+	if (NULL != data) log_record(journal, OP_REMOVE, size);
+	return data;
+}
+
+/**
+ * @brief Saves a checkpoint of a journaled tree and restarts its journal.
+ *
+ * Pending records are committed, the tree is saved with RBsave to snapfd
+ * and the journal continues on the new empty log logfd. Once this returns,
+ * the new snapshot followed by the new log describe the tree: the caller is
+ * responsible for atomically replacing the previous files.
+ *
+ * @param journal : the journal of the tree
+ * @param snapfd : a file descriptor open for writing the snapshot
+ * @param logfd : a file descriptor open for writing on an empty log
+ * @return : 0 on success or -1 if an error occurred
+*/
+int RBjournal_checkpoint(RBJournal* journal, int snapfd, int logfd) {
+	// the old log stays the reference until the snapshot is complete
+	RBjournal_commit(journal);
+	if (RBsave(journal->tree, snapfd, journal->serialize)
+		|| fsync(snapfd)) {
+		journal->failed = 1;
+		return -1;
+	}
+	return start(journal, logfd);
+}
+
+/**
+ * @brief Commits the pending records and releases a journal.
+ *
+ * The file descriptor is not closed.
+ *
+ * @param journal : the journal to release
+ * @return : 0 if the last commit succeeded or -1
+*/
+int RBjournal_close(RBJournal* journal) {
+	int cr = RBjournal_commit(journal);
+	free(journal->rec);
+	free(journal);
+	return cr;
+}
+
+static int read_full(int fd, void* data, size_t size) {
+	size_t done = 0;
+	while (done < size) {
+		long n = (long)read(fd, (unsigned char*)data + done, size - done);
+		if (n <= 0) return -1;
+		done += n;
+	}
+	return 0;
+}
+
+/**
+ * @brief Replays a journal into a tree.
+ *
+ * The tree is expected to be in the state it had when the journal was
+ * started (typically loaded from the last checkpoint). Replay stops at the
+ * end of the log or at the first incomplete or corrupted record, which is
+ * what a crash in the middle of a write leaves. Replaced and removed
+ * elements, as well as the keys used for removals, are passed to dele if
+ * it is not NULL.
+ *
+ * @param tree : the tree to update
+ * @param fd : a file descriptor open for reading the log
+ * @param deserialize : the function converting bytes to an element
+ * @param dele : an optional function to release discarded elements
+ * @return : the number of replayed records or -1 if the log is not valid
+*/
+long RBjournal_replay(RBTree* tree, int fd,
+		void* (*deserialize)(const void*, size_t),
+		void (*dele)(const void*)) {
+	char magic[sizeof(MAGIC)];
+	uint32_t bom;
+	if (read_full(fd, magic, sizeof(magic)) || read_full(fd, &bom, sizeof(bom))
+		|| memcmp(magic, MAGIC, sizeof(MAGIC)) || BYTE_ORDER_MARK != bom) {
+		return -1;
+	}
+	size_t recsize = 256;
+	unsigned char* rec = malloc(recsize);
+	long count = 0;
+	while (NULL != rec) {
+		uint32_t len, crc;
+		if (read_full(fd, rec, RECHEAD)) break;
+		memcpy(&len, rec, sizeof(len));
+		if (len > recsize - RECHEAD) {
+			unsigned char* tmp = realloc(rec, (size_t)len + RECHEAD);
+			if (NULL == tmp) break;
+			rec = tmp;
+			recsize = (size_t)len + RECHEAD;
+		}
+		if (read_full(fd, rec + RECHEAD, len)
+			|| read_full(fd, &crc, sizeof(crc))
+			|| crc != crc32(0, rec, RECHEAD + (size_t)len)) break;
+		void* data = deserialize(rec + RECHEAD, len);
+		if (NULL == data) break;
+		int op = rec[sizeof(len)];
+		if (OP_REMOVE == op) {
+			void* old = RBremove(tree, data);
+			if (dele) {
+				if (old) dele(old);
+				dele(data);
+			}
+		}
+		else {
+			int err;
+			void* old = RBinsert(tree, data, &err);
+			if (err) {
+				if (dele) dele(data);
+				break;
+			}
+			if (old && dele) dele(old);
+		}
+		count += 1;
+	}
+	free(rec);
+	return count;
+}
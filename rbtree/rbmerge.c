@@ -0,0 +1,247 @@
+#ifndef RBTREE_BUILD
+#define RBTREE_BUILD
+#endif
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "rbtree.h"
+#include "rbinternal.h"
+
+/*
+ * A merged iterator reads ahead the next element (head) of every source
+ * tree through a cursor, and keeps a tournament tree of the sources: the
+ * internal node n (1 <= n < size) holds the source whose head wins among
+ * the leaves of its subtree, node 1 being the root and leaf i standing at
+ * size + i. Advancing a source only replays the matches on the path from its
+ * leaf, with one comparison per level. Ties go to the left (newer) source.
+ */
+struct source {
+	RBTree* tree;	// NULL for the padding sources
+	RBIter* cursor;
+	unsigned long mods;	// value of tree->mods when head was read
+	void* head;	// NULL once the source is exhausted
+};
+
+struct _RBMerge {
+	void* (*resolve)(void*, void*);
+	RBTree* order;	// the tree whose comparison function is used
+	void* from;	// the key the iteration resumes from or NULL
+	int after;	// whether the element of that key was already returned
+	int err;	// set by a comparison error, which ends the iteration
+	size_t size;	// number of leaves, a power of 2 not lower than 2
+	size_t* game;	// the internal nodes of the tournament tree
+	struct source src[];
+};
+
+// Compares the heads of two sources, an exhausted source always losing
+static size_t play(RBMerge* merge, size_t a, size_t b) {
+	void* x = merge->src[a].head;
+	void* y = merge->src[b].head;
+	if (NULL == y || merge->err) return a;
+	if (NULL == x) return b;
+	RBTree* tree = merge->order;
+	int err = 0;
+	STAT(comparisons, 1);
+	int cmp = tree->comperr(x, y, &err, tree->comp);
+	if (err) merge->err = 1;
+	return (cmp <= 0) ? a : b;
+}
+
+// The winner of the subtree of a node of the tournament tree
+static size_t winner(RBMerge* merge, size_t n) {
+	return (n >= merge->size) ? n - merge->size : merge->game[n];
+}
+
+// Replays the matches from the leaf of a source up to the root
+static void replay(RBMerge* merge, size_t i) {
+	for (size_t n = (merge->size + i) / 2; n >= 1; n /= 2) {
+		merge->game[n] = play(merge, winner(merge, 2 * n),
+			winner(merge, 2 * n + 1));
+	}
+}
+
+/*
+ * Positions the cursor of a source from the key the iteration resumes from
+ * and reads its head.
+ * Returns 0 on success or -1 if memory could not be allocated.
+ */
+static int source_seek(RBMerge* merge, struct source* src) {
+	RBiter_release(src->cursor);
+	src->cursor = NULL;
+	src->head = NULL;
+	if (NULL == src->tree) return 0;
+	src->cursor = RBcursor(src->tree, merge->from);
+	if (NULL == src->cursor) return -1;
+	src->mods = src->tree->mods;
+	src->head = RBnext(src->cursor);
+	if (NULL != src->head && merge->after) {
+		// the element of the key was already returned
+		RBTree* tree = merge->order;
+		int err = 0;
+		STAT(comparisons, 1);
+		int cmp = tree->comperr(src->head, merge->from, &err, tree->comp);
+		if (err) merge->err = 1;
+		else if (0 == cmp) src->head = RBnext(src->cursor);
+	}
+	return 0;
+}
+
+// Reads the next head of a source
+static void advance(RBMerge* merge, size_t i) {
+	struct source* src = merge->src + i;
+	src->head = RBnext(src->cursor);
+	src->mods = src->tree->mods;
+	replay(merge, i);
+}
+
+/*
+ * Positions all the sources from the key the iteration resumes from and
+ * plays the whole tournament.
+ * Returns 0 on success or -1 if memory could not be allocated.
+ */
+static int merge_seek(RBMerge* merge) {
+	merge->err = 0;
+	for (size_t i = 0; i < merge->size; i++) {
+		if (source_seek(merge, merge->src + i)) return -1;
+	}
+	for (size_t n = merge->size - 1; n >= 1; n--) {
+		merge->game[n] = play(merge, winner(merge, 2 * n),
+			winner(merge, 2 * n + 1));
+	}
+	if (NULL != merge->order) STAT_FLUSH(merge->order);
+	return 0;
+}
+
+/**
+ * @brief Builds an iterator merging the elements of several trees in order.
+ *
+ * The trees, which must share the same order, are given from the newest to
+ * the oldest, as the generations of a log-structured merge tree. RBmerge_next
+ * returns their elements in a single ordered sequence, each key once: when
+ * several trees hold a key, the element of the newest one is returned, or if
+ * resolve is not NULL, resolve(newer, older) is called for each older
+ * element of the key and its result replaces the newer one. If it returns
+ * NULL, for example because the newer element marks a removal, the key is
+ * skipped along with its older elements. Every source is read through a
+ * cursor (see RBcursor), so that the trees may change during the iteration,
+ * which then goes on after the last returned key. Each step costs
+ * O(log k) comparisons plus the step of a tree iterator.
+ *
+ * @param trees : the k trees, from the newest to the oldest
+ * @param k : the number of trees
+ * @param resolve : the function merging the elements of a key or NULL
+ * @return : an iterator positioned at the first key, to be released with
+ *           RBmerge_release, or NULL if memory could not be allocated
+*/
+RBMerge* RBmerge_iter(RBTree** trees, size_t k,
+		void* (*resolve)(void*, void*)) {
+	size_t size = 2;
+	while (size < k) size *= 2;
+	RBMerge* merge = malloc(sizeof(*merge) + size * sizeof(struct source)
+		+ size * sizeof(size_t));
+	if (NULL == merge) return NULL;
+	merge->resolve = resolve;
+	merge->order = (k > 0) ? trees[0] : NULL;
+	merge->from = NULL;
+	merge->after = 0;
+	merge->size = size;
+	merge->game = (size_t*)(merge->src + size);
+	for (size_t i = 0; i < size; i++) {
+		merge->src[i].tree = (i < k) ? trees[i] : NULL;
+		merge->src[i].cursor = NULL;
+		merge->src[i].head = NULL;
+	}
+	if (merge_seek(merge)) {
+		RBmerge_release(merge);
+		return NULL;
+	}
+	return merge;
+}
+
+/**
+ * @brief Positions a merged iterator at a key of all its trees at once.
+ *
+ * As with RBsearch, the next element returned by RBmerge_next is the one of
+ * that key if a tree holds it, or else of the following key. The key must
+ * stay valid until that element is returned.
+ *
+ * @param merge : the merged iterator
+ * @param key : the key to start from, or NULL to start from the first key
+ * @return : 0 on success or -1 if memory could not be allocated, the
+ *           iteration being then over
+*/
+int RBmerge_seek(RBMerge* merge, void* key) {
+	merge->from = key;
+	merge->after = 0;
+	if (0 == merge_seek(merge)) return 0;
+	for (size_t i = 0; i < merge->size; i++) merge->src[i].head = NULL;
+	merge->game[1] = 0;
+	return -1;
+}
+
+/**
+ * @brief Returns the next element of a merged iterator.
+ *
+ * A comparison error ends the iteration, which RBmerge_seek can start again.
+ *
+ * @param merge : the merged iterator
+ * @return : the next element in key order, or NULL at the end
+*/
+void* RBmerge_next(RBMerge* merge) {
+	// the sources whose tree changed must read their head again
+	int changed = 0;
+	for (size_t i = 0; i < merge->size; i++) {
+		struct source* src = merge->src + i;
+		if (NULL == src->tree || src->mods == src->tree->mods) continue;
+		if (source_seek(merge, src)) merge->err = 1;
+		changed = 1;
+	}
+	if (changed) {
+		for (size_t n = merge->size - 1; n >= 1; n--) {
+			merge->game[n] = play(merge, winner(merge, 2 * n),
+				winner(merge, 2 * n + 1));
+		}
+	}
+	void* data = NULL;
+	while (NULL == data && !merge->err) {
+		size_t w = merge->game[1];
+		void* key = merge->src[w].head;
+		if (NULL == key) break;
+		data = key;
+		advance(merge, w);
+		// the older elements of the same key follow, from the newest
+		for (;;) {
+			size_t o = merge->game[1];
+			void* other = merge->src[o].head;
+			if (NULL == other || merge->err) break;
+			RBTree* tree = merge->order;
+			int err = 0;
+			STAT(comparisons, 1);
+			int cmp = tree->comperr(key, other, &err, tree->comp);
+			if (err) merge->err = 1;
+			if (err || 0 != cmp) break;
+			if (NULL != data && NULL != merge->resolve) {
+				data = merge->resolve(data, other);
+			}
+			advance(merge, o);
+		}
+		merge->from = key;
+		merge->after = 1;
+	}
+	if (NULL != merge->order) STAT_FLUSH(merge->order);
+	return merge->err ? NULL : data;
+}
+
+/**
+ * @brief Releases a merged iterator.
+ *
+ * @param merge : the merged iterator to release or NULL
+*/
+void RBmerge_release(RBMerge* merge) {
+	if (NULL == merge) return;
+	for (size_t i = 0; i < merge->size; i++) {
+		RBiter_release(merge->src[i].cursor);
+	}
+	free(merge);
+}
@@ -0,0 +1,196 @@
+#ifndef RBTREE_BUILD
+#define RBTREE_BUILD
+#endif
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE	// MAP_ANONYMOUS, MAP_HUGETLB and syscall
+#endif
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "rbtree.h"
+#include "rbinternal.h"
+
+/*
+ * The arena of a pool is a list of chunks of at least 2MB, the size of a huge
+ * page. Nodes are cut from the last chunk in sequence and the slots of the
+ * removed nodes are reused before any new cut. Chunks are only released with
+ * the pool, by RBdestroy or RBcompact.
+ */
+
+#define CHUNK_SIZE ((size_t)2 << 20)
+
+// The slots of a chunk start after its header, aligned as the slots
+#define CHUNK_HEADER ((sizeof(struct chunk) + SLOT_ALIGN - 1) \
+	& ~(SLOT_ALIGN - 1))
+
+// Memory policies of mbind (from linux/mempolicy.h)
+#define MPOL_BIND_MODE 2
+#define MPOL_INTERLEAVE_MODE 3
+
+#ifdef __linux__
+/*
+ * Maps size bytes, a multiple of CHUNK_SIZE, following the flags of a pool.
+ * Huge pages are first requested explicitly, which only works if the system
+ * reserved some, then through transparent huge pages on a region aligned on
+ * their size. The NUMA policy is set before the pages are touched, and is
+ * only a hint: a failure (no such node, no NUMA support) is ignored.
+ */
+static void* map_chunk(const RBPool* pool, size_t size) {
+	void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (pool->flags & RB_POOL_HUGE) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+#endif
+	if (MAP_FAILED == p) {
+		size_t extra = (pool->flags & RB_POOL_HUGE) ? CHUNK_SIZE : 0;
+		unsigned char* raw = mmap(NULL, size + extra, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (MAP_FAILED == raw) return NULL;
+		unsigned char* start = raw;
+		if (extra) {
+			// trims the region to an aligned one
+			start = (unsigned char*)(((uintptr_t)raw + CHUNK_SIZE - 1)
+				& ~(uintptr_t)(CHUNK_SIZE - 1));
+			if (start > raw) munmap(raw, start - raw);
+			if (start < raw + extra) {
+				munmap(start + size, raw + extra - start);
+			}
+		}
+#ifdef MADV_HUGEPAGE
+		if (pool->flags & RB_POOL_HUGE) madvise(start, size, MADV_HUGEPAGE);
+#endif
+		p = start;
+	}
+#ifdef SYS_mbind
+	if (pool->flags & (RB_POOL_BIND | RB_POOL_INTERLEAVE)) {
+		unsigned long mask = pool->nodes;
+		int mode = (pool->flags & RB_POOL_BIND) ? MPOL_BIND_MODE
+			: MPOL_INTERLEAVE_MODE;
+		syscall(SYS_mbind, p, size, mode, &mask,
+			sizeof(mask) * CHAR_BIT + 1, 0);
+	}
+#endif
+	return p;
+}
+
+static void unmap_chunk(struct chunk* chunk) {
+	munmap(chunk, chunk->size);
+}
+#else
+// Without mmap, chunks are plain allocations and the flags are ignored
+static void* map_chunk(const RBPool* pool, size_t size) {
+	(void)pool;
+	return malloc(size);
+}
+
+static void unmap_chunk(struct chunk* chunk) {
+	free(chunk);
+}
+#endif
+
+/**
+ * @brief Makes an empty tree allocate its nodes from an arena.
+ *
+ * The nodes are then cut in sequence from chunks of 2MB (or more for
+ * RBcompact), instead of being allocated one by one, and the nodes of the
+ * removed elements are reused by the next insertions. On Linux, the chunks
+ * can be backed by huge pages, which spares most of the TLB misses of the
+ * searches in a large tree: explicit huge pages are used if the system has
+ * some reserved, transparent ones otherwise. They can also be allocated on
+ * a set of NUMA nodes, or interleaved on them, as a hint which is ignored if
+ * the system cannot follow it. Elsewhere the flags have no effect. The memory
+ * of the arena is only given back by RBdestroy and RBcompact. A clone made
+ * by RBclone gets its own arena with the same options.
+ *
+ * @param tree : an empty tree which is not intrusive
+ * @param flags : a combination of RB_POOL_HUGE and of either RB_POOL_BIND or
+ *                RB_POOL_INTERLEAVE, or 0
+ * @param nodes : the mask of the NUMA nodes for RB_POOL_BIND and
+ *                RB_POOL_INTERLEAVE (bit n for node n)
+ * @return : 0 on success or -1 if the tree is not empty or is intrusive,
+ *           flags are invalid or memory could not be allocated
+*/
+int RBpool(RBTree* tree, int flags, unsigned long nodes) {
+	if (NULL != tree->root || tree->intrusive) return -1;
+	if ((flags & ~(RB_POOL_HUGE | RB_POOL_BIND | RB_POOL_INTERLEAVE))
+		|| ((flags & RB_POOL_BIND) && (flags & RB_POOL_INTERLEAVE))
+		|| ((flags & (RB_POOL_BIND | RB_POOL_INTERLEAVE)) && 0 == nodes)) {
+		return -1;
+	}
+	RBPool* pool = pool_new(1, flags, nodes);
+	if (NULL == pool) return -1;
+	pool_free(tree->pool);
+	tree->pool = pool;
+	return 0;
+}
+
+// Creates an empty pool, with an arena or for the block of RBcompact
+RBPool* pool_new(int arena, int flags, unsigned long nodes) {
+	RBPool* pool = malloc(sizeof(*pool));
+	if (NULL == pool) return NULL;
+	pool->base = NULL;
+	pool->size = 0;
+	pool->nfree = 0;
+	pool->free = NULL;
+	pool->arena = arena;
+	pool->flags = flags;
+	pool->nodes = nodes;
+	pool->chunks = NULL;
+	pool->next = NULL;
+	pool->end = NULL;
+	pool->mapped = 0;
+	return pool;
+}
+
+/*
+ * Cuts n contiguous slots from the arena of a pool, in a new chunk if the
+ * last one has not enough room left.
+ * Returns the first slot or NULL if memory could not be allocated.
+ */
+unsigned char* pool_reserve(const RBTree* tree, RBPool* pool, size_t n) {
+	size_t bytes = (n ? n : 1) * SLOT_SIZE(tree);
+	if (NULL == pool->next || (size_t)(pool->end - pool->next) < bytes) {
+		size_t size = (CHUNK_HEADER + bytes + CHUNK_SIZE - 1)
+			& ~(CHUNK_SIZE - 1);
+		struct chunk* chunk = map_chunk(pool, size);
+		if (NULL == chunk) return NULL;
+		STAT(allocs, 1);
+		chunk->next = pool->chunks;
+		chunk->size = size;
+		pool->chunks = chunk;
+		pool->mapped += size;
+		pool->next = (unsigned char*)chunk + CHUNK_HEADER;
+		pool->end = (unsigned char*)chunk + size;
+	}
+	unsigned char* slots = pool->next;
+	pool->next += bytes;
+	return slots;
+}
+
+// Releases a pool and all the memory of its nodes
+void pool_free(RBPool* pool) {
+	if (NULL == pool) return;
+	while (NULL != pool->chunks) {
+		struct chunk* chunk = pool->chunks;
+		pool->chunks = chunk->next;
+		unmap_chunk(chunk);
+		STAT(frees, 1);
+	}
+	if (NULL != pool->base) {
+		free(pool->base);
+		STAT(frees, 1);
+	}
+	free(pool);
+}
@@ -0,0 +1,422 @@
+#ifndef RBTREE_BUILD
+#define RBTREE_BUILD
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define write(fd, buf, n) _write(fd, buf, (unsigned)(n))
+#define read(fd, buf, n) _read(fd, buf, (unsigned)(n))
+#define fstat _fstat64
+typedef struct _stat64 stat_t;
+#else
+#include <unistd.h>
+typedef struct stat stat_t;
+#endif
+
+#include "rbtree.h"
+#include "rbinternal.h"
+
+/*
+ * File format (all integers in native byte order):
+ *
+ * header:  "RBTS", uint32 byte order mark, uint64 number of records
+ * records: uint64 length followed by the serialized bytes, padded with 0
+ *          up to a multiple of 8 bytes. Records are in key order.
+ * table:   uint64 offset of every record from the beginning of the file
+ * trailer: uint64 offset of the table
+ *
+ * The records can be read as a stream, while the table and the trailer
+ * allow to query a memory mapped image in place.
+ */
+
+static const char MAGIC[4] = { 'R', 'B', 'T', 'S' };
+#define BYTE_ORDER_MARK 0x01020304u
+#define HEADER_SIZE 16
+#define BUFSIZE 65536
+#define PAD8(x) (((x) + 7) & ~(uint64_t)7)
+
+struct writer {
+	int fd;
+	size_t used;
+	uint64_t pos;
+	unsigned char buf[BUFSIZE];
+	unsigned char* elt;
+	size_t eltsize;
+	size_t (*serialize)(const void*, void*, size_t);
+	uint64_t* offsets;
+	size_t count;
+};
+
+static int flush(struct writer* w) {
+	size_t done = 0;
+	while (done < w->used) {
+		long n = (long)write(w->fd, w->buf + done, w->used - done);
+		if (n <= 0) return -1;
+		done += n;
+	}
+	w->used = 0;
+	return 0;
+}
+
+static int put(struct writer* w, const void* data, size_t size) {
+	const unsigned char* src = data;
+	while (size > 0) {
+		size_t n = BUFSIZE - w->used;
+		if (n > size) n = size;
+		memcpy(w->buf + w->used, src, n);
+		w->used += n;
+		w->pos += n;
+		src += n;
+		size -= n;
+		if (BUFSIZE == w->used && flush(w)) return -1;
+	}
+	return 0;
+}
+
+static int put_record(void* data, void* ctx) {
+	struct writer* w = ctx;
+	static const unsigned char zeros[8] = { 0 };
+	size_t size = w->serialize(data, w->elt, w->eltsize);
+	if (size > w->eltsize) {
+		unsigned char* elt = realloc(w->elt, size);
+		if (NULL == elt) return 1;
+		w->elt = elt;
+		w->eltsize = size;
+		if (w->serialize(data, w->elt, w->eltsize) != size) return 1;
+	}
+	w->offsets[w->count++] = w->pos;
+	uint64_t len = size;
+	if (put(w, &len, sizeof(len)) || put(w, w->elt, size)) return 1;
+	return put(w, zeros, (size_t)(PAD8(len) - len));
+}
+
+/**
+ * @brief Saves a tree to a file descriptor.
+ *
+ * Every element is converted to bytes by the serialize function, which
+ * receives a buffer and its size and returns the number of bytes needed.
+ * If that number is greater than the size, it will be called again with a
+ * large enough buffer. Elements are written in key order, so that RBload
+ * can rebuild the tree in linear time, and the file ends with an offset
+ * table allowing to query a memory mapped copy through RBimage_find.
+ *
+ * @param tree : the tree to save
+ * @param fd : a file descriptor open for writing
+ * @param serialize : the function converting an element to bytes
+ * @return : 0 on success or -1 if an error occurred
+*/
+int RBsave(RBTree* tree, int fd, size_t (*serialize)(const void*, void*,
+		size_t)) {
+	struct writer* w = malloc(sizeof(*w));
+	if (NULL == w) return -1;
+	w->fd = fd;
+	w->used = 0;
+	w->pos = 0;
+	w->elt = NULL;
+	w->eltsize = 0;
+	w->serialize = serialize;
+	w->count = 0;
+	w->offsets = malloc((tree->count ? tree->count : 1) * sizeof(uint64_t));
+	int cr = -1;
+	if (NULL != w->offsets) {
+		uint32_t bom = BYTE_ORDER_MARK;
+		uint64_t count = tree->count;
+		if (0 == put(w, MAGIC, sizeof(MAGIC)) && 0 == put(w, &bom, sizeof(bom))
+			&& 0 == put(w, &count, sizeof(count))
+			&& 0 == RBforeach(tree, put_record, w)) {
+			uint64_t table = w->pos;
+			if (0 == put(w, w->offsets, w->count * sizeof(uint64_t))
+				&& 0 == put(w, &table, sizeof(table))
+				&& 0 == flush(w)) {
+				cr = 0;
+			}
+		}
+	}
+	free(w->offsets);
+	free(w->elt);
+	free(w);
+	return cr;
+}
+
+struct reader {
+	int fd;
+	size_t pos;
+	size_t end;
+	unsigned char buf[BUFSIZE];
+};
+
+static int get(struct reader* r, void* data, size_t size) {
+	unsigned char* dst = data;
+	while (size > 0) {
+		if (r->pos == r->end) {
+			long n = (long)read(r->fd, r->buf, BUFSIZE);
+			if (n <= 0) return -1;
+			r->pos = 0;
+			r->end = n;
+		}
+		size_t n = r->end - r->pos;
+		if (n > size) n = size;
+		if (NULL != dst) {
+			memcpy(dst, r->buf + r->pos, n);
+			dst += n;
+		}
+		r->pos += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/*
+ * Gives the bytes of a file after its header when the file descriptor is a
+ * regular file whose size is known, or UINT64_MAX. A corrupt count or
+ * length is then rejected before allocating for it.
+ */
+static uint64_t file_left(int fd) {
+	stat_t st;
+	if (fstat(fd, &st) || (st.st_mode & S_IFMT) != S_IFREG) return UINT64_MAX;
+	uint64_t size = (uint64_t)st.st_size;
+	return (size >= HEADER_SIZE) ? size - HEADER_SIZE : 0;
+}
+
+/*
+ * Reads the bytes of a record into a buffer of *size bytes, reallocated as
+ * they arrive: a corrupt length read from a pipe then fails on a short read
+ * instead of allocating for it at once.
+ * Returns 0 on success or -1 on error.
+ */
+static int get_record(struct reader* r, unsigned char** elt, size_t* size,
+		size_t len) {
+	size_t done = 0;
+	while (done < len) {
+		size_t n = len - done;
+		if (n > BUFSIZE) n = BUFSIZE;
+		if (done + n > *size) {
+			size_t grown = (2 * *size < done + n) ? done + n : 2 * *size;
+			if (grown > len) grown = len;
+			unsigned char* tmp = realloc(*elt, grown);
+			if (NULL == tmp) return -1;
+			*elt = tmp;
+			*size = grown;
+		}
+		if (get(r, *elt + done, n)) return -1;
+		done += n;
+	}
+	return 0;
+}
+
+/**
+ * @brief Loads a tree saved by RBsave.
+ *
+ * The tree must have been initialized and be empty. Records are read as a
+ * stream and converted back to elements by the deserialize function, which
+ * returns NULL on error. As they were saved in key order, the tree is built
+ * in linear time without any comparison after a check of that order. Records
+ * out of order are inserted one at a time instead: the elements they replace
+ * (duplicate keys of a corrupt file) and the ones which could not be
+ * inserted are given to dele. On error, the tree contains the other elements
+ * read so far, so that the caller can release them with RBdestroy. The
+ * number of records of the header and the length of every record are
+ * checked against the size of a regular file, and memory for them is
+ * otherwise only allocated as they are read.
+ *
+ * @param tree : an empty tree using the same comparison as the saved one
+ * @param fd : a file descriptor open for reading
+ * @param deserialize : the function converting bytes to an element
+ * @param dele : an optional function to release the elements left out of
+ *               the tree, or NULL
+ * @return : 0 on success or -1 if an error occurred
+*/
+int RBload(RBTree* tree, int fd, void* (*deserialize)(const void*, size_t),
+		void (*dele)(const void*)) {
+	if (NULL != tree->root) return -1;
+	struct reader* r = malloc(sizeof(*r));
+	if (NULL == r) return -1;
+	r->fd = fd;
+	r->pos = r->end = 0;
+	char magic[sizeof(MAGIC)];
+	uint32_t bom;
+	uint64_t count;
+	if (get(r, magic, sizeof(magic)) || memcmp(magic, MAGIC, sizeof(MAGIC))
+		|| get(r, &bom, sizeof(bom)) || BYTE_ORDER_MARK != bom
+		|| get(r, &count, sizeof(count)) || count > UINT_MAX) {
+		free(r);
+		return -1;
+	}
+	// every record takes at least 8 bytes
+	uint64_t left = file_left(fd);
+	if (count > left / 8) {
+		free(r);
+		return -1;
+	}
+	// the count cannot be trusted from a pipe: the array grows with the
+	// records actually read
+	size_t capacity = (count < 1024) ? (size_t)count + 1 : 1024;
+	void** data = malloc(capacity * sizeof(void*));
+	unsigned char* elt = NULL;
+	size_t eltsize = 0;
+	size_t n = 0;
+	int cr = (NULL == data) ? -1 : 0;
+	int sorted = 1;
+	int err = 0;
+	while (0 == cr && n < count) {
+		if (n == capacity) {
+			void** tmp = realloc(data, 2 * capacity * sizeof(void*));
+			if (NULL == tmp) {
+				cr = -1;
+				break;
+			}
+			data = tmp;
+			capacity *= 2;
+		}
+		uint64_t len;
+		if (get(r, &len, sizeof(len)) || len > SIZE_MAX - 8 || left < 8
+			|| PAD8(len) > left - 8) {
+			cr = -1;
+			break;
+		}
+		if (UINT64_MAX != left) left -= 8 + PAD8(len);
+		if (get_record(r, &elt, &eltsize, (size_t)len)
+			|| get(r, NULL, (size_t)(PAD8(len) - len))
+			|| NULL == (data[n] = deserialize(elt, (size_t)len))) {
+			cr = -1;
+			break;
+		}
+		if (n > 0 && sorted && tree->comperr(data[n - 1], data[n], &err,
+			tree->comp) >= 0) {
+			sorted = 0;
+		}
+		n += 1;
+	}
+	free(elt);
+	free(r);
+	if (NULL != data) {
+		if (!sorted || err || RBbuild(tree, data, NULL, n)) {
+			for (size_t i = 0; i < n; i++) {
+				int error;
+				void* old = RBinsert(tree, data[i], &error);
+				if (error) {
+					cr = -1;
+					old = data[i];
+				}
+				if (NULL != old && NULL != dele) dele(old);
+			}
+		}
+		free(data);
+	}
+	return cr;
+}
+
+/**
+ * @brief Opens an image of a saved tree that lies in memory.
+ *
+ * The image is typically a read only memory mapping of a file written by
+ * RBsave. Nothing is copied: the image structure only points into it. The
+ * offset and length of every record are checked to lie between the header
+ * and the offset table, so that a truncated or corrupt image is rejected
+ * here instead of being read out of its bounds later. This reads the whole
+ * offset table and the length of every record once.
+ *
+ * @param image : the image structure to initialize
+ * @param base : the address of the first byte of the image
+ * @param size : the size of the image in bytes
+ * @return : 0 on success or -1 if the bytes are not a valid image
+*/
+int RBimage_open(RBImage* image, const void* base, size_t size) {
+	const unsigned char* bytes = base;
+	uint32_t bom;
+	uint64_t count, table;
+	if (size < HEADER_SIZE + sizeof(table) || ((uintptr_t)base & 7)) return -1;
+	memcpy(&bom, bytes + sizeof(MAGIC), sizeof(bom));
+	memcpy(&count, bytes + sizeof(MAGIC) + sizeof(bom), sizeof(count));
+	memcpy(&table, bytes + size - sizeof(table), sizeof(table));
+	if (memcmp(bytes, MAGIC, sizeof(MAGIC)) || BYTE_ORDER_MARK != bom
+		|| (table & 7) || table < HEADER_SIZE || table > size - sizeof(table)
+		|| count > (size - sizeof(table) - table) / sizeof(uint64_t)
+		|| (size - sizeof(table) - table) != count * sizeof(uint64_t)) {
+		return -1;
+	}
+	const uint64_t* offsets = (const uint64_t*)(bytes + table);
+	for (size_t i = 0; i < count; i++) {
+		uint64_t offset = offsets[i];
+		// the record, its length and its padding end before the table
+		if ((offset & 7) || offset < HEADER_SIZE
+			|| offset > table - sizeof(uint64_t)) {
+			return -1;
+		}
+		uint64_t len = *(const uint64_t*)(bytes + offset);
+		if (len > table - offset - sizeof(uint64_t)) return -1;
+	}
+	image->base = bytes;
+	image->size = size;
+	image->count = (size_t)count;
+	image->offsets = offsets;
+	return 0;
+}
+
+/**
+ * @brief Gives access to a record of an image by its position.
+ *
+ * @param image : the image
+ * @param index : the position of the record in key order
+ * @param size : if not NULL, receives the size of the record
+ * @return : the address of the serialized bytes or NULL if index is too big
+*/
+const void* RBimage_get(const RBImage* image, size_t index, size_t* size) {
+	if (index >= image->count) return NULL;
+	const unsigned char* rec = image->base + image->offsets[index];
+	if (size) *size = (size_t)*(const uint64_t*)rec;
+	return rec + sizeof(uint64_t);
+}
+
+/**
+ * @brief Searches a key in an image and returns the position of the first
+ * record that is not lower than it.
+ *
+ * The comparison function receives the key and the bytes of a record with
+ * their size and returns a negative, zero or positive value like the
+ * comparison function of the tree.
+ *
+ * @param image : the image
+ * @param key : the key to be searched
+ * @param comp : the function comparing a key with a serialized record
+ * @return : the position of the record or the number of records if all are
+ *           lower than key
+*/
+size_t RBimage_search(const RBImage* image, const void* key,
+		int (*comp)(const void*, const void*, size_t)) {
+	size_t lo = 0, hi = image->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		size_t size = 0;
+		const void* rec = RBimage_get(image, mid, &size);
+		if (comp(key, rec, size) > 0) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * @brief Finds a key in an image.
+ *
+ * @param image : the image
+ * @param key : the key to be searched
+ * @param comp : the function comparing a key with a serialized record
+ * @param size : if not NULL, receives the size of the record
+ * @return : the address of the serialized bytes or NULL if not found
+*/
+const void* RBimage_find(const RBImage* image, const void* key,
+		int (*comp)(const void*, const void*, size_t), size_t* size) {
+	size_t index = RBimage_search(image, key, comp);
+	size_t sz;
+	const void* rec = RBimage_get(image, index, &sz);
+	if (NULL == rec || 0 != comp(key, rec, sz)) return NULL;
+	if (size) *size = sz;
+	return rec;
+}
@@ -0,0 +1,82 @@
+#ifndef RBTREE_BUILD
+#define RBTREE_BUILD
+#endif
+
+#include <string.h>
+
+#include "rbtree.h"
+#include "rbinternal.h"
+
+#ifdef RB_STATS
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define ATOMIC_ADD(var, n) \
+	_InterlockedExchangeAdd64((volatile long long*)&(var), (long long)(n))
+#define ATOMIC_TAKE(var) \
+	((unsigned long long)_InterlockedExchange64((volatile long long*)&(var), 0))
+#else
+#define ATOMIC_ADD(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+#define ATOMIC_TAKE(var) __atomic_exchange_n(&(var), 0, __ATOMIC_RELAXED)
+#endif
+
+RB_THREAD_LOCAL struct rb_counters rb_counters;
+
+#define FLUSH(stats, field) do { if (0 != rb_counters.field) \
+	ATOMIC_ADD((stats)->field, rb_counters.field); } while (0)
+
+/*
+ * Adds the counters of the current operation to the stats of a tree. Threads
+ * reading the same tree concurrently flush into the same stats, so the
+ * counters are added atomically, and only when they are not 0.
+ */
+void stats_flush(RBStats* stats) {
+	FLUSH(stats, comparisons);
+	FLUSH(stats, rotations);
+	FLUSH(stats, recolors);
+	FLUSH(stats, allocs);
+	FLUSH(stats, frees);
+	FLUSH(stats, iterators);
+	if (rb_counters.depth > 0) {
+		int depth = rb_counters.depth - 1;
+		ATOMIC_ADD(stats->searches, 1);
+		ATOMIC_ADD(stats->depths[depth < RB_STATS_DEPTHS ? depth
+			: RB_STATS_DEPTHS - 1], 1);
+	}
+	memset(&rb_counters, 0, sizeof(rb_counters));
+}
+#endif // RB_STATS
+
+/**
+ * @brief Copies the operation counters of a tree and resets them.
+ *
+ * Counters are only maintained when the library (and the code including
+ * rbtree.h, as it changes the RBTree structure) is compiled with the RB_STATS
+ * macro defined. Each thread counts in its own variables during an operation
+ * and adds them atomically to the tree counters when the operation ends, so
+ * that concurrent readers of a tree can still share it. Every counter is
+ * read and reset at once, but the set of counters is not a snapshot if
+ * other threads are using the tree.
+ *
+ * @param tree : the tree
+ * @param out : the structure receiving the counters
+ * @return : 0 on success or -1 if the library was built without RB_STATS
+*/
+int RBstats(RBTree* tree, RBStats* out) {
+#ifdef RB_STATS
+	RBStats* stats = &tree->stats;
+	out->comparisons = ATOMIC_TAKE(stats->comparisons);
+	out->rotations = ATOMIC_TAKE(stats->rotations);
+	out->recolors = ATOMIC_TAKE(stats->recolors);
+	out->allocs = ATOMIC_TAKE(stats->allocs);
+	out->frees = ATOMIC_TAKE(stats->frees);
+	out->iterators = ATOMIC_TAKE(stats->iterators);
+	out->searches = ATOMIC_TAKE(stats->searches);
+	for (int i = 0; i < RB_STATS_DEPTHS; i++) {
+		out->depths[i] = ATOMIC_TAKE(stats->depths[i]);
+	}
+	return 0;
+#else
+	memset(out, 0, sizeof(*out));
+	return -1;
+#endif // RB_STATS
+}
@@ -1,5 +1,5 @@
-#ifndef EXPORT
-#define EXPORT __declspec(dllexport)
+#ifndef RBTREE_BUILD
+#define RBTREE_BUILD
 #endif
 
 #include <stddef.h>
@@ -21,22 +21,22 @@ const unsigned char* RBversion() {
 	return RBVERSION;
 }
 
-static RBIter* search(RBTree* tree, void* data, int* how) {
-	if (0 == tree->black_depth) return NULL;
-	int md = 1 + 2 * tree->black_depth;
-	RBIter *iter = malloc(sizeof(RBIter) + md * sizeof(struct iter_elt));
-	if (NULL == iter) return NULL;
+/*
+ * Records in an iterator the path from the root of a non empty tree to the
+ * node of a key, or to the last node before falling out of the tree, and
+ * tells in *how where the key stands compared to that node.
+ * Returns 0 on success or non zero on comparison error.
+ */
+static int descend(RBTree* tree, void* data, RBIter* iter, int* how) {
 	RBNode* curr = tree->root;
 	int_fast8_t side = 0;
 	int err = 0;
-	for (int i = 0; i < md; i++) {
+	uint64_t kp = KEY_PREFIX(tree, data);
+	for (int i = 0; ; i++) {
 		iter->elt[i].node = curr;
 		iter->elt[i].right = side;
-		int next = tree->comperr(data, curr->data, &err, tree->comp);
-		if (err != 0) {
-			free(iter);
-			return NULL;
-		}
+		int next = key_comp(tree, data, kp, curr, &err);
+		if (err != 0) return err;
 		if (0 == next) {
 			iter->curdepth = i;
 			*how = 0;
@@ -49,11 +49,57 @@ static RBIter* search(RBTree* tree, void* data, int* how) {
 			*how = side ? 1 : -1;
 			break;
 		}
-		// md should be large enough for never falling out of the loop
+		// the iterator is deep enough for never overflowing
+	}
+	STAT_DEPTH(iter->curdepth);
+	return 0;
+}
+
+static RBIter* search(RBTree* tree, void* data, int* how) {
+	if (0 == tree->black_depth) return NULL;
+	int md = 1 + 2 * tree->black_depth;
+	RBIter *iter = malloc(sizeof(RBIter) + md * sizeof(struct iter_elt));
+	if (NULL == iter) return NULL;
+	STAT(iterators, 1);
+	iter->tree = NULL;
+	if (descend(tree, data, iter, how)) {
+		free(iter);
+		return NULL;
 	}
 	return iter;
 }
 
+static void iter_push(RBIter* iter, RBNode* node, int side) {
+	iter->elt[++iter->curdepth].node = node;
+	iter->elt[iter->curdepth].right = side;
+}
+
+// Positions an iterator on the leftmost node of a subtree
+static void leftmost(RBIter* iter, RBNode* node) {
+	iter->curdepth = -1;
+	for (; NULL != node; node = node->child[0]) {
+		iter_push(iter, node, 0);
+	}
+}
+
+// Advances an iterator to the next node and returns the node it was on
+static RBNode* iter_step(RBIter* iter) {
+	RBNode* node = iter->elt[iter->curdepth].node;
+	RBNode* curr = node;
+	if (node->child[1]) {
+		node = node->child[1];
+		iter_push(iter, node, 1);
+		while (node->child[0]) {
+			node = node->child[0];
+			iter_push(iter, node, 0);
+		}
+	}
+	else {
+		while (iter->elt[iter->curdepth--].right);
+	}
+	return curr;
+}
+
 /**
  * @brief Searches a tree from a key and returns an iterator positioned there.
  * 
@@ -68,11 +114,12 @@ static RBIter* search(RBTree* tree, void* data, int* how) {
 RBIter* RBsearch(RBTree* tree, void* key) {
 	int how;
 	RBIter* iter = search(tree, key, &how);
+	STAT_FLUSH(tree);
 	if (iter == NULL) {
 		return NULL;
 	}
 	if (how > 0) {
-		RBnext(iter);
+		iter_step(iter);
 	}
 	return iter;
 }
@@ -82,22 +129,57 @@ RBIter* RBsearch(RBTree* tree, void* key) {
 
 /**
  * @brief Finds an element from a tree and returns it if found or returns NULL.
+ *
+ * A tree with a hash index (see RBhash) is searched in O(1) expected time.
+ *
  * @param tree : the tree where the key is searched
  * @param key : the key to be searched
  * @return : the element for that key
 */
 EXPORT void* RBfind(RBTree* tree, void* key) {
+	if (NULL != tree->hash) return hash_find(tree, key);
 	int how;
 	RBIter* iter = search(tree, key, &how);
-	void* data = ((iter == NULL) || (how != 0)) ? NULL :
+	void* data = ((iter == NULL) || (how != 0)
+		|| iter->elt[iter->curdepth].node->dead) ? NULL :
 		iter->elt[iter->curdepth].node->data;
 	RBiter_release(iter);
+	STAT_FLUSH(tree);
 	return data;
 }
 
-static void iter_push(RBIter* iter, RBNode* node, int side) {
-	iter->elt[++iter->curdepth].node = node;
-	iter->elt[iter->curdepth].right = side;
+/**
+ * @brief Finds the key of a map and returns the slot of its value.
+ *
+ * The value can be read and replaced through the slot, which stays valid
+ * until the key is removed from the map or the map is compacted (see
+ * RBcompact). A map with a hash index (see RBhash) is searched in O(1)
+ * expected time, like RBfind.
+ *
+ * @param tree : the map (see RBmap) where the key is searched
+ * @param key : the key to be searched
+ * @return : the slot of the value of that key or NULL if the key is not in
+ *           the map or the tree is not a map
+*/
+void** RBfind_slot(RBTree* tree, void* key) {
+	if (!tree->map) return NULL;
+	RBNode* node;
+	if (NULL != tree->hash) node = hash_find_node(tree, key);
+	else {
+		// no path is needed, so neither is an iterator
+		int err = 0;
+		uint64_t kp = KEY_PREFIX(tree, key);
+		node = tree->root;
+		for (int depth = 0; NULL != node; depth++) {
+			int cmp = key_comp(tree, key, kp, node, &err);
+			STAT_DEPTH(depth);
+			if (err) node = NULL;
+			else if (0 == cmp) break;
+			else node = node->child[cmp > 0];
+		}
+		STAT_FLUSH(tree);
+	}
+	return (NULL == node || node->dead) ? NULL : &NODE_VALUE(tree, node);
 }
 
 /**
@@ -110,64 +192,303 @@ RBIter* RBfirst(RBTree* tree) {
 	int md = 1 + 2 * tree->black_depth;
 	RBIter* iter = malloc(sizeof(RBIter) + md * sizeof(struct iter_elt));
 	if (NULL == iter) return NULL;
-	RBNode* curr = tree->root;
-	if (curr == NULL) {
-		iter->curdepth = -1;
-	}
-	else {
-		for (int i = 0; i < md; i++) {
-			iter->elt[i].node = curr;
-			iter->elt[i].right = 0;
-			iter->curdepth = i;
-			if (curr->child[0]) curr = curr->child[0];
-			else break;
-		}
-	}
+	STAT(iterators, 1);
+	STAT_FLUSH(tree);
+	iter->tree = NULL;
+	leftmost(iter, tree->root);
+	return iter;
+}
+
+/*
+ * Positions an iterator of a cursor from the key it resumes from, after
+ * the element of that key if it was already returned.
+ */
+static void cursor_seek(RBIter* iter) {
+	RBTree* tree = iter->tree;
+	int how;
+	iter->mods = tree->mods;
+	if (NULL == iter->last || NULL == tree->root) leftmost(iter, tree->root);
+	// on comparison error, the cursor ends
+	else if (descend(tree, iter->last, iter, &how)) iter->curdepth = -1;
+	else if (how > 0 || (0 == how && iter->after)) iter_step(iter);
+	STAT_FLUSH(tree);
+}
+
+/**
+ * @brief Builds an iterator which survives the changes of its tree.
+ *
+ * Unlike the other iterators, which must not be used once their tree has
+ * changed, a cursor checks on every call of RBnext whether its tree changed
+ * since its last call (from its modification count), and if it did, first
+ * searches again its position from the last element it returned, in
+ * logarithmic time. A long scan can thus be interleaved with insertions and
+ * removals, and goes on from the first element following the last one it
+ * returned. As that element is the key of the search, if it was removed from
+ * the tree in the meantime, it must not have been released yet. The key
+ * given here is used the same way until the first element is returned.
+ *
+ * @param tree : the tree which is to be iterated
+ * @param key : the key to start from, as with RBsearch, or NULL to start from
+ *              the first element
+ * @return : a cursor to be used with RBnext and released with
+ *           RBiter_release, or NULL if memory could not be allocated
+*/
+RBIter* RBcursor(RBTree* tree, void* key) {
+	// deep enough for the tree to grow as much as it can
+	RBIter* iter = malloc(sizeof(RBIter)
+		+ RB_MAX_DEPTH * sizeof(struct iter_elt));
+	if (NULL == iter) return NULL;
+	STAT(iterators, 1);
+	iter->tree = tree;
+	iter->last = key;
+	iter->after = 0;
+	cursor_seek(iter);
 	return iter;
 }
 
 /**
  * @brief : Returns the currently pointed element and advances the iterator.
  * 
+ * Elements removed with RBremove_lazy are skipped. A cursor (see RBcursor)
+ * whose tree changed since the last call first finds its position again.
+ *
  * @param iter : the iterator
  * @return : the currently pointed element
 */
 void* RBnext(RBIter* iter) {
-	if (iter->curdepth == -1) return NULL;
-	RBNode* node = iter->elt[iter->curdepth].node;
-	void* data = node->data;
-	if (node->child[1]) {
-		node = node->child[1];
-		iter_push(iter, node, 1);
-		while (node->child[0]) {
-			node = node->child[0];
-			iter_push(iter, node, 0);
+	RBNode* node;
+	if (NULL != iter->tree && iter->mods != iter->tree->mods) {
+		cursor_seek(iter);
+	}
+	do {
+		if (iter->curdepth == -1) return NULL;
+		node = iter_step(iter);
+	} while (node->dead);
+	if (NULL != iter->tree) {
+		iter->last = node->data;
+		iter->after = 1;
+	}
+	return node->data;
+}
+
+// Calls fn, or fnkv with the value slot of maps, on the nodes of a walk
+static int walk(RBTree* tree, RBNode** stack, int depth, void* hi,
+		int (*fn)(void*, void*), int (*fnkv)(void*, void**, void*),
+		void* ctx) {
+	int err = 0;
+	while (depth > 0) {
+		RBNode* node = stack[--depth];
+		if (hi != NULL) {
+			int cmp = tree->comperr(node->data, hi, &err, tree->comp);
+			STAT(comparisons, 1);
+			if (err) return -1;
+			if (cmp >= 0) break;
+		}
+		if (!node->dead) {
+			int ret = (NULL != fn) ? fn(node->data, ctx) : fnkv(node->data,
+				tree->map ? &NODE_VALUE(tree, node) : NULL, ctx);
+			if (ret) return ret;
+		}
+		for (node = node->child[1]; node != NULL; node = node->child[0]) {
+			stack[depth++] = node;
 		}
 	}
-	else {
-		while (iter->elt[iter->curdepth--].right);
+	return 0;
+}
+
+/**
+ * @brief Calls a function on every element of a tree in order.
+ *
+ * The traversal uses a small stack local to the call instead of an iterator,
+ * so it does not allocate any memory. It stops as soon as fn returns a non
+ * zero value.
+ *
+ * @param tree : the tree to walk
+ * @param fn : the function called as fn(element, ctx)
+ * @param ctx : an opaque pointer passed to every fn call
+ * @return : 0 if all elements were visited or the non zero value returned by fn
+*/
+int RBforeach(RBTree* tree, int (*fn)(void*, void*), void* ctx) {
+	RBNode* stack[RB_MAX_DEPTH];
+	int depth = 0;
+	for (RBNode* node = tree->root; node != NULL; node = node->child[0]) {
+		stack[depth++] = node;
 	}
-	return data;
+	int cr = walk(tree, stack, depth, NULL, fn, NULL, ctx);
+	STAT_FLUSH(tree);
+	return cr;
 }
 
-static RBNode* new_node(void* data) {
-	RBNode* node = malloc(sizeof(*node));
-	if (NULL != node) {
-		memset(node->child, 0, sizeof(node->child));
-		node->red = 1;
-		node->data = data;
+/**
+ * @brief Calls a function on every key of a map and the slot of its value.
+ *
+ * The walk is the one of RBforeach, but fn also gets the slot of the value,
+ * which it can read or replace as the one of RBfind_slot. The slot is NULL
+ * if the tree is not a map.
+ *
+ * @param tree : the map (see RBmap) to walk
+ * @param fn : the function called as fn(key, slot, ctx)
+ * @param ctx : an opaque pointer passed to every fn call
+ * @return : 0 if all keys were visited or the non zero value returned by fn
+*/
+int RBforeach_kv(RBTree* tree, int (*fn)(void*, void**, void*), void* ctx) {
+	RBNode* stack[RB_MAX_DEPTH];
+	int depth = 0;
+	for (RBNode* node = tree->root; node != NULL; node = node->child[0]) {
+		stack[depth++] = node;
+	}
+	int cr = walk(tree, stack, depth, NULL, NULL, fn, ctx);
+	STAT_FLUSH(tree);
+	return cr;
+}
+
+/**
+ * @brief Calls a function in order on the elements of a range of keys.
+ *
+ * Elements are visited if their key is greater or equal to lo and lower than
+ * hi. A NULL lo (resp. hi) leaves the range open at the beginning (resp. the
+ * end). The walk stops as soon as fn returns a non zero value, which should
+ * then be positive to be distinguished from a comparison error.
+ *
+ * @param tree : the tree to walk
+ * @param lo : the first key of the range or NULL
+ * @param hi : the key ending the range (excluded) or NULL
+ * @param fn : the function called as fn(element, ctx)
+ * @param ctx : an opaque pointer passed to every fn call
+ * @return : 0 if the whole range was visited, the non zero value returned
+ *           by fn, or -1 if the comparison function reported an error
+*/
+int RBforeach_range(RBTree* tree, void* lo, void* hi,
+		int (*fn)(void*, void*), void* ctx) {
+	RBNode* stack[RB_MAX_DEPTH];
+	int depth = 0;
+	int err = 0;
+	RBNode* node = tree->root;
+	while (node != NULL) {
+		STAT(comparisons, lo != NULL);
+		if (lo != NULL && tree->comperr(lo, node->data, &err, tree->comp) > 0) {
+			node = node->child[1];
+		}
+		else {
+			stack[depth++] = node;
+			node = node->child[0];
+		}
+		if (err) return -1;
 	}
+	int cr = walk(tree, stack, depth, hi, fn, NULL, ctx);
+	STAT_FLUSH(tree);
+	return cr;
+}
+
+// Recomputes the augmented value of a node from its element and children
+static void augment(const RBTree* tree, RBNode* node) {
+	tree->combine(NODE_AUG(node), node->data,
+		node->child[0] ? NODE_AUG(node->child[0]) : NULL,
+		node->child[1] ? NODE_AUG(node->child[1]) : NULL, tree->augctx);
+}
+
+// Recomputes the augmented values of the nodes of a path up to the root
+static void augment_path(const RBTree* tree, RBIter* iter, int depth) {
+	if (NULL == tree->combine) return;
+	for (; depth >= 0; depth--) augment(tree, iter->elt[depth].node);
+}
+
+// Recomputes the augmented values of a whole subtree in post-order
+static void augment_all(const RBTree* tree, RBNode* node) {
+	RBNode* stack[RB_MAX_DEPTH];
+	RBNode* last = NULL;
+	int depth = 0;
+	while (NULL != node || depth > 0) {
+		if (NULL != node) {
+			stack[depth++] = node;
+			node = node->child[0];
+		}
+		else {
+			RBNode* top = stack[depth - 1];
+			if (NULL != top->child[1] && last != top->child[1]) {
+				node = top->child[1];
+			}
+			else {
+				augment(tree, top);
+				last = top;
+				depth -= 1;
+			}
+		}
+	}
+}
+
+// An RBLink is the storage of a node (fails to compile otherwise)
+typedef char link_size_check[sizeof(RBLink) == sizeof(RBNode) ? 1 : -1];
+
+// Makes a lone red node of an element from the storage of a node
+static RBNode* init_node(const RBTree* tree, RBNode* node, void* data) {
+	if (NULL != tree->prefix) NODE_PREFIX(tree, node) = tree->prefix(data);
+	memset(node->child, 0, sizeof(node->child));
+	node->red = 1;
+	node->dead = 0;
+	node->data = data;
+	if (tree->map) NODE_VALUE(tree, node) = NULL;
+	if (NULL != tree->combine) augment(tree, node);
 	return node;
 }
 
-static RBNode* rotate(RBNode* node, int side) {
+// The node of an element is either allocated or its link (see RBintrusive)
+static RBNode* new_node(const RBTree* tree, void* data) {
+	RBNode* node;
+	RBPool* pool = tree->pool;
+	if (tree->intrusive) node = LINK(tree, data);
+	else if (NULL != pool && NULL != pool->free) {
+		// reuse a slot of the block made by RBcompact or of the arena
+		node = pool->free;
+		pool->free = node->child[0];
+		pool->nfree -= 1;
+	}
+	else if (NULL != pool && pool->arena) {
+		node = (RBNode*)pool_reserve(tree, pool, 1);
+	}
+	else if (NULL != (node = malloc(NODE_SIZE(tree)))) {
+		STAT(allocs, 1);
+	}
+	return (NULL == node) ? NULL : init_node(tree, node, data);
+}
+
+static void free_node(const RBTree* tree, RBNode* node) {
+	RBPool* pool = tree->pool;
+	if (tree->intrusive) return;
+	if (NULL != pool && IN_POOL(tree, pool, node)) {
+		node->child[0] = pool->free;
+		pool->free = node;
+		pool->nfree += 1;
+	}
+	else {
+		free(node);
+		STAT(frees, 1);
+	}
+}
+
+// Gives the place of the node of an element to the link of a new element
+// with the same key in an intrusive tree
+static RBNode* replace_link(const RBTree* tree, RBNode* node, void* data) {
+	RBNode* link = LINK(tree, data);
+	*link = *node;
+	link->data = data;
+	return link;
+}
+
+static RBNode* rotate(const RBTree* tree, RBNode* node, int side) {
 	RBNode *next = node->child[1 - side];
+	STAT(rotations, 1);
 	node->child[1 - side] = next->child[side];
 	next->child[side] = node;
+	if (NULL != tree->combine) {
+		augment(tree, node);
+		augment(tree, next);
+	}
 	return next;
 }
 
-static RBNode* fix_red_violation(RBIter* iter, int side) {
+static RBNode* fix_red_violation(const RBTree* tree, RBIter* iter,
+		int side) {
 	for (;;) {
 		RBNode* parent = iter->elt[iter->curdepth - 1].node;
 		if (parent->child[!iter->elt[iter->curdepth].right] &&
@@ -175,18 +496,20 @@ static RBNode* fix_red_violation(RBIter* iter, int side) {
 			// sibling is red: just swap colors
 			for (int i = 0; i < 2; i++) parent->child[i]->red = 0;
 			parent->red = 1;
+			STAT(recolors, 3);
 		}
 		else {
 			int curside = iter->elt[iter->curdepth].right;
 			// sibling is black: we will have to rotate
 			if (side != curside) {
 				// we need an additional rotation
-				parent->child[1 - side] = rotate(parent->child[1 - side],
-					1 - side);
+				parent->child[1 - side] = rotate(tree,
+					parent->child[1 - side], 1 - side);
 			}
-			parent = rotate(parent, 1 - curside);
+			parent = rotate(tree, parent, 1 - curside);
 			parent->child[1-curside]->red = 1;
 			parent->red = 0;
+			STAT(recolors, 2);
 			if (iter->curdepth == 1) {
 				return parent;
 			}
@@ -211,6 +534,33 @@ static int defcomp2(const void* a, const void* b, int* err,
 static int defcomp3(const void* a, const void* b, int* err, int (*comp)()) {
 	return comp(a, b, err);
 }
+
+static void init(RBTree* tree, int (*comp)(),
+		int (*comperr)(const void*, const void*, int*, int (*comp)())) {
+	tree->root = NULL;
+	tree->black_depth = 0;
+	tree->count = 0;
+	tree->dead = 0;
+	tree->mods = 0;
+	tree->comp = comp;
+	tree->comperr = comperr;
+	tree->augsize = 0;
+	tree->combine = NULL;
+	tree->augctx = NULL;
+	tree->expiry = NULL;
+	tree->deadline = NULL;
+	tree->hash = NULL;
+	tree->pool = NULL;
+	tree->prefix = NULL;
+	tree->balance = RB_BALANCE;
+	tree->map = 0;
+	tree->intrusive = 0;
+	tree->link = 0;
+#ifdef RB_STATS
+	memset(&tree->stats, 0, sizeof(tree->stats));
+#endif
+}
+
 /**
  * @brief Initializes a new tree given a comparison function.
  *
@@ -222,11 +572,7 @@ static int defcomp3(const void* a, const void* b, int* err, int (*comp)()) {
  * @param comp : the comparison function
 */
 void RBinit(RBTree* tree, int (*comp)(const void*, const void*)) {
-	tree->root = NULL;
-	tree->black_depth = 0;
-	tree->count = 0;
-	tree->comp = comp;
-	tree->comperr = defcomp2;
+	init(tree, comp, defcomp2);
 }
 
 /**
@@ -240,11 +586,127 @@ void RBinit(RBTree* tree, int (*comp)(const void*, const void*)) {
  * @param comp : the comparison function handling exceptional condition
 */
 void RBinit2(RBTree* tree, int (*comp)(const void*, const void*, int*)) {
-	tree->root = NULL;
-	tree->black_depth = 0;
-	tree->count = 0;
-	tree->comp = comp;
-	tree->comperr = defcomp3;
+	init(tree, comp, defcomp3);
+}
+
+/**
+ * @brief Selects the balancing policy of an empty tree.
+ *
+ * All policies keep the tree height logarithmic behind the same interface,
+ * but trade the height bound against the restructuring work:
+ * - RB_BALANCE_RB (red-black, the default unless the library is compiled
+ *   with RB_BALANCE defined to another policy): height up to 2 log n, at
+ *   most 2 rotations per insertion and 3 per removal
+ * - RB_BALANCE_AVL: height up to 1.44 log n, the shortest searches, but
+ *   removals may rotate at every level
+ * - RB_BALANCE_WAVL (weak AVL): the height of an AVL tree as long as there
+ *   is no removal and 2 log n at worst, with at most 2 rotations per
+ *   insertion or removal and amortized O(1) rank changes
+ * AVL and WAVL trees keep the rank of every node in place of its color, and
+ * always use the bottom-up algorithms, even if RB_TOPDOWN is defined.
+ *
+ * @param tree : an empty tree initialized with RBinit or RBinit2
+ * @param policy : RB_BALANCE_RB, RB_BALANCE_AVL or RB_BALANCE_WAVL
+ * @return : 0 on success or -1 if the tree is not empty or the policy is
+ *           unknown
+*/
+int RBbalance(RBTree* tree, int policy) {
+	if (NULL != tree->root || policy < RB_BALANCE_RB
+		|| policy > RB_BALANCE_WAVL) {
+		return -1;
+	}
+	tree->balance = policy;
+	return 0;
+}
+
+/**
+ * @brief Makes an empty tree use links embedded in its elements.
+ *
+ * The elements of an intrusive tree are structures containing an RBLink at
+ * offset, which the tree uses as their node: an insertion allocates nothing
+ * and a removal frees nothing, and the element is next to its links in
+ * memory. An element can only be in one tree through a given link, must not
+ * be moved or released while it is in the tree (including as a tombstone,
+ * see RBremove_lazy) and is still what the comparison function receives.
+ * Intrusive trees cannot be augmented or use abbreviated keys.
+ *
+ * @param tree : an empty tree initialized with RBinit or RBinit2
+ * @param offset : the offset of the RBLink in the elements, as given by
+ *                 offsetof(struct, member)
+ * @return : 0 on success or -1 if the tree is not empty, is augmented,
+ *           uses abbreviated keys or is a map
+*/
+int RBintrusive(RBTree* tree, size_t offset) {
+	if (NULL != tree->root || NULL != tree->combine || NULL != tree->prefix
+		|| tree->map) {
+		return -1;
+	}
+	tree->intrusive = 1;
+	tree->link = offset;
+	return 0;
+}
+
+/**
+ * @brief Makes an empty tree keep an abbreviated key in every node.
+ *
+ * The abbreviated key of an element, given by prefix, is an integer whose
+ * order must be consistent with the comparison function: if the abbreviated
+ * key of a is lower than the one of b, then a must be lower than b. It is
+ * typically made of the first bytes of a string key, see RBprefix_string.
+ * Searches then compare abbreviated keys kept in the nodes, and only call the
+ * comparison function when they are equal, sparing most calls and the memory
+ * accesses to the elements. It costs 8 bytes per node.
+ *
+ * @param tree : an empty tree initialized with RBinit or RBinit2
+ * @param prefix : the function giving the abbreviated key of an element
+ * @return : 0 on success or -1 if the tree is not empty or is intrusive
+*/
+int RBprefix(RBTree* tree, uint64_t (*prefix)(const void*)) {
+	if (NULL != tree->root || tree->intrusive) return -1;
+	tree->prefix = prefix;
+	return 0;
+}
+
+/**
+ * @brief Makes an empty tree a map whose nodes also hold a value.
+ *
+ * The elements of the tree are then the keys, and every node has a slot for
+ * the value of its key, set by RBinsert_kv. RBfind_slot gives the address of
+ * that slot, so that a value can be read or updated in place with a single
+ * search and without allocating a new element. The other functions only see
+ * the keys: RBinsert gives a new key a NULL value, RBclone copies the values
+ * but RBsave and the journals ignore them, and RBremove_kv gives back the
+ * value of the key it removes. It costs a pointer per node.
+ *
+ * @param tree : an empty tree initialized with RBinit or RBinit2
+ * @return : 0 on success or -1 if the tree is not empty or is intrusive or
+ *           memory could not be allocated
+*/
+int RBmap(RBTree* tree) {
+	if (NULL != tree->root || tree->intrusive) return -1;
+	// the hash index of a map also keeps the nodes of the values
+	if (NULL != tree->hash && hash_map(tree)) return -1;
+	tree->map = 1;
+	return 0;
+}
+
+/**
+ * @brief Gives the abbreviated key of a string for RBprefix.
+ *
+ * Its first 8 bytes are packed in big endian order, padded with zeroes, so
+ * that abbreviated keys compare like strcmp compares the strings.
+ *
+ * @param str : a null terminated string
+ * @return : the abbreviated key of the string
+*/
+uint64_t RBprefix_string(const char* str) {
+	uint64_t prefix = 0;
+	int end = 0;
+	for (int i = 0; i < 8; i++) {
+		if (!end) end = '\0' == str[i];
+		prefix = (prefix << 8) | (end ? 0 : (unsigned char)str[i]);
+	}
+	return prefix;
 }
 
 /**
@@ -256,12 +718,50 @@ void RBiter_release(RBIter* iter) {
 	free(iter);
 }
 
-static void node_destroy(RBNode* node, void (*dele)(const void *)) {
-	if (NULL == node) return;
-	node_destroy(node->child[0], dele);
-	node_destroy(node->child[1], dele);
-	if (dele) dele(node->data);
-	free(node);
+// Frees a subtree in order without any stack: while a node has a left child,
+// a right rotation brings that child up, so the tree degenerates into a list.
+static void node_destroy(const RBTree* tree, RBNode* node,
+		void (*dele)(const void *)) {
+	while (NULL != node) {
+		RBNode* left = node->child[0];
+		if (NULL != left) {
+			node->child[0] = left->child[1];
+			left->child[1] = node;
+			node = left;
+		}
+		else {
+			RBNode* next = node->child[1];
+			if (dele) dele(node->data);
+			free_node(tree, node);
+			node = next;
+		}
+	}
+}
+
+// Tells whether all the nodes of a tree lie in its pool, which releases
+// them at once
+static int all_pooled(const RBTree* tree) {
+	const RBPool* pool = tree->pool;
+	if (NULL == pool || tree->intrusive) return 0;
+	return pool->arena
+		|| (size_t)tree->count + tree->dead == pool->size - pool->nfree;
+}
+
+// Calls dele on the elements of a subtree in order, leaving its nodes alone
+static void node_visit(RBNode* node, void (*dele)(const void *)) {
+	RBNode* stack[RB_MAX_DEPTH];
+	int depth = 0;
+	while (NULL != node || depth > 0) {
+		if (NULL != node) {
+			stack[depth++] = node;
+			node = node->child[0];
+		}
+		else {
+			node = stack[--depth];
+			dele(node->data);
+			node = node->child[1];
+		}
+	}
 }
 
 /**
@@ -269,142 +769,924 @@ static void node_destroy(RBNode* node, void (*dele)(const void *)) {
  *
  * RBdestroy removes all nodes from a tree and if dele is not null, applies
  * if to any referenced element (intended to free the elements resources).
+ * Elements are released in key order and the operation uses no additional
+ * memory whatever the tree size. The deadlines given by RBexpiry, the
+ * hash index added by RBhash and the arena of RBpool are dropped. When all
+ * the nodes lie in the arena or in the block of RBcompact, they are not
+ * visited one by one but released with it, and only visited for dele.
  *
  * @param tree : the tree do clean
  * @param dele : an optional function that would be applied on evey element
 */
 void RBdestroy(RBTree* tree, void (*dele)(const void*)) {
-	node_destroy(tree->root, dele);
+	if (!all_pooled(tree)) node_destroy(tree, tree->root, dele);
+	else if (NULL != dele) node_visit(tree->root, dele);
+	STAT_FLUSH(tree);
 	tree->root = NULL;
 	tree->black_depth = 0;
+	tree->count = 0;
+	tree->dead = 0;
+	tree->mods += 1;
+	if (NULL != tree->expiry) {
+		RBdestroy(tree->expiry, NULL);
+		free(tree->expiry);
+		tree->expiry = NULL;
+	}
+	if (NULL != tree->hash) hash_free(tree);
+	pool_free(tree->pool);
+	tree->pool = NULL;
 }
 
-RBNode* node_clone(RBNode* old, void* (*process)(void* const)) {
-	if (NULL == old) return NULL;
-	RBNode* node = new_node((NULL == process) ?
+/*
+ * Adds an element to the expiry index of a tree (see RBexpiry).
+ * Returns 0 on success or -1 if memory could not be allocated.
+ */
+static int expiry_add(RBTree* tree, void* data) {
+	int err;
+	if (DEADLINE(tree->expiry, data) < 0) return 0;
+	RBinsert(tree->expiry, data, &err);
+	return err ? -1 : 0;
+}
+
+// Removes an element from the expiry index of a tree
+static void expiry_del(RBTree* tree, void* data) {
+	if (DEADLINE(tree->expiry, data) >= 0) RBremove(tree->expiry, data);
+}
+
+static int index_one(void* data, void* tree) {
+	return expiry_add(tree, data);
+}
+
+/*
+ * Gives a clone the expiry index of the original tree: as the elements of
+ * the clone may be new ones, the index is rebuilt from them.
+ * Returns 0 on success or -1 if memory could not be allocated.
+ */
+static int expiry_clone(RBTree* tree, const RBTree* old) {
+	tree->expiry = malloc(sizeof(*tree->expiry));
+	if (NULL == tree->expiry) return -1;
+	memcpy(tree->expiry, old->expiry, sizeof(*tree->expiry));
+	tree->expiry->pool = NULL;
+	tree->expiry->root = NULL;
+	tree->expiry->black_depth = 0;
+	tree->expiry->count = 0;
+	return RBforeach(tree, index_one, tree) ? -1 : 0;
+}
+
+static RBNode* clone_one(const RBTree* tree, RBNode* old,
+		void* (*process)(void* const)) {
+	RBNode* node = new_node(tree, (NULL == process) ?
 		old->data : process(old->data));
-	node->red = old->red;
-	for (int i = 0; i < 2; i++) {
-		node->child[i] = node_clone(old->child[i], process);
+	if (NULL != node) {
+		node->red = old->red;
+		node->dead = old->dead;
+		memcpy(NODE_AUG(node), NODE_AUG(old), tree->augsize);
+		if (tree->map) NODE_VALUE(tree, node) = NODE_VALUE(tree, old);
 	}
 	return node;
 }
 
+// Copies a subtree in pre-order. Only the right children waiting to be copied
+// are stacked, so the stack never holds more elements than the tree height.
+static RBNode* node_clone(const RBTree* tree, RBNode* old,
+		void* (*process)(void* const)) {
+	if (NULL == old) return NULL;
+	struct {
+		RBNode* old;
+		RBNode* node;
+	} stack[RB_MAX_DEPTH];
+	int depth = 0;
+	RBNode* root = clone_one(tree, old, process);
+	RBNode* node = root;
+	while (NULL != node) {
+		for (int i = 0; i < 2; i++) {
+			if (NULL == old->child[i]) continue;
+			node->child[i] = clone_one(tree, old->child[i], process);
+			if (NULL == node->child[i]) {
+				node_destroy(tree, root, NULL);
+				return NULL;
+			}
+		}
+		if (NULL != old->child[1]) {
+			stack[depth].old = old->child[1];
+			stack[depth++].node = node->child[1];
+		}
+		if (NULL != old->child[0]) {
+			old = old->child[0];
+			node = node->child[0];
+		}
+		else if (depth > 0) {
+			old = stack[--depth].old;
+			node = stack[depth].node;
+		}
+		else node = NULL;
+	}
+	return root;
+}
+
 /**
  * @brief Duplicates a tree.
  * 
  * RBclone duplicates a tree by taking a fresh new copy of every node.
  * Optionaly, an operation can be applied on the data field.
  * (new_data = process(old_data))
+ * An intrusive tree can only be cloned into new elements, so process is
+ * then required.
  * 
  * @param old : the tree to duplicate 
  * @param process : an optional function to compute the new data from
  *                  the old one
- * @return : a copy of the tree
+ * @return : a copy of the tree or NULL if memory could not be allocated or
+ *           the tree is intrusive and process is NULL
 */
 RBTree* RBclone(RBTree* old, void* (*process)(void* const)) {
+	// the links of the elements are already used by the old tree
+	if (old->intrusive && NULL == process) return NULL;
 	RBTree* tree = malloc(sizeof(*tree));
+	if (NULL == tree) return NULL;
 	memcpy(tree, old, sizeof(*tree));
-	tree->root = node_clone(old->root, process);
+	tree->hash = NULL;
+	tree->pool = NULL;
+	// the clone gets an arena like the one of the tree, not its block
+	if (NULL != old->pool && old->pool->arena) {
+		tree->pool = pool_new(1, old->pool->flags, old->pool->nodes);
+		if (NULL == tree->pool) {
+			free(tree);
+			return NULL;
+		}
+	}
+	tree->root = node_clone(tree, old->root, process);
+	if (NULL == tree->root && NULL != old->root) {
+		pool_free(tree->pool);
+		free(tree);
+		STAT_RESET();
+		return NULL;
+	}
+	// processed elements may have different augmented values
+	if (NULL != process && NULL != tree->combine) {
+		augment_all(tree, tree->root);
+	}
+	if ((NULL != old->expiry && expiry_clone(tree, old))
+		|| (NULL != old->hash && hash_clone(tree, old))) {
+		RBdestroy(tree, NULL);
+		free(tree);
+		STAT_RESET();
+		return NULL;
+	}
+#ifdef RB_STATS
+	memset(&tree->stats, 0, sizeof(tree->stats));
+#endif
+	STAT_FLUSH(tree);
 	return tree;
 }
 
+// Gives its color or rank to a node of a perfectly balanced subtree once
+// its children have theirs: as both halves differ by at most one element,
+// only the nodes below the last complete level (full) can be found at depth
+// full, and they are painted red. The heights make valid AVL and WAVL ranks.
+static void paint_balanced(const RBTree* tree, RBNode* node, int depth,
+		int full) {
+	if (RB_BALANCE_RB == tree->balance) node->red = (depth >= full);
+	else {
+		int left = RANK(node->child[0]), right = RANK(node->child[1]);
+		node->red = 1 + ((left > right) ? left : right);
+	}
+}
+
+/*
+ * Builds a perfectly balanced subtree from sorted elements. Its nodes are
+ * either allocated, or the nodes of the same rank already made in slots.
+ */
+static RBNode* node_build(const RBTree* tree, void** data, size_t n,
+		int depth, int full, unsigned char* slots) {
+	if (0 == n) return NULL;
+	size_t mid = n / 2;
+	RBNode* node = (NULL == slots) ? new_node(tree, data[mid])
+		: (RBNode*)(slots + mid * SLOT_SIZE(tree));
+	if (NULL == node) return NULL;
+	node->child[0] = node_build(tree, data, mid, depth + 1, full, slots);
+	node->child[1] = node_build(tree, data + mid + 1, n - mid - 1, depth + 1,
+		full, (NULL == slots) ? NULL : slots + (mid + 1) * SLOT_SIZE(tree));
+	if ((NULL == node->child[0] && mid > 0) ||
+		(NULL == node->child[1] && n - mid > 1)) {
+		node_destroy(tree, node, NULL);
+		return NULL;
+	}
+	paint_balanced(tree, node, depth, full);
+	if (NULL != tree->combine) augment(tree, node);
+	return node;
+}
+
+// Number of complete levels of a perfectly balanced tree of n nodes
+static int complete_levels(size_t n) {
+	int full = 0;
+	while (((size_t)2 << full) <= n + 1) full++;
+	return full;
+}
+
+/*
+ * Gives n contiguous slots to the nodes of an empty tree, which then lie in
+ * key order as after RBcompact: a new block replaces the previous one, and a
+ * tree with an arena cuts them from it.
+ * Returns the first slot or NULL if the nodes must be allocated one by one.
+ */
+static unsigned char* build_slots(RBTree* tree, size_t n) {
+	if (tree->intrusive || 0 == n) return NULL;
+	if (NULL != tree->pool && tree->pool->arena) {
+		return pool_reserve(tree, tree->pool, n);
+	}
+	RBPool* pool = pool_new(0, 0, 0);
+	if (NULL == pool) return NULL;
+	if (NULL == (pool->base = malloc(n * SLOT_SIZE(tree)))) {
+		pool_free(pool);
+		return NULL;
+	}
+	STAT(allocs, 1);
+	pool->size = n;
+	pool_free(tree->pool);
+	tree->pool = pool;
+	return pool->base;
+}
+
+/*
+ * Replaces the content of an empty tree with n elements sorted in strictly
+ * increasing order in O(n) time and without any comparison. The hashes of
+ * the elements for the hash index are also put in hashes if it is not NULL,
+ * while the elements are read for their nodes.
+ * Returns 0 on success or -1 if memory could not be allocated.
+ */
+static int tree_build(RBTree* tree, void** data, size_t n, size_t* hashes) {
+	int full = complete_levels(n);
+	unsigned char* slots = build_slots(tree, n);
+	for (size_t i = 0; i < n && (NULL != slots || NULL != hashes); i++) {
+		if (NULL != slots) {
+			init_node(tree, (RBNode*)(slots + i * SLOT_SIZE(tree)), data[i]);
+		}
+		if (NULL != hashes) hashes[i] = hash_of(tree, data[i]);
+	}
+	RBNode* root = node_build(tree, data, n, 0, full, slots);
+	if (NULL == root && n > 0) {
+		STAT_FLUSH(tree);
+		return -1;
+	}
+	tree->root = root;
+	tree->black_depth = (RB_BALANCE_RB == tree->balance) ? full : RANK(root);
+	tree->count = (unsigned)n;
+	tree->dead = 0;
+	tree->mods += 1;
+	STAT_FLUSH(tree);
+	return 0;
+}
+
+// Gives the values of a map just built to its nodes
+static void build_fill(RBTree* tree, void** values) {
+	RBNode* stack[RB_MAX_DEPTH];
+	int depth = 0;
+	size_t i = 0;
+	RBNode* node = tree->root;
+	while (NULL != node || depth > 0) {
+		if (NULL != node) {
+			stack[depth++] = node;
+			node = node->child[0];
+			continue;
+		}
+		node = stack[--depth];
+		NODE_VALUE(tree, node) = values ? values[i++] : NULL;
+		node = node->child[1];
+	}
+}
+
+static int unindex_one(void* data, void* ctx) {
+	RBTree* tree = ctx;
+	if (NULL != tree->hash) hash_del(tree, data);
+	if (NULL != tree->expiry) expiry_del(tree, data);
+	return 0;
+}
+
 /**
- * @brief Inserts a new element into a valid tree.
+ * @brief Fills an empty tree with elements sorted by key.
  *
- * @param tree : the tree where to insert the element
- * @param data : the element to insert
- * @param error : a pointer to an int variable which if not NULL
- *  will be set to 0 if no error and a non zero value if error
- * @return : the previous element with same key if any or NULL
+ * The elements must be sorted in strictly increasing order of their keys,
+ * which is not checked: the tree is then built perfectly balanced in O(n)
+ * time without any comparison. The nodes are cut from a single block in key
+ * order, as after RBcompact (from the arena of a tree with one, see RBpool),
+ * unless the tree is intrusive. Its hash index (see RBhash) and expiry index
+ * (see RBexpiry) are filled too, the hash index in the order of its slots.
+ * The keys of a map (see RBmap) get the values of the same rank, or NULL
+ * values if values is NULL.
+ *
+ * @param tree : an empty tree
+ * @param data : the elements in increasing order
+ * @param values : the values of the keys of a map or NULL
+ * @param n : the number of elements
+ * @return : 0 on success or -1 if the tree is not empty or memory could not
+ *           be allocated, in which case the tree is left empty
 */
-void * RBinsert(RBTree* tree, void* data, int *error) {
+int RBbuild(RBTree* tree, void** data, void** values, size_t n) {
+	if (NULL != tree->root) return -1;
+	if (NULL != tree->hash && hash_reserve_n(tree, n)) return -1;
+	// the hashes are only an optimization: without memory, they are computed
+	// again from the nodes
+	size_t* hashes = (NULL == tree->hash) ? NULL
+		: malloc((n ? n : 1) * sizeof(*hashes));
+	if (tree_build(tree, data, n, hashes)) {
+		free(hashes);
+		return -1;
+	}
+	if (tree->map) build_fill(tree, values);
+	if (NULL != tree->hash) hash_fill(tree, hashes);
+	free(hashes);
+	if (NULL != tree->expiry && RBforeach(tree, index_one, tree)) {
+		RBforeach(tree, unindex_one, tree);
+		node_destroy(tree, tree->root, NULL);
+		STAT_FLUSH(tree);
+		tree->root = NULL;
+		tree->black_depth = 0;
+		tree->count = 0;
+		tree->mods += 1;
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef RB_TOPDOWN
+/*
+ * Top-down insertion and removal (Guibas and Sedgewick): the tree is
+ * rebalanced during the single descent, so that no path has to be recorded
+ * and every level is visited only once. A false root (head) allows the root
+ * to be rotated like any other node. The root is always kept black, so the
+ * black depth only changes when the root is repainted.
+ */
+
+static int is_red(const RBNode* node) {
+	return NULL != node && node->red;
+}
+
+// Rotates and paints the node going up black and the one going down red
+static RBNode* rotate_paint(const RBTree* tree, RBNode* node, int side) {
+	node = rotate(tree, node, side);
+	node->red = 0;
+	node->child[side]->red = 1;
+	STAT(recolors, 2);
+	return node;
+}
+
+static void* topdown_insert(RBTree* tree, void* data, int* error,
+		RBNode** at) {
+	RBNode head = { NULL, { NULL, tree->root }, 0 };
+	RBNode *ggp = NULL, *gp = NULL, *parent = &head;
+	RBNode* node = tree->root;
+	void* old = NULL;
+	int side = 1, depth = 0, err = 0, done = 0;
+	uint64_t kp = KEY_PREFIX(tree, data);
+	if (error) *error = 1; // be conservative
+	for (;;) {
+		if (NULL == node) {
+			if (NULL == (node = new_node(tree, data))) break;
+			parent->child[side] = node;
+			tree->count += 1;
+			if (at) *at = node;
+			done = 1;
+		}
+		else if (is_red(node->child[0]) && is_red(node->child[1])) {
+			// both children are red: push the red up
+			node->red = 1;
+			node->child[0]->red = node->child[1]->red = 0;
+			STAT(recolors, 3);
+		}
+		if (node == head.child[1]) {
+			if (node->red) {
+				node->red = 0;
+				tree->black_depth += 1;
+				STAT(recolors, 1);
+			}
+		}
+		else if (node->red && parent->red) {
+			// the parent is red so it is not the root and ggp exists. The
+			// rotation stays even if the insertion then fails.
+			tree->mods += 1;
+			int gside = (ggp->child[1] == gp);
+			int pside = (gp->child[1] == parent);
+			if (parent->child[pside] == node) {
+				ggp->child[gside] = rotate_paint(tree, gp, 1 - pside);
+				gp = ggp;	// node is still a child of parent
+			}
+			else {
+				gp->child[pside] = rotate(tree, parent, pside);
+				ggp->child[gside] = rotate_paint(tree, gp, 1 - pside);
+				parent = ggp;	// node is now a child of ggp
+			}
+		}
+		if (done) break;
+		int cmp = key_comp(tree, data, kp, node, &err);
+		STAT_DEPTH(depth);
+		if (err) break;
+		if (0 == cmp) {
+			old = node->data;
+			if (tree->intrusive) {
+				RBNode* link = replace_link(tree, node, data);
+				parent->child[parent->child[1] == node] = link;
+				node = link;
+			}
+			else node->data = data;
+			if (node->dead) {
+				// the tombstoned element is given back to the caller
+				node->dead = 0;
+				tree->dead -= 1;
+				tree->count += 1;
+			}
+			if (at) *at = node;
+			done = 1;
+			break;
+		}
+		side = (cmp > 0);
+		ggp = gp;
+		gp = parent;
+		parent = node;
+		node = node->child[side];
+		depth += 1;
+	}
+	tree->root = head.child[1];
+	if (done && error) *error = 0;
+	STAT_FLUSH(tree);
+	return old;
+}
+
+static void* topdown_remove(RBTree* tree, void* key, void** value) {
+	RBNode head = { NULL, { NULL, tree->root }, 0 };
+	RBNode *gp = NULL, *parent = NULL, *node = &head, *found = NULL;
+	RBNode* fparent = NULL;
+	int side = 1, depth = 0, err = 0;
+	uint64_t kp = KEY_PREFIX(tree, key);
+	// push a red node down along the path, so that the node to unlink is red
+	while (NULL != node->child[side]) {
+		int last = side;
+		gp = parent;
+		parent = node;
+		node = node->child[side];
+		if (NULL != found) side = 0;	// going to the successor
+		else {
+			int cmp = key_comp(tree, key, kp, node, &err);
+			STAT_DEPTH(depth);
+			if (err) break;
+			if (0 == cmp && !node->dead) {
+				found = node;
+				fparent = parent;
+			}
+			side = (cmp >= 0);
+		}
+		depth += 1;
+		if (node->red || is_red(node->child[side])) continue;
+		if (is_red(node->child[1 - side])) {
+			// the descent restructures the tree even if the key is absent
+			tree->mods += 1;
+			parent = parent->child[last] = rotate_paint(tree, node, side);
+			if (node == found) fparent = parent;
+			continue;
+		}
+		RBNode* sibling = parent->child[1 - last];
+		if (NULL == sibling) continue;
+		// a black parent can only be the root: the black depth decreases
+		if (!parent->red) tree->black_depth -= 1;
+		if (!is_red(sibling->child[0]) && !is_red(sibling->child[1])) {
+			parent->red = 0;
+			sibling->red = node->red = 1;
+			STAT(recolors, 3);
+		}
+		else {
+			tree->mods += 1;
+			int pside = (gp->child[1] == parent);
+			if (is_red(sibling->child[last])) {
+				parent->child[1 - last] = rotate(tree, sibling, 1 - last);
+			}
+			RBNode* top = gp->child[pside] = rotate(tree, parent, last);
+			if (parent == found) fparent = top;
+			node->red = top->red = 1;
+			top->child[0]->red = top->child[1]->red = 0;
+			STAT(recolors, 4);
+		}
+	}
+	void* data = NULL;
+	if (NULL != found && 0 == err) {
+		data = found->data;
+		parent->child[parent->child[1] == node] =
+			node->child[NULL == node->child[0]];
+		if (node != found) {
+			// the successor takes the place of the found node
+			node->child[0] = found->child[0];
+			node->child[1] = found->child[1];
+			node->red = found->red;
+			fparent->child[fparent->child[1] == found] = node;
+		}
+		if (tree->map) *value = NODE_VALUE(tree, found);
+		free_node(tree, found);
+		tree->count -= 1;
+	}
+	tree->root = head.child[1];
+	if (NULL == tree->root) tree->black_depth = 0;
+	else if (tree->root->red) {
+		tree->root->red = 0;
+		tree->black_depth += 1;
+		STAT(recolors, 1);
+	}
+	STAT_FLUSH(tree);
+	return data;
+}
+#endif // RB_TOPDOWN
+
+/*
+ * AVL and WAVL balancing (see RBbalance): the rank of a node is kept in its
+ * red field, missing nodes have rank 0 and new leaves rank 1, which new_node
+ * gives them. The ranks are restored bottom-up along the path of an
+ * iterator, like the colors of a red-black tree.
+ */
+
+// Links node at depth of the path of iter in place of the node there
+static void relink(RBTree* tree, RBIter* iter, int depth, RBNode* node) {
+	if (0 == depth) tree->root = node;
+	else iter->elt[depth - 1].node->child[iter->elt[depth].right] = node;
+	iter->elt[depth].node = node;
+}
+
+static void avl_height(RBNode* node) {
+	int left = RANK(node->child[0]), right = RANK(node->child[1]);
+	node->red = 1 + ((left > right) ? left : right);
+}
+
+/*
+ * Restores the AVL heights from depth up to the root of the path of iter,
+ * once a subtree below changed. Every unbalanced node is rotated, and the
+ * walk stops at the first subtree keeping its height.
+ */
+static void avl_fix(RBTree* tree, RBIter* iter, int depth) {
+	for (; depth >= 0; depth--) {
+		RBNode* node = iter->elt[depth].node;
+		int height = node->red;
+		int diff = RANK(node->child[1]) - RANK(node->child[0]);
+		if (diff > 1 || diff < -1) {
+			int side = (diff > 0);	// the higher subtree
+			RBNode* child = node->child[side];
+			if (RANK(child->child[1 - side]) > RANK(child->child[side])) {
+				node->child[side] = rotate(tree, child, side);
+				avl_height(child);
+				avl_height(node->child[side]);
+			}
+			RBNode* top = rotate(tree, node, 1 - side);
+			avl_height(node);
+			avl_height(top);
+			relink(tree, iter, depth, top);
+			node = top;
+		}
+		else avl_height(node);
+		if (node->red == height) break;
+	}
+}
+
+/*
+ * Restores the WAVL ranks after a leaf was added on side of the node ending
+ * the path of iter: while the new node has the rank of its parent, the
+ * parent is promoted if its other child is one rank below, otherwise one or
+ * two rotations end the fix-up.
+ */
+static void wavl_insert_fix(RBTree* tree, RBIter* iter, int side) {
+	int depth = iter->curdepth;
+	RBNode* node = iter->elt[depth].node->child[side];
+	while (depth >= 0) {
+		RBNode* parent = iter->elt[depth].node;
+		if (parent->red != node->red) break;
+		if (parent->red - RANK(parent->child[1 - side]) == 1) {
+			parent->red += 1;
+			STAT(recolors, 1);
+			node = parent;
+			side = iter->elt[depth].right;
+			depth -= 1;
+			continue;
+		}
+		RBNode* top;
+		if (node->red - RANK(node->child[side]) == 1) {
+			top = rotate(tree, parent, 1 - side);
+			parent->red -= 1;
+			STAT(recolors, 1);
+		}
+		else {
+			RBNode* inner = node->child[1 - side];
+			parent->child[side] = rotate(tree, node, side);
+			top = rotate(tree, parent, 1 - side);
+			inner->red += 1;
+			node->red -= 1;
+			parent->red -= 1;
+			STAT(recolors, 3);
+		}
+		relink(tree, iter, depth, top);
+		break;
+	}
+}
+
+/*
+ * Restores the WAVL ranks after a node was unlinked from side of the node at
+ * depth of the path of iter. A leaf left with rank 2 is demoted, then while
+ * a child is 3 ranks below its parent, the parent is demoted (with its other
+ * child if both children of that one are 2 ranks below), otherwise one or
+ * two rotations end the fix-up.
+ */
+static void wavl_remove_fix(RBTree* tree, RBIter* iter, int depth, int side) {
+	RBNode* parent = iter->elt[depth].node;
+	RBNode* node = parent->child[side];
+	if (2 == parent->red && NULL == parent->child[0]
+		&& NULL == parent->child[1]) {
+		parent->red = 1;
+		STAT(recolors, 1);
+		if (0 == depth) return;
+		node = parent;
+		side = iter->elt[depth].right;
+		parent = iter->elt[--depth].node;
+	}
+	while (parent->red - RANK(node) == 3) {
+		RBNode* sibling = parent->child[1 - side];
+		if (parent->red - sibling->red == 2) {
+			parent->red -= 1;
+			STAT(recolors, 1);
+		}
+		else if (sibling->red - RANK(sibling->child[0]) == 2
+			&& sibling->red - RANK(sibling->child[1]) == 2) {
+			parent->red -= 1;
+			sibling->red -= 1;
+			STAT(recolors, 2);
+		}
+		else {
+			RBNode* top;
+			if (sibling->red - RANK(sibling->child[1 - side]) == 1) {
+				top = rotate(tree, parent, side);
+				sibling->red += 1;
+				parent->red -= 1;
+				// a leaf cannot keep rank 2
+				if (NULL == parent->child[0] && NULL == parent->child[1]) {
+					parent->red -= 1;
+				}
+				STAT(recolors, 2);
+			}
+			else {
+				RBNode* inner = sibling->child[side];
+				parent->child[1 - side] = rotate(tree, sibling, 1 - side);
+				top = rotate(tree, parent, side);
+				inner->red += 2;
+				sibling->red -= 1;
+				parent->red -= 2;
+				STAT(recolors, 3);
+			}
+			relink(tree, iter, depth, top);
+			return;
+		}
+		if (0 == depth) return;
+		node = parent;
+		side = iter->elt[depth].right;
+		parent = iter->elt[--depth].node;
+	}
+}
+
+static void* tree_insert(RBTree* tree, void* data, int* error, RBNode** at) {
+#ifdef RB_TOPDOWN
+	// the augmented values of the path have to be updated from the bottom
+	if (NULL == tree->combine && RB_BALANCE_RB == tree->balance) {
+		return topdown_insert(tree, data, error, at);
+	}
+#endif
 	int how;
 	RBIter* iter = search(tree, data, &how);
 	if (error) *error = 1; // be conservative
 	if (NULL == iter) {
-		if (tree->black_depth == 0) {
-			tree->root = new_node(data);
+		if (tree->black_depth == 0
+			&& NULL != (tree->root = new_node(tree, data))) {
 			tree->black_depth = 1;
 			tree->count = 1;
-			tree->root->red = 0;
+			// a leaf is red in a red-black tree but has rank 1 otherwise
+			if (RB_BALANCE_RB == tree->balance) tree->root->red = 0;
+			if (at) *at = tree->root;
 			if (error) *error = 0;
 		}
+		STAT_FLUSH(tree);
 		return NULL;
 	}
 	void* old = NULL;
 	RBNode* node = iter->elt[iter->curdepth].node;
 	if (how == 0) {
 		old = node->data;
-		node->data = data;
+		if (tree->intrusive) {
+			node = replace_link(tree, node, data);
+			if (0 == iter->curdepth) tree->root = node;
+			else iter->elt[iter->curdepth - 1].node->child[
+				iter->elt[iter->curdepth].right] = node;
+			iter->elt[iter->curdepth].node = node;
+		}
+		else node->data = data;
+		if (node->dead) {
+			// the tombstoned element is given back to the caller
+			node->dead = 0;
+			tree->dead -= 1;
+			tree->count += 1;
+		}
+		if (at) *at = node;
+		augment_path(tree, iter, iter->curdepth);
 	}
 	else {
 		int side = (how > 0);
-		if (NULL == (node->child[side] = new_node(data))) return NULL;
-		if (node->red) {
-			tree->root = fix_red_violation(iter, side);
+		if (NULL == (node->child[side] = new_node(tree, data))) {
+			RBiter_release(iter);
+			STAT_FLUSH(tree);
+			return NULL;
+		}
+		if (at) *at = node->child[side];
+		// fix-up rotations keep the augmented values of the nodes they move
+		augment_path(tree, iter, iter->curdepth);
+		if (RB_BALANCE_AVL == tree->balance) avl_fix(tree, iter, iter->curdepth);
+		else if (RB_BALANCE_WAVL == tree->balance) {
+			wavl_insert_fix(tree, iter, side);
+		}
+		else if (node->red) {
+			tree->root = fix_red_violation(tree, iter, side);
 		}
 	}
 	RBiter_release(iter);
 	if (error) *error = 0;
-	if (tree->root && tree->root->red) {
+	if (RB_BALANCE_RB != tree->balance) tree->black_depth = RANK(tree->root);
+	else if (tree->root && tree->root->red) {
 		tree->root->red = 0;
 		tree->black_depth += 1;
+		STAT(recolors, 1);
 	}
 	if (!old) tree->count += 1;
+	STAT_FLUSH(tree);
 	return old;
 }
 
+/*
+ * Inserts an element into a tree and its indexes and gives in *at, if at is
+ * not NULL, the node where the element now is.
+ */
+static void* insert(RBTree* tree, void* data, int* error, RBNode** at) {
+	int err = 0;
+	void* old = NULL;
+	RBNode* node = NULL;
+	if (NULL == tree->expiry && NULL == tree->hash) {
+		old = tree_insert(tree, data, &err, at);
+	}
+	else {
+		// making room in the indexes first leaves the tree unchanged on failure
+		if (NULL != tree->hash) err = hash_reserve(tree);
+		if (0 == err && NULL != tree->expiry) err = expiry_add(tree, data);
+		if (0 == err) {
+			old = tree_insert(tree, data, &err, &node);
+			if (NULL != tree->expiry) {
+				if (err) expiry_del(tree, data);
+				else if (NULL != old && old != data) expiry_del(tree, old);
+			}
+			if (0 == err && NULL != tree->hash) {
+				hash_put(tree, data, old, node);
+			}
+			if (0 == err && at) *at = node;
+		}
+	}
+	if (0 == err) tree->mods += 1;
+	if (error) *error = err;
+	return old;
+}
+
+/**
+ * @brief Inserts a new element into a valid tree.
+ *
+ * If the key was removed with RBremove_lazy, its element is returned as a
+ * replaced one would be, so that it can be released, but the element
+ * counts as a new one.
+ *
+ * @param tree : the tree where to insert the element
+ * @param data : the element to insert
+ * @param error : a pointer to an int variable which if not NULL
+ *  will be set to 0 if no error and a non zero value if error
+ * @return : the previous element with same key if any or NULL
+*/
+void * RBinsert(RBTree* tree, void* data, int *error) {
+	return insert(tree, data, error, NULL);
+}
+
+/**
+ * @brief Inserts a key with a value into a map and returns the previous value.
+ *
+ * As with RBinsert, the key replaces the one already in the map for the same
+ * key, if any, and that previous key is given back in *old so that it can be
+ * released. The previous key and value of a key removed with RBremove_lazy
+ * are also given back. RBfind_slot updates the value of a present key
+ * without replacing the key.
+ *
+ * @param tree : the map (see RBmap)
+ * @param key : the key to insert
+ * @param value : its value
+ * @param old : a pointer which if not NULL receives the previous key, or
+ *  NULL if the key was not in the map or on error
+ * @param error : a pointer to an int variable which if not NULL
+ *  will be set to 0 if no error and a non zero value if error, including
+ *  when the tree is not a map
+ * @return : the previous value of the key or NULL if it was not in the map
+*/
+void* RBinsert_kv(RBTree* tree, void* key, void* value, void** old,
+		int* error) {
+	RBNode* node = NULL;
+	int err = 1;
+	void* prev = NULL;
+	if (tree->map) prev = insert(tree, key, &err, &node);
+	if (old) *old = prev;
+	if (error) *error = err;
+	if (err) return NULL;
+	void* previous = NODE_VALUE(tree, node);
+	NODE_VALUE(tree, node) = value;
+	return previous;
+}
+
 #ifdef _TEST
 EXPORT
 #else
 static
 #endif // !_TEST
-RBNode* paint_child_red(RBNode* node, int side) {
+RBNode* paint_child_red(const RBTree* tree, RBNode* node, int side) {
 	RBNode* child = node->child[side];
 	child->red = 1;
+	STAT(recolors, 1);
 	if ((! child->child[side] || ! child->child[side]->red)
 		&& child->child[1-side] && child->child[1-side]->red) {
 		// additional rotation
-		child = node->child[side] = rotate(child, side);
+		child = node->child[side] = rotate(tree, child, side);
 	}
 	if (child->child[side] && child->child[side]->red) {
-		node = rotate(node, 1 - side);
+		node = rotate(tree, node, 1 - side);
 		node->child[side]->red = 0;
+		STAT(recolors, 1);
 	}
 	return node;
 }
 
-/**
- * @brief Removes an element from a tree and returns it.
- * 
- * @param tree : the tree to search
- * @param key : the key for which an element is to be retrieved
- * @return : NULL if the key could not be found or the removed element
-*/
-void* RBremove(RBTree* tree, void* key) {
+/*
+ * Exchanges the places of the node at depth top of the path of iter and of
+ * its successor, which ends the path, so that the node can be unlinked from
+ * the place of the successor. Nodes belong to their elements in an intrusive
+ * tree, so the successor node has to move instead of its element.
+ */
+static void swap_successor(RBTree* tree, RBIter* iter, int top) {
+	RBNode* found = iter->elt[top].node;
+	RBNode* succ = iter->elt[iter->curdepth].node;
+	int_fast8_t red = found->red;
+	found->red = succ->red;
+	succ->red = red;
+	succ->child[0] = found->child[0];
+	found->child[0] = NULL;
+	if (succ == found->child[1]) {
+		found->child[1] = succ->child[1];
+		succ->child[1] = found;
+	}
+	else {
+		RBNode* right = succ->child[1];
+		succ->child[1] = found->child[1];
+		found->child[1] = right;
+		iter->elt[iter->curdepth - 1].node->child[0] = found;
+	}
+	if (0 == top) tree->root = succ;
+	else iter->elt[top - 1].node->child[iter->elt[top].right] = succ;
+	iter->elt[top].node = succ;
+	iter->elt[iter->curdepth].node = found;
+}
+
+/*
+ * Removes the element of a key from a tree and gives in *value the value of
+ * the key if the tree is a map.
+ */
+static void* tree_remove(RBTree* tree, void* key, void** value) {
+#ifdef RB_TOPDOWN
+	if (NULL == tree->combine && RB_BALANCE_RB == tree->balance) {
+		return topdown_remove(tree, key, value);
+	}
+#endif
 	int how;
 	RBNode* to_del = NULL;
 
 	RBIter* iter = search(tree, key, &how);
-	if (iter == NULL) return NULL;
-	if (how != 0) {
+	if (iter == NULL || how != 0 || iter->elt[iter->curdepth].node->dead) {
 		RBiter_release(iter);
+		STAT_FLUSH(tree);
 		return NULL;
 	}
 	RBNode * node = iter->elt[iter->curdepth].node;
+	RBNode* found = node;
 	void *data = node->data;
-	void** old = &(node->data);
 	RBNode* child;
 	if (node->child[1] != NULL) {
+		int top = iter->curdepth;
 		node = node->child[1];
 		iter_push(iter, node, 1);
 		while (node->child[0] != NULL) {
 			node = node->child[0];
 			iter_push(iter, node, 0);
 		}
+		swap_successor(tree, iter, top);
+		node = found;
 		child = node->child[1];
-		*old = node->data;
 	}
 	else {
 		child = node->child[0];
@@ -419,9 +1701,18 @@ void* RBremove(RBTree* tree, void* key) {
 		iter->elt[iter->curdepth - 1].node->child[iter->elt[
 			iter->curdepth].right] = child
 		;
+		augment_path(tree, iter, iter->curdepth - 1);
+		if (RB_BALANCE_AVL == tree->balance) {
+			avl_fix(tree, iter, iter->curdepth - 1);
+		}
+		else if (RB_BALANCE_WAVL == tree->balance) {
+			wavl_remove_fix(tree, iter, iter->curdepth - 1,
+				iter->elt[iter->curdepth].right);
+		}
 		// handle a possible black violation.
-		if (node->child[1] && node->child[1]->red) {
+		else if (node->child[1] && node->child[1]->red) {
 			node->child[1]->red = 0;
+			STAT(recolors, 1);
 		}
 		else if (0 == node->red) {
 			int done = 0;
@@ -432,22 +1723,25 @@ void* RBremove(RBTree* tree, void* key) {
 				if (node->red) {
 					// found a red ancestor
 					node->red = 0;
-					node = paint_child_red(node, 1 - side);
+					STAT(recolors, 1);
+					node = paint_child_red(tree, node, 1 - side);
 					done = 1;
 				}
 				else if (node->child[1 - side]->red) {
 					// found a red sibling
 					RBNode* old = node;
-					node = rotate(node, side);
+					node = rotate(tree, node, side);
 					node->red = 0;
-					node->child[side] = paint_child_red(
+					STAT(recolors, 1);
+					node->child[side] = paint_child_red(tree,
 						old, 1 - side);
 					done = 1;
 				}
 				else {
-					node = paint_child_red(node, 1 - side);
+					node = paint_child_red(tree, node, 1 - side);
 					if (node->red) {
 						node->red = 0;
+						STAT(recolors, 1);
 						done = 1;
 					}
 				}
@@ -464,16 +1758,238 @@ void* RBremove(RBTree* tree, void* key) {
 		}
 	}
 	RBiter_release(iter);
+	if (RB_BALANCE_RB != tree->balance) tree->black_depth = RANK(tree->root);
 	// handle a possible red root
-	if (tree->root && tree->root->red) {
+	else if (tree->root && tree->root->red) {
 		tree->root->red = 0;
 		tree->black_depth += 1;
+		STAT(recolors, 1);
 	}
 	tree->count -= 1;
-	free(to_del);
+	if (tree->map) *value = NODE_VALUE(tree, to_del);
+	free_node(tree, to_del);
+	STAT_FLUSH(tree);
+	return data;
+}
+
+// Removes an element from a tree and its indexes
+static void* remove_kv(RBTree* tree, void* key, void** value) {
+	void* data = tree_remove(tree, key, value);
+	if (NULL != data) {
+		tree->mods += 1;
+		if (NULL != tree->expiry) expiry_del(tree, data);
+		if (NULL != tree->hash) hash_del(tree, data);
+	}
 	return data;
 }
 
+/**
+ * @brief Removes an element from a tree and returns it.
+ * 
+ * @param tree : the tree to search
+ * @param key : the key for which an element is to be retrieved
+ * @return : NULL if the key could not be found or the removed element
+*/
+void* RBremove(RBTree* tree, void* key) {
+	void* value;
+	return remove_kv(tree, key, &value);
+}
+
+/**
+ * @brief Removes a key from a map and returns it with its value.
+ *
+ * @param tree : the map (see RBmap)
+ * @param key : the key to remove
+ * @param value : a pointer receiving the value of the removed key, left
+ *                unchanged if the key could not be found
+ * @return : NULL if the key could not be found or the tree is not a map, or
+ *           the removed key
+*/
+void* RBremove_kv(RBTree* tree, void* key, void** value) {
+	return tree->map ? remove_kv(tree, key, value) : NULL;
+}
+
+/**
+ * @brief Removes an element from a tree without restructuring it.
+ *
+ * The node of the element is only marked as deleted (a tombstone): finds,
+ * iterators and walks skip it and it is no longer counted, but it stays in
+ * the tree, which still uses its element for comparisons, until RBpurge or
+ * RBdestroy releases it. The removal is then a mere search, while RBpurge
+ * removes all the tombstones in a single linear pass, typically once
+ * tree->dead becomes a significant part of the nodes. It is not available
+ * on augmented trees, whose aggregates would still include the element.
+ *
+ * @param tree : the tree to search
+ * @param key : the key for which an element is to be removed
+ * @return : 1 if an element was marked as deleted, 0 if the key could not
+ *           be found or -1 if the tree is augmented or on comparison error
+*/
+int RBremove_lazy(RBTree* tree, void* key) {
+	if (NULL != tree->combine) return -1;
+	RBNode* node = tree->root;
+	int err = 0;
+	uint64_t kp = KEY_PREFIX(tree, key);
+	for (int depth = 0; NULL != node; depth++) {
+		int cmp = key_comp(tree, key, kp, node, &err);
+		STAT_DEPTH(depth);
+		if (err) {
+			STAT_FLUSH(tree);
+			return -1;
+		}
+		if (0 == cmp) break;
+		node = node->child[cmp > 0];
+	}
+	STAT_FLUSH(tree);
+	if (NULL == node || node->dead) return 0;
+	node->dead = 1;
+	tree->dead += 1;
+	tree->count -= 1;
+	if (NULL != tree->expiry) expiry_del(tree, node->data);
+	if (NULL != tree->hash) hash_del(tree, node->data);
+	return 1;
+}
+
+// Relinks sorted nodes into a perfectly balanced subtree, like node_build
+static RBNode* node_relink(const RBTree* tree, RBNode** nodes, size_t n,
+		int depth, int full) {
+	if (0 == n) return NULL;
+	size_t mid = n / 2;
+	RBNode* node = nodes[mid];
+	node->child[0] = node_relink(tree, nodes, mid, depth + 1, full);
+	node->child[1] = node_relink(tree, nodes + mid + 1, n - mid - 1,
+		depth + 1, full);
+	paint_balanced(tree, node, depth, full);
+	if (NULL != tree->combine) augment(tree, node);
+	return node;
+}
+
+/**
+ * @brief Releases the elements removed with RBremove_lazy.
+ *
+ * The nodes of the tombstones are freed and the remaining ones are relinked
+ * into a perfectly balanced tree, in a single linear pass without any
+ * comparison. If dele is not NULL, it is applied to the released elements.
+ *
+ * @param tree : the tree to purge
+ * @param dele : an optional function to release the removed elements
+ * @return : 0 on success or -1 if memory could not be allocated, in which
+ *           case the tree is unchanged
+*/
+int RBpurge(RBTree* tree, void (*dele)(const void*)) {
+	if (0 == tree->dead) return 0;
+	RBNode** nodes = malloc((tree->count ? tree->count : 1) * sizeof(*nodes));
+	if (NULL == nodes) return -1;
+	RBNode* stack[RB_MAX_DEPTH];
+	int depth = 0;
+	size_t n = 0;
+	RBNode* node = tree->root;
+	while (NULL != node || depth > 0) {
+		if (NULL != node) {
+			stack[depth++] = node;
+			node = node->child[0];
+			continue;
+		}
+		node = stack[--depth];
+		RBNode* next = node->child[1];
+		if (node->dead) {
+			if (dele) dele(node->data);
+			free_node(tree, node);
+		}
+		else nodes[n++] = node;
+		node = next;
+	}
+	int full = complete_levels(n);
+	tree->root = node_relink(tree, nodes, n, 0, full);
+	tree->black_depth = (RB_BALANCE_RB == tree->balance) ? full
+		: RANK(tree->root);
+	tree->dead = 0;
+	tree->mods += 1;
+	free(nodes);
+	STAT_FLUSH(tree);
+	return 0;
+}
+
+/**
+ * @brief Removes all the elements matching a predicate.
+ *
+ * A single in order walk applies pred to every element and sets the
+ * matching ones apart. If they are many, the other nodes are then relinked
+ * into a perfectly balanced tree in linear time without any comparison, like
+ * RBpurge does. If they are few compared to the size of the tree, they are
+ * rather removed one by one, which costs less than relinking the whole tree.
+ * Elements removed with RBremove_lazy are not passed to pred and are kept.
+ * pred must not change the tree. If dele is not NULL, it is applied to the
+ * removed elements.
+ *
+ * @param tree : the tree to filter
+ * @param pred : the predicate, called as pred(element, ctx), returning non
+ *               zero for the elements to remove
+ * @param ctx : an optional context passed to pred
+ * @param dele : an optional function to release the removed elements
+ * @return : the number of removed elements or -1 if memory could not be
+ *           allocated, in which case the tree is unchanged
+*/
+long RBremove_if(RBTree* tree, int (*pred)(void*, void*), void* ctx,
+		void (*dele)(const void*)) {
+	if (0 == tree->count) return 0;
+	size_t total = (size_t)tree->count + tree->dead;
+	RBNode** nodes = malloc(total * sizeof(*nodes));
+	if (NULL == nodes) return -1;
+	// the kept nodes fill the array from its start, the matching ones from
+	// its end
+	size_t n = 0, k = 0;
+	RBNode* stack[RB_MAX_DEPTH];
+	int depth = 0;
+	RBNode* node = tree->root;
+	while (NULL != node || depth > 0) {
+		if (NULL != node) {
+			stack[depth++] = node;
+			node = node->child[0];
+			continue;
+		}
+		node = stack[--depth];
+		if (!node->dead && pred(node->data, ctx)) nodes[total - ++k] = node;
+		else nodes[n++] = node;
+		node = node->child[1];
+	}
+	if (0 == k) {
+		free(nodes);
+		return 0;
+	}
+	// a removal visits about black_depth + 1 nodes and a relinking all of them
+	if (k * (1 + (size_t)tree->black_depth) < n) {
+		void** data = (void**)nodes + n;
+		// the removals may move the elements between nodes
+		for (size_t i = 0; i < k; i++) data[i] = nodes[n + i]->data;
+		long removed = 0;
+		for (size_t i = 0; i < k; i++) {
+			// only a failing comparison could leave an element in place
+			if (NULL == RBremove(tree, data[i])) continue;
+			if (dele) dele(data[i]);
+			removed += 1;
+		}
+		free(nodes);
+		return removed;
+	}
+	for (size_t i = n; i < total; i++) {
+		void* data = nodes[i]->data;
+		if (NULL != tree->expiry) expiry_del(tree, data);
+		if (NULL != tree->hash) hash_del(tree, data);
+		free_node(tree, nodes[i]);
+		if (dele) dele(data);
+	}
+	int full = complete_levels(n);
+	tree->root = node_relink(tree, nodes, n, 0, full);
+	tree->black_depth = (RB_BALANCE_RB == tree->balance) ? full
+		: RANK(tree->root);
+	tree->count -= (unsigned)k;
+	tree->mods += 1;
+	free(nodes);
+	STAT_FLUSH(tree);
+	return (long)k;
+}
+
 /* *
  * @brief Inserts an array of elements into a valid tree.
  *
@@ -501,35 +2017,83 @@ size_t RBbulk_insert(RBTree* tree, void** data, size_t n,
 }
 */
 
-static int node_validate(RBNode *node, int *total, 
-		int (*comp)(const void *, const void *),
-		int (*comperr)(const void*, const void *, int *,
-			int (*c)(const void *, const void*))) {
-	int child_level[2];
+// Checks the rank of a node of an AVL or WAVL tree against the ranks of its
+// children
+static int rank_valid(int balance, int rank, const int* level) {
+	if (RB_BALANCE_AVL == balance) {
+		int high = (level[0] > level[1]) ? level[0] : level[1];
+		return rank == high + 1 && level[0] - level[1] <= 1
+			&& level[1] - level[0] <= 1;
+	}
+	for (int i = 0; i < 2; i++) {
+		if (rank - level[i] < 1 || rank - level[i] > 2) return 0;
+	}
+	// a leaf has rank 1
+	return rank < 2 || level[0] > 0 || level[1] > 0;
+}
+
+// Post-order walk keeping on an explicit stack the black level (or the rank)
+// of the already validated children of every node of the current path.
+static int node_validate(const RBTree* tree, RBNode *node, int *total) {
+	int balance = tree->balance;
+	struct {
+		RBNode* node;
+		int side;
+		int level[2];
+	} stack[RB_MAX_DEPTH];
+	int depth = 0;
 	int err = 0;
+	stack[0].node = node;
+	stack[0].side = 0;
 	*total += 1;
-	for (int i = 0; i < 2; i++) {
-		if (node->child[i] == 0) child_level[i] = 0;
-		else {
-			if (node->red && node->child[i]->red) return -RED_VIOLATION;
-			int delta = comperr(node->child[i]->data, node->data, &err, comp);
+	for (;;) {
+		node = stack[depth].node;
+		int i = stack[depth].side;
+		if (i < 2) {
+			RBNode* child = node->child[i];
+			if (child == 0) {
+				stack[depth].level[i] = 0;
+				stack[depth].side += 1;
+				continue;
+			}
+			if (RB_BALANCE_RB == balance && node->red && child->red) {
+				return -RED_VIOLATION;
+			}
+			int delta = elt_comp(tree, child->data, node->data, &err);
 			if (err || (delta >= 0 && 0 == i) || (delta <= 0 && 1 == i)) {
 				return -ORDER_ERROR;
 			}
-			int lev = node_validate(node->child[i], total, comp, comperr);
-			if (lev < 0) return lev;
-			child_level[i] = lev;
+			// a path that long cannot exist in a valid tree
+			if (++depth == RB_MAX_DEPTH) return -DEPTH_ERROR;
+			stack[depth].node = child;
+			stack[depth].side = 0;
+			*total += 1;
+		}
+		else {
+			int lev = node->red;
+			if (RB_BALANCE_RB != balance) {
+				if (!rank_valid(balance, lev, stack[depth].level)) {
+					return -RANK_ERROR;
+				}
+			}
+			else if (stack[depth].level[0] != stack[depth].level[1]) {
+				return -BLACK_VIOLATION;
+			}
+			else lev = stack[depth].level[0] + (!node->red);
+			if (0 == depth) return lev;
+			depth -= 1;
+			stack[depth].level[stack[depth].side++] = lev;
 		}
 	}
-	if (child_level[0] != child_level[1]) return -BLACK_VIOLATION;
-	return child_level[0] + (!node->red);
 }
 
 /**
  * @brief Validates a tree.
  *
  * RBvalidate controls that a tree is correctly ordered, contains neither
- * red nor black violation and that its black_depth and count are correct.
+ * red nor black violation and that its black_depth and count (plus the
+ * number of tombstones) are correct. The ranks of an AVL or WAVL tree
+ * (see RBbalance) are checked instead of the colors (RANK_ERROR).
  *
  * @param tree : the tree to validate
  * @return : 0 if the tree is correct or a (non-zero) error code
@@ -537,11 +2101,11 @@ static int node_validate(RBNode *node, int *total,
 int RBvalidate(RBTree* tree) {
 	if ((0 == tree->black_depth) && (NULL == tree->root)) return 0;
 	if ((0 == tree->black_depth) || (NULL == tree->root)) return DEPTH_ERROR;
-	if (tree->root->red) return RED_ROOT;
+	if (RB_BALANCE_RB == tree->balance && tree->root->red) return RED_ROOT;
 	int total = 0;
-	int lev = node_validate(tree->root, &total, tree->comp, tree->comperr);
+	int lev = node_validate(tree, tree->root, &total);
 	if (lev < 0) return -lev;
 	if (lev != tree->black_depth) return DEPTH_ERROR;
-	if (total != tree->count) return COUNT_ERROR;
+	if (total != tree->count + tree->dead) return COUNT_ERROR;
 	return 0;
 }
@@ -1,8 +1,21 @@
 #ifndef RBTREE_H
 #define RBTREE_H
 
+// EXPORT marks the public functions. When building a DLL on Windows, the
+// library sources define RBTREE_BUILD to export them while users import them.
+// RBTREE_STATIC must be defined when building or using a static library.
 #ifndef EXPORT
-#define EXPORT __declspec(dllimport) 
+#if defined(RBTREE_STATIC)
+#define EXPORT
+#elif defined(_WIN32) && defined(RBTREE_BUILD)
+#define EXPORT __declspec(dllexport)
+#elif defined(_WIN32)
+#define EXPORT __declspec(dllimport)
+#elif defined(__GNUC__)
+#define EXPORT __attribute__((visibility("default")))
+#else
+#define EXPORT
+#endif
 #endif // EXPORT
 
 #define BLACK_VIOLATION 1
@@ -11,7 +24,15 @@
 #define DEPTH_ERROR 4
 #define ORDER_ERROR 5
 #define COUNT_ERROR 6
+#define RANK_ERROR 7
+
+// Balancing policies (see RBbalance)
+#define RB_BALANCE_RB 0
+#define RB_BALANCE_AVL 1
+#define RB_BALANCE_WAVL 2
 
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #ifdef __cplusplus
@@ -23,16 +44,126 @@ extern "C" {
 	// Some opaque structures
 	typedef struct _RBNode RBNode;
 	typedef struct _RBIter RBIter;
+	typedef struct _RBJournal RBJournal;
+	typedef struct _RBHash RBHash;
+	typedef struct _RBPool RBPool;
+	typedef struct _RBFinger RBFinger;
+	typedef struct _RBMerge RBMerge;
+
+	// Operation counters (only maintained if the library is built with RB_STATS)
+#define RB_STATS_DEPTHS 64
+	typedef struct _RBStats {
+		unsigned long long comparisons;
+		unsigned long long rotations;
+		unsigned long long recolors;
+		unsigned long long allocs;
+		unsigned long long frees;
+		unsigned long long iterators;
+		unsigned long long searches;
+		// number of searches per depth where they stopped (the last
+		// element counts all deeper searches)
+		unsigned long long depths[RB_STATS_DEPTHS];
+	} RBStats;
 
 	// The main structure
 	typedef struct _RBTree {
 		RBNode* root;
+		// rank of the root if the tree is not red-black (see RBbalance)
 		unsigned black_depth;
 		unsigned count;
+		unsigned dead;	// number of tombstones (see RBremove_lazy)
+		// incremented by every change of the structure (see RBfinger_open)
+		unsigned long mods;
 		int (*comp)();
 		int (*comperr)(const void*, const void*, int*, int (*comp)());
+		// augmented value stored with every node (see RBaugment) and
+		// computed by combine(aug, element, left aug, right aug, augctx)
+		size_t augsize;
+		void (*combine)(void*, const void*, const void*, const void*,
+			const void*);
+		const void* augctx;
+		struct _RBTree* expiry;	// deadline ordered index (see RBexpiry)
+		// orders the elements of a deadline ordered index before comp
+		int64_t (*deadline)(const void*);
+		RBHash* hash;	// exact match index (see RBhash)
+		RBPool* pool;	// block or arena of the nodes (see RBcompact, RBpool)
+		// abbreviated key kept in every node (see RBprefix)
+		uint64_t (*prefix)(const void*);
+		int balance;	// balancing policy (see RBbalance)
+		int map;	// nodes also hold a value (see RBmap)
+		// elements embed their node at offset link (see RBintrusive)
+		int intrusive;
+		size_t link;
+#ifdef RB_STATS
+		RBStats stats;
+#endif
 	} RBTree;
 
+	// The node embedded in the elements of an intrusive tree, reserved for
+	// the tree while the element is in it
+	typedef struct _RBLink {
+		void* reserved[3];
+		int_fast8_t flags[2];
+	} RBLink;
+
+	// Access to the endpoints of the elements of an interval tree
+	typedef struct _RBInterval {
+		// the low and high endpoints of an element
+		const void* (*low)(const void* elt);
+		const void* (*high)(const void* elt);
+		// compares 2 endpoints
+		int (*comp)(const void* a, const void* b);
+	} RBInterval;
+
+	// Memory used by a tree (see RBmemory_usage)
+	typedef struct _RBMemory {
+		size_t node_size;	// bytes per node
+		size_t nodes;	// bytes of the nodes, tombstones included
+		size_t pooled;	// part of nodes in the block of RBcompact or the arena
+		// free slots of the block, estimated allocator headers of the other
+		// nodes and indexes
+		size_t overhead;
+	} RBMemory;
+
+	// Options of the node arena of a tree (see RBpool)
+#define RB_POOL_HUGE 1	// back the arena with 2MB huge pages
+#define RB_POOL_BIND 2	// allocate the arena on the given NUMA nodes
+#define RB_POOL_INTERLEAVE 4	// spread the arena on the given NUMA nodes
+
+	// Shape and memory locality of a tree (see RBanalyze)
+#define RB_REPORT_LEVELS 64
+#define RB_REPORT_DISTANCES 64
+	typedef struct _RBReport {
+		size_t nodes;	// tombstones included
+		size_t red;	// 0 for AVL and WAVL trees
+		size_t dead;
+		int height;	// nodes on the longest path from the root
+		double avg_path;	// average number of nodes visited by a search
+		// the same in a perfectly balanced tree
+		int min_height;
+		double min_avg_path;
+		// number of nodes per depth from the root (the last element counts
+		// all deeper nodes)
+		size_t levels[RB_REPORT_LEVELS];
+		// number of parent child links per log2 of the distance of their
+		// addresses in bytes
+		size_t distances[RB_REPORT_DISTANCES];
+		size_t same_line;	// links within a 64 bytes cache line
+		size_t same_page;	// links within a 4KB page
+	} RBReport;
+
+	// Formats of the writer of RBanalyze
+#define RB_ANALYZE_DOT 1
+#define RB_ANALYZE_JSON 2
+
+	// A saved tree queried in place (typically memory mapped)
+	typedef struct _RBImage {
+		const unsigned char* base;
+		size_t size;
+		size_t count;
+		const uint64_t* offsets;
+	} RBImage;
+
 	// The public interface functions
 
 	// Initializes a new tree given a comparison function.
@@ -42,30 +173,145 @@ extern "C" {
 	EXPORT void RBinit2(RBTree* tree, int (*comperr)(const void*, const void*,
 		int*));
 
+	// Selects the balancing policy of an empty tree
+	EXPORT int RBbalance(RBTree* tree, int policy);
+
+	// Makes an empty tree use the RBLink found at offset in its elements
+	EXPORT int RBintrusive(RBTree* tree, size_t offset);
+
+	// Makes an empty tree a map whose nodes also hold a value
+	EXPORT int RBmap(RBTree* tree);
+
+	// Makes an empty tree keep an abbreviated key in every node
+	EXPORT int RBprefix(RBTree* tree, uint64_t (*prefix)(const void*));
+
+	// Abbreviated key of a string: its first 8 bytes in big endian order
+	EXPORT uint64_t RBprefix_string(const char* str);
+
+	// Moves the nodes of a tree into a contiguous block in traversal order
+	EXPORT int RBcompact(RBTree* tree);
+
+	// Reports the memory used by the nodes of a tree and its overhead
+	EXPORT void RBmemory_usage(const RBTree* tree, RBMemory* usage);
+
+	// Makes an empty tree allocate its nodes from an arena of large chunks
+	EXPORT int RBpool(RBTree* tree, int flags, unsigned long nodes);
+
+	// Initializes a new interval tree
+	EXPORT void RBinit_interval(RBTree* tree,
+		int (*comp)(const void*, const void*), const RBInterval* interval);
+
+	// Augments an empty tree with an aggregate of its subtree in every node
+	EXPORT int RBaugment(RBTree* tree, size_t size,
+		void (*combine)(void*, const void*, const void*, const void*,
+			const void*), const void* ctx);
+
+	// Computes the aggregate of the elements with lo <= key < hi
+	EXPORT int RBaggregate_range(RBTree* tree, void* lo, void* hi, void* out);
+
+	// Adds a hash index to an empty tree to speed up RBfind
+	EXPORT int RBhash(RBTree* tree, size_t (*hash)(const void*));
+
+	// Gives deadlines to the elements of an empty tree
+	EXPORT int RBexpiry(RBTree* tree, int64_t (*deadline)(const void*));
+
+	// Removes the elements whose deadline is not after now
+	EXPORT long RBexpire(RBTree* tree, int64_t now, void (*dele)(const void*));
+
 	// Inserts a new element into a valid tree and return the previous element with same key if any.
 	EXPORT void *RBinsert(RBTree* tree, void* data, int *error);
 
+	// Inserts a key with a value into a map and returns the previous value
+	EXPORT void* RBinsert_kv(RBTree* tree, void* key, void* value,
+		void** old, int* error);
+
 	// Removes an element from a tree and returns it
 	EXPORT void* RBremove(RBTree* tree, void* key);
 
+	// Removes a key from a map and returns it with its value
+	EXPORT void* RBremove_kv(RBTree* tree, void* key, void** value);
+
+	// Marks an element as removed without restructuring the tree
+	EXPORT int RBremove_lazy(RBTree* tree, void* key);
+
+	// Releases the elements marked by RBremove_lazy and rebalances the tree
+	EXPORT int RBpurge(RBTree* tree, void (*dele)(const void*));
+
+	// Removes all the elements matching a predicate
+	EXPORT long RBremove_if(RBTree* tree, int (*pred)(void*, void*),
+		void* ctx, void (*dele)(const void*));
+
 	// Finds an element from a tree and returns it if found or returns NULL
 	EXPORT void* RBfind(RBTree* tree, void* key);
 
+	// Finds the key of a map and returns the slot of its value
+	EXPORT void** RBfind_slot(RBTree* tree, void* key);
+
 	// Searches a tree from a key and returns an iterator positioned there
 	EXPORT RBIter* RBsearch(RBTree* tree, void* key);
 
+	// Creates a finger remembering the path of the last search in a tree
+	EXPORT RBFinger* RBfinger_open(RBTree* tree);
+
+	// Releases a finger
+	EXPORT void RBfinger_close(RBFinger* finger);
+
+	// Same as RBfind, starting from the last search of a finger
+	EXPORT void* RBfinger_find(RBFinger* finger, void* key);
+
+	// Same as RBsearch, starting from the last search of a finger
+	EXPORT RBIter* RBfinger_search(RBFinger* finger, void* key);
+
 	// Gets an iterator positioned at the first element of a tree
 	EXPORT RBIter* RBfirst(RBTree* tree);
 
+	// Builds an iterator which survives the changes of its tree
+	EXPORT RBIter* RBcursor(RBTree* tree, void* key);
+
 	// Gets next element from an iterator (returns NULL at the end)
 	EXPORT void* RBnext(RBIter* iter);
 
+	// Calls fn on every element in order until it returns a non zero value
+	EXPORT int RBforeach(RBTree* tree, int (*fn)(void*, void*), void* ctx);
+
+	// Calls fn on every key of a map and the slot of its value in order
+	EXPORT int RBforeach_kv(RBTree* tree, int (*fn)(void*, void**, void*),
+		void* ctx);
+
+	// Calls fn in order on every element with lo <= key < hi
+	EXPORT int RBforeach_range(RBTree* tree, void* lo, void* hi,
+		int (*fn)(void*, void*), void* ctx);
+
+	// Calls fn in order on every interval overlapping [lo, hi]
+	EXPORT int RBoverlaps(RBTree* tree, const void* lo, const void* hi,
+		int (*fn)(void*, void*), void* ctx);
+
+	// Calls fn in order on every interval containing point
+	EXPORT int RBstab(RBTree* tree, const void* point,
+		int (*fn)(void*, void*), void* ctx);
+
 	// Release all resources associated with an iterator.
 	EXPORT void RBiter_release(RBIter* iter);
 
+	// Builds an iterator merging the elements of several trees in order
+	EXPORT RBMerge* RBmerge_iter(RBTree** trees, size_t k,
+		void* (*resolve)(void*, void*));
+
+	// Positions a merged iterator at a key of all its trees at once
+	EXPORT int RBmerge_seek(RBMerge* merge, void* key);
+
+	// Gets the next element of a merged iterator (returns NULL at the end)
+	EXPORT void* RBmerge_next(RBMerge* merge);
+
+	// Releases a merged iterator
+	EXPORT void RBmerge_release(RBMerge* merge);
+
 	// Completely cleans a tree.
 	EXPORT void RBdestroy(RBTree* tree, void (*dele)(const void*));
 
+	// Fills an empty tree with elements sorted by key in linear time
+	EXPORT int RBbuild(RBTree* tree, void** data, void** values, size_t n);
+
 	/*
 	// Inserts an array of elements into a valid tree.
 	EXPORT size_t RBbulk_insert(RBTree* tree, void** data, size_t n,
@@ -81,6 +327,59 @@ extern "C" {
 	// Duplicates a tree
 	EXPORT RBTree* RBclone(RBTree* old, void* (*process)(void* const));
 
+	// Copies the operation counters of a tree and resets them
+	EXPORT int RBstats(RBTree* tree, RBStats* out);
+
+	// Reports the shape and locality of a tree and optionally writes it out
+	EXPORT int RBanalyze(RBTree* tree, RBReport* report, FILE* out,
+		int format, void (*label)(const void*, char*, size_t));
+
+	// Saves a tree in key order to a file descriptor
+	EXPORT int RBsave(RBTree* tree, int fd,
+		size_t (*serialize)(const void*, void*, size_t));
+
+	// Loads a saved tree into an empty tree
+	EXPORT int RBload(RBTree* tree, int fd,
+		void* (*deserialize)(const void*, size_t), void (*dele)(const void*));
+
+	// Opens the in memory image of a saved tree
+	EXPORT int RBimage_open(RBImage* image, const void* base, size_t size);
+
+	// Gets a serialized record from an image by its position
+	EXPORT const void* RBimage_get(const RBImage* image, size_t index,
+		size_t* size);
+
+	// Gets the position of the first record not lower than a key in an image
+	EXPORT size_t RBimage_search(const RBImage* image, const void* key,
+		int (*comp)(const void*, const void*, size_t));
+
+	// Finds a key in an image and returns the serialized record or NULL
+	EXPORT const void* RBimage_find(const RBImage* image, const void* key,
+		int (*comp)(const void*, const void*, size_t), size_t* size);
+
+	// Starts journaling the changes of a tree into an empty log
+	EXPORT RBJournal* RBjournal_open(RBTree* tree, int fd,
+		size_t (*serialize)(const void*, void*, size_t), unsigned batch);
+
+	// Inserts an element into a journaled tree
+	EXPORT void* RBjournal_insert(RBJournal* journal, void* data, int* error);
+
+	// Removes an element from a journaled tree and returns it
+	EXPORT void* RBjournal_remove(RBJournal* journal, void* key);
+
+	// Writes and syncs the pending records of a journal
+	EXPORT int RBjournal_commit(RBJournal* journal);
+
+	// Saves a snapshot of a journaled tree and restarts the journal on a new log
+	EXPORT int RBjournal_checkpoint(RBJournal* journal, int snapfd, int logfd);
+
+	// Commits the pending records and releases a journal
+	EXPORT int RBjournal_close(RBJournal* journal);
+
+	// Replays a journal into a tree and returns the number of records applied
+	EXPORT long RBjournal_replay(RBTree* tree, int fd,
+		void* (*deserialize)(const void*, size_t), void (*dele)(const void*));
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,175 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <algorithm>
+#include <map>
+#include <random>
+
+namespace {
+	struct Item {
+		int key;
+		long val;
+	};
+
+	struct Agg {
+		long sum;
+		long min;
+		long max;
+		long count;
+	};
+
+	int compare(const void* a, const void* b) {
+		return ((const Item*)a)->key - ((const Item*)b)->key;
+	}
+
+	int compare_err(const void* a, const void* b, int* err) {
+		if (((const Item*)a)->key < 0 || ((const Item*)b)->key < 0) *err = 1;
+		return compare(a, b);
+	}
+
+	void combine(void* aug, const void* data, const void* left,
+			const void* right, const void* ctx) {
+		Agg* agg = (Agg*)aug;
+		long val = ((const Item*)data)->val;
+		*agg = { val, val, val, 1 };
+		for (const void* child : { left, right }) {
+			if (child == nullptr) continue;
+			const Agg* c = (const Agg*)child;
+			agg->sum += c->sum;
+			agg->min = std::min(agg->min, c->min);
+			agg->max = std::max(agg->max, c->max);
+			agg->count += c->count;
+		}
+		*(int*)ctx += 1;
+	}
+
+	void dele(const void* data) {
+		delete (const Item*)data;
+	}
+}
+
+class TestAggregate : public ::testing::Test {
+protected:
+	RBTree tree;
+	std::map<int, long> content;
+	std::mt19937 rg;
+	int calls;
+
+	TestAggregate() : rg(0), calls(0) {
+		RBinit(&tree, compare);
+		RBaugment(&tree, sizeof(Agg), combine, &calls);
+	}
+
+	~TestAggregate() {
+		RBdestroy(&tree, dele);
+	}
+
+	void fill(int nb, int range) {
+		for (int i = 0; i < nb; i++) {
+			int key = rg() % range;
+			if (rg() % 4) {
+				Item* item = new Item{ key, (long)(rg() % 1000) - 500 };
+				Item* old = (Item*)RBinsert(&tree, item, nullptr);
+				if (old) dele(old);
+				content[key] = item->val;
+			}
+			else {
+				Item k{ key, 0 };
+				Item* old = (Item*)RBremove(&tree, &k);
+				if (old) dele(old);
+				content.erase(key);
+			}
+		}
+	}
+
+	void check(RBTree* t, const Item* lo, const Item* hi) {
+		auto first = lo ? content.lower_bound(lo->key) : content.begin();
+		auto last = hi ? content.lower_bound(hi->key) : content.end();
+		Agg agg;
+		if (lo && hi && hi->key <= lo->key) first = last;
+		if (first == last) {
+			EXPECT_EQ(1, RBaggregate_range(t, (void*)lo, (void*)hi, &agg));
+			return;
+		}
+		Agg exp = { 0, first->second, first->second, 0 };
+		for (auto it = first; it != last; ++it) {
+			exp.sum += it->second;
+			exp.min = std::min(exp.min, it->second);
+			exp.max = std::max(exp.max, it->second);
+			exp.count += 1;
+		}
+		ASSERT_EQ(0, RBaggregate_range(t, (void*)lo, (void*)hi, &agg));
+		EXPECT_EQ(exp.sum, agg.sum);
+		EXPECT_EQ(exp.min, agg.min);
+		EXPECT_EQ(exp.max, agg.max);
+		EXPECT_EQ(exp.count, agg.count);
+	}
+
+	void check_all(RBTree* t) {
+		for (int i = 0; i < 200; i++) {
+			Item lo{ (int)(rg() % 1100) - 50, 0 };
+			Item hi{ lo.key + (int)(rg() % 500), 0 };
+			check(t, &lo, &hi);
+			check(t, nullptr, &hi);
+			check(t, &lo, nullptr);
+		}
+		check(t, nullptr, nullptr);
+	}
+};
+
+TEST_F(TestAggregate, Range) {
+	for (int i = 0; i < 10; i++) {
+		fill(300, 1000);
+		ASSERT_EQ(0, RBvalidate(&tree));
+		check_all(&tree);
+	}
+}
+
+TEST_F(TestAggregate, Logarithmic) {
+	fill(20000, 100000);
+	Item lo{ 10, 0 }, hi{ 90000, 0 };
+	Agg agg;
+	calls = 0;
+	ASSERT_EQ(0, RBaggregate_range(&tree, &lo, &hi, &agg));
+	EXPECT_LT(agg.count, 20000);
+	EXPECT_GT(agg.count, 10000);
+	EXPECT_GE(2 * (int)(2 * tree.black_depth + 1), calls);
+}
+
+TEST_F(TestAggregate, Empty) {
+	Agg agg;
+	EXPECT_EQ(1, RBaggregate_range(&tree, nullptr, nullptr, &agg));
+	fill(10, 1000);
+	EXPECT_EQ(-1, RBaugment(&tree, sizeof(Agg), combine, &calls));
+}
+
+TEST_F(TestAggregate, Clone) {
+	fill(2000, 1000);
+	RBTree* copy = RBclone(&tree, [](void* const data) -> void* {
+		return new Item(*(Item*)data);
+		});
+	ASSERT_NE(nullptr, copy);
+	check_all(copy);
+	RBdestroy(copy, dele);
+	free(copy);
+}
+
+TEST_F(TestAggregate, Error) {
+	RBTree t;
+	RBinit2(&t, compare_err);
+	ASSERT_EQ(0, RBaugment(&t, sizeof(Agg), combine, &calls));
+	Item items[] = { {1, 1}, {2, 2}, {3, 3} };
+	for (Item& item : items) RBinsert(&t, &item, nullptr);
+	Item bad{ -1, 0 };
+	Agg agg;
+	EXPECT_EQ(-1, RBaggregate_range(&t, &bad, nullptr, &agg));
+	EXPECT_EQ(0, RBaggregate_range(&t, &items[1], nullptr, &agg));
+	EXPECT_EQ(5, agg.sum);
+	RBdestroy(&t, nullptr);
+}
+
+TEST(TestNotAugmented, Aggregate) {
+	RBTree t;
+	RBinit(&t, compare);
+	Agg agg;
+	EXPECT_EQ(-1, RBaggregate_range(&t, nullptr, nullptr, &agg));
+}
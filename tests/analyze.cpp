@@ -0,0 +1,108 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <cstdio>
+#include <string>
+
+namespace {
+	int compare(const void* a, const void* b) {
+		intptr_t x = (intptr_t)a, y = (intptr_t)b;
+		return (x > y) - (x < y);
+	}
+
+	void label(const void* data, char* buf, size_t size) {
+		snprintf(buf, size, "k%d", (int)(intptr_t)data);
+	}
+
+	// Analyzes a tree and gives its output in format
+	std::string write(RBTree* tree, RBReport* report, int format) {
+		FILE* out = tmpfile();
+		EXPECT_NE(nullptr, out);
+		EXPECT_EQ(0, RBanalyze(tree, report, out, format, label));
+		std::string text;
+		rewind(out);
+		for (int c; (c = fgetc(out)) != EOF;) text += (char)c;
+		fclose(out);
+		return text;
+	}
+}
+
+class TestAnalyze : public ::testing::Test {
+protected:
+	RBTree tree;
+
+	TestAnalyze() {
+		RBinit(&tree, compare);
+	}
+
+	~TestAnalyze() {
+		RBdestroy(&tree, nullptr);
+	}
+
+	void fill(int n) {
+		for (int i = 1; i <= n; i++) RBinsert(&tree, (void*)(intptr_t)i, nullptr);
+	}
+};
+
+TEST_F(TestAnalyze, Empty) {
+	RBReport report;
+	EXPECT_EQ(0, RBanalyze(&tree, &report, nullptr, 0, nullptr));
+	EXPECT_EQ(0u, report.nodes);
+	EXPECT_EQ(0, report.height);
+	EXPECT_EQ(0, report.min_height);
+	EXPECT_EQ("null\n", write(&tree, &report, RB_ANALYZE_JSON));
+	EXPECT_EQ(-1, RBanalyze(&tree, &report, stderr, 0, nullptr));
+}
+
+TEST_F(TestAnalyze, Small) {
+	fill(3);
+	RBremove_lazy(&tree, (void*)(intptr_t)3);
+	RBReport report;
+	EXPECT_EQ("{\"label\": \"k2\", \"red\": false, \"dead\": false, "
+		"\"left\": {\"label\": \"k1\", \"red\": true, \"dead\": false, "
+		"\"left\": null, \"right\": null}, "
+		"\"right\": {\"label\": \"k3\", \"red\": true, \"dead\": true, "
+		"\"left\": null, \"right\": null}}\n",
+		write(&tree, &report, RB_ANALYZE_JSON));
+	EXPECT_EQ(3u, report.nodes);
+	EXPECT_EQ(2u, report.red);
+	EXPECT_EQ(1u, report.dead);
+	EXPECT_EQ(2, report.height);
+	EXPECT_EQ(2, report.min_height);
+	EXPECT_DOUBLE_EQ(5.0 / 3, report.avg_path);
+	EXPECT_DOUBLE_EQ(5.0 / 3, report.min_avg_path);
+	EXPECT_EQ(1u, report.levels[0]);
+	EXPECT_EQ(2u, report.levels[1]);
+}
+
+TEST_F(TestAnalyze, Dot) {
+	fill(100);
+	RBReport report;
+	std::string dot = write(&tree, &report, RB_ANALYZE_DOT);
+	EXPECT_EQ(0u, dot.find("digraph rbtree {\n"));
+	size_t edges = 0;
+	for (size_t pos = 0; (pos = dot.find(" -> ", pos)) != std::string::npos; pos++) {
+		edges += 1;
+	}
+	EXPECT_EQ(99u, edges);
+	EXPECT_NE(std::string::npos, dot.find("[label=\"k100\", fillcolor=red"));
+	EXPECT_EQ("}\n", dot.substr(dot.size() - 2));
+}
+
+TEST_F(TestAnalyze, Shape) {
+	fill(10000);
+	RBReport report;
+	ASSERT_EQ(0, RBanalyze(&tree, &report, nullptr, 0, nullptr));
+	EXPECT_EQ(10000u, report.nodes);
+	size_t levels = 0, links = 0;
+	for (size_t n : report.levels) levels += n;
+	for (size_t n : report.distances) links += n;
+	EXPECT_EQ(report.nodes, levels);
+	EXPECT_EQ(report.nodes - 1, links);
+	EXPECT_EQ(14, report.min_height);
+	EXPECT_GE(report.height, report.min_height);
+	EXPECT_LE(report.height, 2 * report.min_height);
+	EXPECT_GE(report.avg_path, report.min_avg_path);
+	EXPECT_LE(report.same_line, report.same_page);
+	EXPECT_GT(report.red, 0u);
+	EXPECT_LT(report.red, report.nodes);
+}
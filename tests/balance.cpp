@@ -0,0 +1,164 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <cmath>
+#include <map>
+#include <random>
+#include <vector>
+
+extern "C" {
+#include "rbinternal.h"
+}
+
+namespace {
+	struct Item {
+		int key;
+		int val;
+	};
+
+	int compare(const void* a, const void* b) {
+		return ((const Item*)a)->key - ((const Item*)b)->key;
+	}
+
+	void dele(const void* data) {
+		delete (const Item*)data;
+	}
+
+	// sum of the values of a subtree
+	void combine(void* aug, const void* data, const void* left,
+			const void* right, const void*) {
+		long sum = ((const Item*)data)->val;
+		if (left) sum += *(const long*)left;
+		if (right) sum += *(const long*)right;
+		*(long*)aug = sum;
+	}
+
+	int collect(void* data, void* ctx) {
+		((std::vector<int>*)ctx)->push_back(((Item*)data)->key);
+		return 0;
+	}
+}
+
+class TestBalance : public ::testing::TestWithParam<int> {
+protected:
+	RBTree tree;
+	std::map<int, int> content;
+
+	TestBalance() {
+		RBinit(&tree, compare);
+	}
+
+	~TestBalance() {
+		RBdestroy(&tree, dele);
+	}
+
+	void churn(int n, int range, std::mt19937& rg) {
+		for (int i = 0; i < n; i++) {
+			int key = rg() % range;
+			Item k{ key, 0 };
+			if (rg() % 2) {
+				Item* old = (Item*)RBinsert(&tree, new Item{ key, i }, nullptr);
+				if (old) dele(old);
+				content[key] = i;
+			}
+			else {
+				Item* old = (Item*)RBremove(&tree, &k);
+				ASSERT_EQ(content.erase(key) > 0, old != nullptr);
+				if (old) dele(old);
+			}
+			ASSERT_EQ(0, RBvalidate(&tree));
+		}
+	}
+
+	void check() {
+		ASSERT_EQ(0, RBvalidate(&tree));
+		std::vector<int> v, expected;
+		RBforeach(&tree, collect, &v);
+		for (auto& kv : content) expected.push_back(kv.first);
+		ASSERT_EQ(expected, v);
+	}
+};
+
+TEST(Balance, Invalid) {
+	RBTree tree;
+	RBinit(&tree, compare);
+	EXPECT_EQ(-1, RBbalance(&tree, 3));
+	Item item{ 1, 1 };
+	RBinsert(&tree, &item, nullptr);
+	EXPECT_EQ(-1, RBbalance(&tree, RB_BALANCE_AVL));
+	RBdestroy(&tree, nullptr);
+}
+
+TEST(Balance, Ranks) {
+	RBTree tree;
+	RBinit(&tree, compare);
+	ASSERT_EQ(0, RBbalance(&tree, RB_BALANCE_AVL));
+	Item items[] = { { 1, 0 }, { 2, 0 }, { 3, 0 } };
+	for (Item& item : items) RBinsert(&tree, &item, nullptr);
+	EXPECT_EQ(2u, tree.black_depth);
+	EXPECT_EQ(1, tree.root->child[0]->red);
+	EXPECT_EQ(0, RBvalidate(&tree));
+	// a leaf of rank 2 breaks the rules
+	tree.root->child[0]->red = 2;
+	EXPECT_EQ(RANK_ERROR, RBvalidate(&tree));
+	RBdestroy(&tree, nullptr);
+}
+
+TEST_P(TestBalance, Churn) {
+	ASSERT_EQ(0, RBbalance(&tree, GetParam()));
+	std::mt19937 rg(0);
+	churn(5000, 500, rg);
+	check();
+	churn(5000, 5000, rg);
+	check();
+}
+
+TEST_P(TestBalance, Height) {
+	ASSERT_EQ(0, RBbalance(&tree, GetParam()));
+	std::mt19937 rg(1);
+	for (int i = 0; i < 1 << 15; i++) {
+		int key = (int)(rg() >> 1);
+		Item* old = (Item*)RBinsert(&tree, new Item{ key, i }, nullptr);
+		if (old) dele(old);
+		content[key] = i;
+	}
+	check();
+	RBReport report;
+	RBanalyze(&tree, &report, nullptr, 0, nullptr);
+	double bound = (RB_BALANCE_RB == GetParam()) ? 2 : 1.45;
+	EXPECT_LE(report.height, bound * std::log2(report.nodes + 2));
+	EXPECT_EQ(RB_BALANCE_RB == GetParam(), report.red > 0);
+}
+
+TEST_P(TestBalance, Augmented) {
+	ASSERT_EQ(0, RBaugment(&tree, sizeof(long), combine, nullptr));
+	ASSERT_EQ(0, RBbalance(&tree, GetParam()));
+	std::mt19937 rg(2);
+	churn(3000, 300, rg);
+	check();
+	long sum = 0, total = 0;
+	for (auto& kv : content) sum += kv.second;
+	Item lo{ -1, 0 }, hi{ 1000, 0 };
+	ASSERT_EQ(0, RBaggregate_range(&tree, &lo, &hi, &total));
+	EXPECT_EQ(sum, total);
+}
+
+TEST_P(TestBalance, Purge) {
+	ASSERT_EQ(0, RBbalance(&tree, GetParam()));
+	std::mt19937 rg(3);
+	churn(2000, 1000, rg);
+	for (auto it = content.begin(); it != content.end();) {
+		Item k{ it->first, 0 };
+		if (rg() % 2) {
+			ASSERT_EQ(1, RBremove_lazy(&tree, &k));
+			it = content.erase(it);
+		}
+		else ++it;
+	}
+	ASSERT_EQ(0, RBpurge(&tree, dele));
+	check();
+	churn(1000, 1000, rg);
+	check();
+}
+
+INSTANTIATE_TEST_SUITE_P(Policies, TestBalance, ::testing::Values(
+	RB_BALANCE_RB, RB_BALANCE_AVL, RB_BALANCE_WAVL));
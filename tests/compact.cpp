@@ -0,0 +1,141 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <map>
+#include <random>
+#include <vector>
+
+namespace {
+	struct Item {
+		int key;
+		int val;
+	};
+
+	int compare(const void* a, const void* b) {
+		return ((const Item*)a)->key - ((const Item*)b)->key;
+	}
+
+	void dele(const void* data) {
+		delete (const Item*)data;
+	}
+
+	size_t hash(const void* a) {
+		return (size_t)((const Item*)a)->key;
+	}
+
+	int64_t deadline(const void* a) {
+		return ((const Item*)a)->val;
+	}
+
+	int collect(void* data, void* ctx) {
+		((std::vector<int>*)ctx)->push_back(((Item*)data)->key);
+		return 0;
+	}
+}
+
+class TestCompact : public ::testing::Test {
+protected:
+	RBTree tree;
+	std::map<int, int> content;
+
+	TestCompact() {
+		RBinit(&tree, compare);
+	}
+
+	~TestCompact() {
+		RBdestroy(&tree, dele);
+	}
+
+	void churn(int n, std::mt19937& rg) {
+		for (int i = 0; i < n; i++) {
+			int key = rg() % 2000;
+			Item k{ key, 0 };
+			if (rg() % 3) {
+				Item* old = (Item*)RBinsert(&tree, new Item{ key, i }, nullptr);
+				if (old) dele(old);
+				content[key] = i;
+			}
+			else {
+				Item* old = (Item*)RBremove(&tree, &k);
+				ASSERT_EQ(content.erase(key) > 0, old != nullptr);
+				if (old) dele(old);
+			}
+		}
+	}
+
+	void check() {
+		ASSERT_EQ(0, RBvalidate(&tree));
+		std::vector<int> v, expected;
+		RBforeach(&tree, collect, &v);
+		for (auto& kv : content) expected.push_back(kv.first);
+		ASSERT_EQ(expected, v);
+		for (auto& kv : content) {
+			Item k{ kv.first, 0 };
+			Item* found = (Item*)RBfind(&tree, &k);
+			ASSERT_NE(nullptr, found);
+			ASSERT_EQ(kv.second, found->val);
+		}
+	}
+};
+
+TEST_F(TestCompact, Empty) {
+	EXPECT_EQ(0, RBcompact(&tree));
+	EXPECT_EQ(0, RBcompact(&tree));
+	RBMemory usage;
+	RBmemory_usage(&tree, &usage);
+	EXPECT_EQ(0u, usage.nodes);
+}
+
+TEST_F(TestCompact, Churn) {
+	std::mt19937 rg(0);
+	for (int round = 0; round < 4; round++) {
+		churn(5000, rg);
+		RBMemory usage;
+		RBmemory_usage(&tree, &usage);
+		EXPECT_EQ(tree.count * usage.node_size, usage.nodes);
+		ASSERT_EQ(0, RBcompact(&tree));
+		RBmemory_usage(&tree, &usage);
+		EXPECT_EQ(usage.nodes, usage.pooled);
+		check();
+		// removals free slots that insertions reuse
+		churn(1000, rg);
+		check();
+		RBmemory_usage(&tree, &usage);
+		EXPECT_LE(usage.pooled, usage.nodes);
+	}
+}
+
+TEST_F(TestCompact, Indexes) {
+	RBhash(&tree, hash);
+	RBexpiry(&tree, deadline);
+	std::mt19937 rg(1);
+	churn(5000, rg);
+	ASSERT_EQ(0, RBcompact(&tree));
+	check();
+	RBMemory usage;
+	RBmemory_usage(&tree, &usage);
+	EXPECT_GT(usage.overhead, 2 * sizeof(void*) * tree.count);
+	long expired = 0;
+	for (auto it = content.begin(); it != content.end();) {
+		if (it->second <= 2500) {
+			it = content.erase(it);
+			expired += 1;
+		}
+		else ++it;
+	}
+	EXPECT_EQ(expired, RBexpire(&tree, 2500, dele));
+	check();
+}
+
+TEST_F(TestCompact, Clone) {
+	std::mt19937 rg(2);
+	churn(3000, rg);
+	ASSERT_EQ(0, RBcompact(&tree));
+	RBTree* copy = RBclone(&tree, nullptr);
+	ASSERT_NE(nullptr, copy);
+	RBMemory usage;
+	RBmemory_usage(copy, &usage);
+	EXPECT_EQ(0u, usage.pooled);
+	RBdestroy(copy, nullptr);
+	free(copy);
+	check();
+}
@@ -0,0 +1,144 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <random>
+#include <set>
+
+namespace {
+	int compare(const void* a, const void* b) {
+		intptr_t x = (intptr_t)a, y = (intptr_t)b;
+		return (x > y) - (x < y);
+	}
+
+	void* key(intptr_t k) {
+		return (void*)k;
+	}
+
+	intptr_t value(void* data) {
+		return (intptr_t)data;
+	}
+}
+
+class TestCursor : public ::testing::Test {
+protected:
+	RBTree tree;
+
+	TestCursor() {
+		RBinit(&tree, compare);
+	}
+
+	~TestCursor() {
+		RBdestroy(&tree, nullptr);
+	}
+
+	// inserts the even keys from 2 to 2 * n
+	void fill(int n) {
+		for (int i = 1; i <= n; i++) RBinsert(&tree, key(2 * i), nullptr);
+	}
+};
+
+TEST_F(TestCursor, Unchanged) {
+	fill(100);
+	RBIter* cursor = RBcursor(&tree, nullptr);
+	ASSERT_NE(nullptr, cursor);
+	for (int i = 1; i <= 100; i++) EXPECT_EQ(2 * i, value(RBnext(cursor)));
+	EXPECT_EQ(nullptr, RBnext(cursor));
+	RBiter_release(cursor);
+	// from a key, like RBsearch
+	cursor = RBcursor(&tree, key(51));
+	EXPECT_EQ(52, value(RBnext(cursor)));
+	RBiter_release(cursor);
+	cursor = RBcursor(&tree, key(52));
+	EXPECT_EQ(52, value(RBnext(cursor)));
+	RBiter_release(cursor);
+}
+
+TEST_F(TestCursor, Empty) {
+	RBIter* cursor = RBcursor(&tree, nullptr);
+	EXPECT_EQ(nullptr, RBnext(cursor));
+	// an insertion behind an exhausted cursor is found
+	RBinsert(&tree, key(1), nullptr);
+	EXPECT_EQ(1, value(RBnext(cursor)));
+	EXPECT_EQ(nullptr, RBnext(cursor));
+	RBiter_release(cursor);
+}
+
+TEST_F(TestCursor, Changes) {
+	fill(100);
+	RBIter* cursor = RBcursor(&tree, key(10));
+	EXPECT_EQ(10, value(RBnext(cursor)));
+	EXPECT_EQ(12, value(RBnext(cursor)));
+	// the last returned element and the next one go away
+	RBremove(&tree, key(12));
+	RBremove(&tree, key(14));
+	EXPECT_EQ(16, value(RBnext(cursor)));
+	RBinsert(&tree, key(17), nullptr);
+	RBinsert(&tree, key(15), nullptr);
+	EXPECT_EQ(17, value(RBnext(cursor)));
+	// the key given to RBcursor is used until the first element
+	RBIter* other = RBcursor(&tree, key(51));
+	fill(200);
+	EXPECT_EQ(52, value(RBnext(other)));
+	RBiter_release(other);
+	EXPECT_EQ(18, value(RBnext(cursor)));
+	RBiter_release(cursor);
+}
+
+TEST_F(TestCursor, Growth) {
+	RBinsert(&tree, key(1), nullptr);
+	RBIter* cursor = RBcursor(&tree, nullptr);
+	EXPECT_EQ(1, value(RBnext(cursor)));
+	// the tree gets far deeper than when the cursor was built
+	fill(100000);
+	for (int i = 1; i <= 100000; i++) {
+		ASSERT_EQ(2 * i, value(RBnext(cursor)));
+	}
+	RBiter_release(cursor);
+}
+
+TEST_F(TestCursor, Interleaved) {
+	std::set<intptr_t> content;
+	std::mt19937 rg(0);
+	for (int i = 0; i < 2000; i++) {
+		intptr_t k = rg() % 10000;
+		RBinsert(&tree, key(k), nullptr);
+		content.insert(k);
+	}
+	RBIter* cursor = RBcursor(&tree, nullptr);
+	intptr_t last = -1;
+	for (void* data; (data = RBnext(cursor)) != nullptr;) {
+		intptr_t k = value(data);
+		// the next element of the current content after the last one
+		auto it = content.upper_bound(last);
+		ASSERT_NE(content.end(), it);
+		ASSERT_EQ(*it, k);
+		last = k;
+		for (int j = 0; j < 3; j++) {
+			intptr_t other = rg() % 10000;
+			if (rg() % 2) {
+				RBinsert(&tree, key(other), nullptr);
+				content.insert(other);
+			}
+			else {
+				RBremove(&tree, key(other));
+				content.erase(other);
+			}
+		}
+	}
+	EXPECT_EQ(content.end(), content.upper_bound(last));
+	RBiter_release(cursor);
+}
+
+TEST_F(TestCursor, RemoveAbsent) {
+	fill(1000);
+	RBIter* cursor = RBcursor(&tree, nullptr);
+	std::mt19937 rg(1);
+	for (int i = 1; i <= 1000; i++) {
+		ASSERT_EQ(2 * i, value(RBnext(cursor)));
+		// the top-down removal rotates on its way down to a missing key
+		for (int j = 0; j < 3; j++) {
+			EXPECT_EQ(nullptr, RBremove(&tree, key(2 * (rg() % 1000) + 1)));
+		}
+	}
+	EXPECT_EQ(nullptr, RBnext(cursor));
+	RBiter_release(cursor);
+}
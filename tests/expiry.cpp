@@ -0,0 +1,168 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <map>
+#include <random>
+#include <vector>
+
+namespace {
+	struct Entry {
+		int id;
+		int64_t expires;	// negative if never
+	};
+
+	int compare(const void* a, const void* b) {
+		return ((const Entry*)a)->id - ((const Entry*)b)->id;
+	}
+
+	int64_t deadline(const void* e) {
+		return ((const Entry*)e)->expires;
+	}
+
+	int released;
+
+	void dele(const void* data) {
+		released += 1;
+		delete (const Entry*)data;
+	}
+
+	int collect(void* data, void* ctx) {
+		((std::vector<int>*)ctx)->push_back(((Entry*)data)->id);
+		return 0;
+	}
+}
+
+class TestExpiry : public ::testing::Test {
+protected:
+	RBTree tree;
+
+	TestExpiry() {
+		RBinit(&tree, compare);
+		EXPECT_EQ(0, RBexpiry(&tree, deadline));
+		released = 0;
+	}
+
+	~TestExpiry() {
+		RBdestroy(&tree, dele);
+	}
+
+	void insert(int id, int64_t expires) {
+		int err;
+		Entry* old = (Entry*)RBinsert(&tree, new Entry{ id, expires }, &err);
+		ASSERT_EQ(0, err);
+		if (old) dele(old);
+	}
+
+	std::vector<int> ids() {
+		std::vector<int> v;
+		RBforeach(&tree, collect, &v);
+		return v;
+	}
+};
+
+TEST_F(TestExpiry, NotEmpty) {
+	RBTree other;
+	RBinit(&other, compare);
+	EXPECT_EQ(-1, RBexpire(&other, 0, nullptr));
+	Entry e{ 1, 10 };
+	RBinsert(&other, &e, nullptr);
+	EXPECT_EQ(-1, RBexpiry(&other, deadline));
+	RBdestroy(&other, nullptr);
+	EXPECT_EQ(-1, RBexpiry(&tree, deadline));
+}
+
+TEST_F(TestExpiry, Expire) {
+	insert(1, 30);
+	insert(2, 10);
+	insert(3, -1);
+	insert(4, 20);
+	insert(5, 10);
+	EXPECT_EQ(0, RBexpire(&tree, 9, dele));
+	EXPECT_EQ(2, RBexpire(&tree, 10, dele));
+	EXPECT_EQ(2, released);
+	EXPECT_EQ((std::vector<int>{ 1, 3, 4 }), ids());
+	EXPECT_EQ(2, RBexpire(&tree, 1000, dele));
+	EXPECT_EQ((std::vector<int>{ 3 }), ids());
+	EXPECT_EQ(0, RBvalidate(&tree));
+}
+
+TEST_F(TestExpiry, Replace) {
+	insert(1, 10);
+	insert(2, 10);
+	// postpones 1 and removes 2 before they expire
+	insert(1, 50);
+	Entry key{ 2, 0 };
+	dele(RBremove(&tree, &key));
+	EXPECT_EQ(0, RBexpire(&tree, 40, dele));
+	EXPECT_EQ((std::vector<int>{ 1 }), ids());
+	// a tombstone does not expire
+	insert(3, 20);
+	key.id = 3;
+	EXPECT_EQ(1, RBremove_lazy(&tree, &key));
+	EXPECT_EQ(0, RBexpire(&tree, 40, dele));
+	EXPECT_EQ(0, RBpurge(&tree, dele));
+	EXPECT_EQ(1, RBexpire(&tree, 50, dele));
+	EXPECT_EQ(0, tree.count);
+}
+
+TEST_F(TestExpiry, Build) {
+	std::vector<void*> entries;
+	for (int id = 1; id <= 10; id++) {
+		entries.push_back(new Entry{ id, (id % 2) ? 100 - id : -1 });
+	}
+	ASSERT_EQ(0, RBbuild(&tree, entries.data(), nullptr, entries.size()));
+	EXPECT_EQ(0, RBvalidate(&tree));
+	// the elements built with the tree are in its expiry index
+	EXPECT_EQ(2, RBexpire(&tree, 94, dele));
+	EXPECT_EQ(2, released);
+	EXPECT_EQ(std::vector<int>({ 1, 2, 3, 4, 5, 6, 8, 10 }), ids());
+}
+
+TEST_F(TestExpiry, Clone) {
+	for (int i = 0; i < 100; i++) insert(i, i % 10);
+	RBTree* copy = RBclone(&tree, [](void* const data) -> void* {
+		return new Entry(*(Entry*)data);
+	});
+	ASSERT_NE(nullptr, copy);
+	EXPECT_EQ(50, RBexpire(&tree, 4, dele));
+	EXPECT_EQ(30, RBexpire(copy, 2, dele));
+	EXPECT_EQ(50u, tree.count);
+	EXPECT_EQ(70u, copy->count);
+	RBdestroy(copy, dele);
+	free(copy);
+}
+
+TEST_F(TestExpiry, Random) {
+	std::mt19937 rg(0);
+	std::map<int, int64_t> content;
+	int64_t now = 0;
+	for (int i = 0; i < 20000; i++) {
+		int id = rg() % 1000;
+		if (rg() % 4) {
+			int64_t expires = now + rg() % 500;
+			insert(id, expires);
+			content[id] = expires;
+		}
+		else {
+			Entry key{ id, 0 };
+			Entry* old = (Entry*)RBremove(&tree, &key);
+			EXPECT_EQ(content.erase(id) > 0, old != nullptr);
+			if (old) dele(old);
+		}
+		if (i % 100 == 0) {
+			now += 10;
+			long expected = 0;
+			for (auto it = content.begin(); it != content.end();) {
+				if (it->second <= now) {
+					it = content.erase(it);
+					expected += 1;
+				}
+				else ++it;
+			}
+			ASSERT_EQ(expected, RBexpire(&tree, now, dele));
+			ASSERT_EQ(content.size(), tree.count);
+			ASSERT_EQ(0, RBvalidate(&tree));
+			// the index is ordered by deadline
+			ASSERT_EQ(0, RBvalidate(tree.expiry));
+		}
+	}
+}
@@ -0,0 +1,121 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <random>
+
+namespace {
+	long comparisons;
+
+	int compare(const void* a, const void* b) {
+		intptr_t x = (intptr_t)a, y = (intptr_t)b;
+		comparisons += 1;
+		return (x > y) - (x < y);
+	}
+
+	void* key(intptr_t k) {
+		return (void*)k;
+	}
+}
+
+class TestFinger : public ::testing::Test {
+protected:
+	RBTree tree;
+	RBFinger* finger;
+
+	TestFinger() {
+		RBinit(&tree, compare);
+		finger = RBfinger_open(&tree);
+	}
+
+	~TestFinger() {
+		RBfinger_close(finger);
+		RBdestroy(&tree, nullptr);
+	}
+
+	// inserts the even keys from 0 to 2 * (n - 1)
+	void fill(int n) {
+		for (int i = 0; i < n; i++) RBinsert(&tree, key(2 * i), nullptr);
+	}
+};
+
+TEST_F(TestFinger, Empty) {
+	EXPECT_EQ(nullptr, RBfinger_find(finger, key(1)));
+	EXPECT_EQ(nullptr, RBfinger_search(finger, key(1)));
+	RBinsert(&tree, key(1), nullptr);
+	EXPECT_EQ(key(1), RBfinger_find(finger, key(1)));
+}
+
+TEST_F(TestFinger, Sequential) {
+	fill(1000);
+	for (int k = -1; k <= 2000; k++) {
+		EXPECT_EQ(RBfind(&tree, key(k)), RBfinger_find(finger, key(k))) << k;
+	}
+	for (int k = 2000; k >= -1; k--) {
+		EXPECT_EQ(RBfind(&tree, key(k)), RBfinger_find(finger, key(k))) << k;
+	}
+}
+
+TEST_F(TestFinger, Random) {
+	fill(1000);
+	std::mt19937 rg(0);
+	for (int i = 0; i < 10000; i++) {
+		intptr_t k = rg() % 2100 - 50;
+		ASSERT_EQ(RBfind(&tree, key(k)), RBfinger_find(finger, key(k))) << k;
+	}
+}
+
+TEST_F(TestFinger, Search) {
+	fill(100);
+	std::mt19937 rg(1);
+	for (int i = 0; i < 1000; i++) {
+		intptr_t k = rg() % 220 - 10;
+		RBIter* expected = RBsearch(&tree, key(k));
+		RBIter* iter = RBfinger_search(finger, key(k));
+		ASSERT_NE(nullptr, iter);
+		for (int j = 0; j < 3; j++) {
+			ASSERT_EQ(RBnext(expected), RBnext(iter)) << k;
+		}
+		RBiter_release(expected);
+		RBiter_release(iter);
+	}
+}
+
+TEST_F(TestFinger, Invalidation) {
+	fill(100);
+	EXPECT_EQ(key(100), RBfinger_find(finger, key(100)));
+	// the path goes through the removed node
+	EXPECT_EQ(key(100), RBremove(&tree, key(100)));
+	EXPECT_EQ(nullptr, RBfinger_find(finger, key(100)));
+	EXPECT_EQ(key(102), RBfinger_find(finger, key(102)));
+	for (int i = 1; i < 200; i += 2) RBinsert(&tree, key(i), nullptr);
+	for (int k = 0; k < 200; k++) {
+		EXPECT_EQ(RBfind(&tree, key(k)), RBfinger_find(finger, key(k))) << k;
+	}
+	RBremove_lazy(&tree, key(51));
+	EXPECT_EQ(nullptr, RBfinger_find(finger, key(51)));
+	EXPECT_EQ(0, RBpurge(&tree, nullptr));
+	EXPECT_EQ(key(53), RBfinger_find(finger, key(53)));
+	RBdestroy(&tree, nullptr);
+	EXPECT_EQ(nullptr, RBfinger_find(finger, key(53)));
+}
+
+TEST_F(TestFinger, RemoveAbsent) {
+	fill(1000);
+	std::mt19937 rg(2);
+	for (int i = 0; i < 10000; i++) {
+		intptr_t k = rg() % 2100 - 50;
+		ASSERT_EQ(RBfind(&tree, key(k)), RBfinger_find(finger, key(k))) << k;
+		// the top-down removal rotates on its way down to a missing key
+		EXPECT_EQ(nullptr, RBremove(&tree, key(2 * (rg() % 1000) + 1)));
+	}
+}
+
+TEST_F(TestFinger, Comparisons) {
+	fill(1 << 14);
+	comparisons = 0;
+	for (int k = 0; k < 1 << 15; k++) RBfind(&tree, key(k));
+	long root = comparisons;
+	comparisons = 0;
+	for (int k = 0; k < 1 << 15; k++) RBfinger_find(finger, key(k));
+	// nearby keys are a few levels apart
+	EXPECT_LT(comparisons * 3, root);
+}
@@ -0,0 +1,119 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <map>
+#include <random>
+
+namespace {
+	struct Item {
+		int key;
+		int val;
+	};
+
+	int compare(const void* a, const void* b) {
+		return ((const Item*)a)->key - ((const Item*)b)->key;
+	}
+
+	size_t hash(const void* a) {
+		return (size_t)((const Item*)a)->key;
+	}
+
+	// many collisions to exercise the probing
+	size_t bad_hash(const void* a) {
+		return (size_t)(((const Item*)a)->key % 3);
+	}
+
+	void dele(const void* data) {
+		delete (const Item*)data;
+	}
+}
+
+class TestHash : public ::testing::TestWithParam<size_t (*)(const void*)> {
+protected:
+	RBTree tree;
+	std::map<int, int> content;
+
+	TestHash() {
+		RBinit(&tree, compare);
+		EXPECT_EQ(0, RBhash(&tree, GetParam()));
+	}
+
+	~TestHash() {
+		RBdestroy(&tree, dele);
+	}
+
+	void insert(int key, int val) {
+		int err;
+		Item* old = (Item*)RBinsert(&tree, new Item{ key, val }, &err);
+		ASSERT_EQ(0, err);
+		// the old element may also be a tombstone
+		if (content.count(key)) ASSERT_NE(nullptr, old);
+		if (old) dele(old);
+		content[key] = val;
+	}
+
+	void check() {
+		for (int key = 0; key < 1000; key++) {
+			Item k{ key, 0 };
+			Item* found = (Item*)RBfind(&tree, &k);
+			auto it = content.find(key);
+			ASSERT_EQ(it != content.end(), found != nullptr) << key;
+			if (found) ASSERT_EQ(it->second, found->val);
+		}
+	}
+};
+
+TEST_P(TestHash, NotEmpty) {
+	insert(1, 1);
+	EXPECT_EQ(-1, RBhash(&tree, hash));
+}
+
+TEST_P(TestHash, Random) {
+	std::mt19937 rg(0);
+	for (int i = 0; i < 20000; i++) {
+		int key = rg() % 1000;
+		Item k{ key, 0 };
+		switch (rg() % 4) {
+		case 0: {
+			Item* old = (Item*)RBremove(&tree, &k);
+			ASSERT_EQ(content.erase(key) > 0, old != nullptr);
+			if (old) dele(old);
+			break;
+		}
+		case 1:
+			ASSERT_EQ((int)content.erase(key), RBremove_lazy(&tree, &k));
+			break;
+		default:
+			insert(key, i);
+		}
+		if (i % 500 == 0) {
+			check();
+			ASSERT_EQ(0, RBpurge(&tree, dele));
+		}
+	}
+	check();
+	// the table shrinks back as the tree empties
+	for (auto& kv : content) {
+		Item k{ kv.first, 0 };
+		dele(RBremove(&tree, &k));
+	}
+	content.clear();
+	check();
+}
+
+TEST_P(TestHash, Clone) {
+	for (int i = 0; i < 100; i++) insert(i, i);
+	RBTree* copy = RBclone(&tree, [](void* const data) -> void* {
+		return new Item{ ((Item*)data)->key, -1 };
+	});
+	ASSERT_NE(nullptr, copy);
+	Item k{ 42, 0 };
+	EXPECT_EQ(-1, ((Item*)RBfind(copy, &k))->val);
+	EXPECT_EQ(42, ((Item*)RBfind(&tree, &k))->val);
+	dele(RBremove(copy, &k));
+	EXPECT_EQ(nullptr, RBfind(copy, &k));
+	EXPECT_NE(nullptr, RBfind(&tree, &k));
+	RBdestroy(copy, dele);
+	free(copy);
+}
+
+INSTANTIATE_TEST_SUITE_P(Hashes, TestHash, ::testing::Values(hash, bad_hash));
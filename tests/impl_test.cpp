@@ -12,6 +12,7 @@ namespace {
 		if (node == nullptr) return nullptr;
 		node->data = nodes->data;
 		node->red = nodes->red;
+		node->dead = 0;
 		for (int i = 0; i < 2; i++) {
 			node->child[i] = build_node(nodes->child[i]);
 		}
@@ -348,7 +349,7 @@ TEST_F(TestRemoveImpl, red_ancestor_rotation) {
 
 #ifdef _TEST
 // Test the implementation of paint_child_red even if it is internal
-extern "C" RBNode * paint_child_red(RBNode*, int);
+extern "C" RBNode * paint_child_red(const RBTree*, RBNode*, int);
 
 class TestPaintRed : public ::testing::Test {
 protected:
@@ -371,7 +372,7 @@ TEST_F(TestPaintRed, simple) {
 	tree.root = nodes;
 	tree.black_depth = 1;
 	tree.count = 2;
-	ASSERT_EQ(nodes, paint_child_red(nodes, 1));
+	ASSERT_EQ(nodes, paint_child_red(&tree, nodes, 1));
 	EXPECT_EQ(nodes + 1, nodes->child[1]);
 	EXPECT_TRUE(nodes[1].red);
 	EXPECT_EQ(0, RBvalidate(&tree));
@@ -385,7 +386,7 @@ TEST_F(TestPaintRed, two_red) {
 		{(void*)2, {nullptr, nullptr}, 1},
 		{(void*)4, {nullptr, nullptr}, 1},
 	};
-	tree.root = paint_child_red(nodes, 1);
+	tree.root = paint_child_red(&tree, nodes, 1);
 	tree.count = 4;
 	EXPECT_EQ(nodes, nodes[1].child[0]);
 	EXPECT_TRUE(nodes[1].red);
@@ -406,7 +407,7 @@ TEST_F(TestPaintRed, inner_red) {
 		{(void*)7, {nullptr, nullptr}, 0},
 	};
 	tree.count = 7;
-	tree.root = paint_child_red(nodes+1, 1);
+	tree.root = paint_child_red(&tree, nodes+1, 1);
 	EXPECT_EQ(nodes+1, nodes[3].child[0]);
 	EXPECT_TRUE(nodes[3].red);
 	tree.root->red = 0;
@@ -415,3 +416,48 @@ TEST_F(TestPaintRed, inner_red) {
 }
 
 #endif // _TEST
+
+class TestDegenerate : public ::testing::Test {
+protected:
+	static constexpr int SIZE = 100000;
+	RBTree tree;
+	static int count;
+
+	TestDegenerate() {
+		RBinit(&tree, compare);
+		count = 0;
+		// a left list of black nodes: far from a valid tree
+		for (int i = SIZE; i > 0; i--) {
+			_RBNode* node = (RBNode*)malloc(sizeof(*node));
+			node->data = (void*)(intptr_t)i;
+			node->red = 0;
+			node->child[0] = tree.root;
+			node->child[1] = nullptr;
+			tree.root = node;
+		}
+		tree.black_depth = SIZE;
+		tree.count = SIZE;
+	}
+
+	static int compare(const void* a, const void* b) {
+		return (int)(intptr_t)b - (int)(intptr_t)a;
+	}
+
+	static void dele(const void* data) {
+		EXPECT_EQ(SIZE - count, (int)(intptr_t)data);
+		count += 1;
+	}
+};
+
+int TestDegenerate::count;
+
+TEST_F(TestDegenerate, Destroy) {
+	RBdestroy(&tree, dele);
+	EXPECT_EQ(SIZE, count);
+	EXPECT_EQ(nullptr, tree.root);
+}
+
+TEST_F(TestDegenerate, Validate) {
+	EXPECT_EQ(DEPTH_ERROR, RBvalidate(&tree));
+	RBdestroy(&tree, nullptr);
+}
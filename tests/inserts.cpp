@@ -43,7 +43,12 @@ TEST_F(TestInsert, test_bunch_red_levels) {
 		EXPECT_EQ(nullptr, RBinsert(&tree, (void*)(intptr_t)i, nullptr));
 		ASSERT_EQ(0, RBvalidate(&tree));
 	}
+#ifndef RB_TOPDOWN
+	// top-down insertion splits the full nodes eagerly and grows one more level
 	EXPECT_EQ(2, tree.black_depth);
+#else
+	EXPECT_EQ(3, tree.black_depth);
+#endif
 	expect_dele.clear();
-	expect_dele.splice(expect_dele.end(), list<int>{1,2,5,6,4,9,10,13,14,12,8});
+	expect_dele.splice(expect_dele.end(), list<int>{1,2,4,5,6,8,9,10,12,13,14});
 }
@@ -0,0 +1,152 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <random>
+#include <set>
+#include <utility>
+#include <vector>
+
+namespace {
+	struct Range {
+		int lo;
+		int hi;
+	};
+
+	typedef std::set<std::pair<int, int>> Ranges;
+
+	int compare(const void* a, const void* b) {
+		const Range* x = (const Range*)a;
+		const Range* y = (const Range*)b;
+		if (x->lo != y->lo) return x->lo - y->lo;
+		return x->hi - y->hi;
+	}
+
+	const void* low(const void* elt) {
+		return &((const Range*)elt)->lo;
+	}
+
+	const void* high(const void* elt) {
+		return &((const Range*)elt)->hi;
+	}
+
+	int pcomp(const void* a, const void* b) {
+		return *(const int*)a - *(const int*)b;
+	}
+
+	const RBInterval interval = { low, high, pcomp };
+
+	void dele(const void* data) {
+		delete (const Range*)data;
+	}
+
+	int collect(void* data, void* ctx) {
+		Range* r = (Range*)data;
+		((std::vector<std::pair<int, int>>*)ctx)->emplace_back(r->lo, r->hi);
+		return 0;
+	}
+}
+
+class TestInterval : public ::testing::Test {
+protected:
+	RBTree tree;
+	Ranges ranges;
+	std::mt19937 rg;
+
+	TestInterval() : rg(0) {
+		RBinit_interval(&tree, compare, &interval);
+	}
+
+	~TestInterval() {
+		RBdestroy(&tree, dele);
+	}
+
+	void insert(int lo, int hi) {
+		Range* r = new Range{ lo, hi };
+		int err;
+		Range* old = (Range*)RBinsert(&tree, r, &err);
+		ASSERT_EQ(0, err);
+		if (old) dele(old);
+		ranges.emplace(lo, hi);
+	}
+
+	void remove(int lo, int hi) {
+		Range key{ lo, hi };
+		Range* old = (Range*)RBremove(&tree, &key);
+		EXPECT_EQ(ranges.erase(std::make_pair(lo, hi)) > 0, old != nullptr);
+		if (old) dele(old);
+	}
+
+	static std::vector<std::pair<int, int>> expected(const Ranges& ranges,
+			int lo, int hi) {
+		std::vector<std::pair<int, int>> v;
+		for (auto& r : ranges) {
+			if (r.first <= hi && r.second >= lo) v.push_back(r);
+		}
+		return v;
+	}
+
+	void check(RBTree* t, const Ranges& ranges) {
+		for (int i = 0; i < 50; i++) {
+			int lo = rg() % 1100, hi = lo + rg() % 50;
+			std::vector<std::pair<int, int>> found;
+			ASSERT_EQ(0, RBoverlaps(t, &lo, &hi, collect, &found));
+			EXPECT_EQ(expected(ranges, lo, hi), found);
+			found.clear();
+			ASSERT_EQ(0, RBstab(t, &lo, collect, &found));
+			EXPECT_EQ(expected(ranges, lo, lo), found);
+		}
+	}
+};
+
+TEST_F(TestInterval, Overlaps) {
+	for (int i = 0; i < 3000; i++) {
+		int lo = rg() % 1000;
+		int hi = lo + rg() % (rg() % 10 ? 20 : 300);
+		if (rg() % 3) insert(lo, hi);
+		else if (!ranges.empty()) {
+			auto it = ranges.lower_bound(std::make_pair(lo, 0));
+			if (it == ranges.end()) it = ranges.begin();
+			remove(it->first, it->second);
+		}
+		if (i % 100 == 0) {
+			ASSERT_EQ(0, RBvalidate(&tree));
+			check(&tree, ranges);
+		}
+	}
+	check(&tree, ranges);
+}
+
+TEST_F(TestInterval, Stop) {
+	for (int i = 0; i < 10; i++) insert(i, i + 10);
+	int point = 9;
+	int count = 0;
+	EXPECT_EQ(3, RBstab(&tree, &point, [](void*, void* ctx) {
+		return ++*(int*)ctx == 2 ? 3 : 0;
+		}, &count));
+	EXPECT_EQ(2, count);
+}
+
+TEST_F(TestInterval, Clone) {
+	for (int i = 0; i < 500; i++) {
+		int lo = rg() % 1000;
+		insert(lo, lo + rg() % 30);
+	}
+	// the copies are longer intervals
+	RBTree* copy = RBclone(&tree, [](void* const data) -> void* {
+		Range* r = (Range*)data;
+		return new Range{ r->lo, r->hi + 100 };
+		});
+	ASSERT_NE(nullptr, copy);
+	Ranges longer;
+	for (auto& r : ranges) longer.emplace(r.first, r.second + 100);
+	check(copy, longer);
+	check(&tree, ranges);
+	RBdestroy(copy, dele);
+	free(copy);
+}
+
+TEST_F(TestInterval, NotInterval) {
+	RBTree plain;
+	RBinit(&plain, compare);
+	int point = 0;
+	EXPECT_EQ(-1, RBstab(&plain, &point, collect, nullptr));
+}
@@ -0,0 +1,127 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <cstddef>
+#include <map>
+#include <random>
+#include <vector>
+
+namespace {
+	struct Object {
+		int key;
+		RBLink link;
+		int version;
+	};
+
+	int compare(const void* a, const void* b) {
+		return ((const Object*)a)->key - ((const Object*)b)->key;
+	}
+
+	void dele(const void* data) {
+		delete (const Object*)data;
+	}
+
+	int collect(void* data, void* ctx) {
+		((std::vector<int>*)ctx)->push_back(((Object*)data)->key);
+		return 0;
+	}
+}
+
+class TestIntrusive : public ::testing::Test {
+protected:
+	RBTree tree;
+
+	TestIntrusive() {
+		RBinit(&tree, compare);
+		EXPECT_EQ(0, RBintrusive(&tree, offsetof(Object, link)));
+	}
+
+	~TestIntrusive() {
+		RBdestroy(&tree, dele);
+	}
+
+	std::vector<int> keys() {
+		std::vector<int> v;
+		RBforeach(&tree, collect, &v);
+		return v;
+	}
+};
+
+TEST_F(TestIntrusive, Refused) {
+	EXPECT_EQ(-1, RBaugment(&tree, sizeof(int), [](void*, const void*,
+		const void*, const void*, const void*) {}, nullptr));
+	EXPECT_EQ(nullptr, RBclone(&tree, nullptr));
+	Object obj{ 1, {}, 0 };
+	RBinsert(&tree, &obj, nullptr);
+	EXPECT_EQ(-1, RBintrusive(&tree, offsetof(Object, link)));
+	RBremove(&tree, &obj);
+}
+
+TEST_F(TestIntrusive, Arena) {
+	// elements in a caller owned array, as no node is allocated
+	std::vector<Object> arena(100);
+	for (int i = 0; i < 100; i++) {
+		arena[i].key = (i * 37) % 100;
+		RBinsert(&tree, &arena[i], nullptr);
+	}
+	EXPECT_EQ(0, RBvalidate(&tree));
+	EXPECT_EQ(100u, tree.count);
+	for (int i = 0; i < 100; i += 2) {
+		EXPECT_EQ(&arena[i], RBremove(&tree, &arena[i]));
+	}
+	EXPECT_EQ(0, RBvalidate(&tree));
+	std::vector<int> v = keys();
+	ASSERT_EQ(50u, v.size());
+	for (int i = 0; i < 50; i++) EXPECT_EQ(2 * i + 1, v[i]);
+	RBdestroy(&tree, nullptr);
+}
+
+TEST_F(TestIntrusive, Clone) {
+	for (int i = 0; i < 50; i++) RBinsert(&tree, new Object{ i, {}, 0 }, nullptr);
+	RBTree* copy = RBclone(&tree, [](void* const data) -> void* {
+		return new Object{ ((Object*)data)->key, {}, 1 };
+	});
+	ASSERT_NE(nullptr, copy);
+	EXPECT_EQ(0, RBvalidate(copy));
+	Object key{ 10, {}, 0 };
+	EXPECT_EQ(1, ((Object*)RBfind(copy, &key))->version);
+	EXPECT_EQ(0, ((Object*)RBfind(&tree, &key))->version);
+	RBdestroy(copy, dele);
+	free(copy);
+}
+
+TEST_F(TestIntrusive, Random) {
+	std::mt19937 rg(0);
+	std::map<int, int> content;
+	for (int i = 0; i < 20000; i++) {
+		int key = rg() % 500;
+		Object probe{ key, {}, 0 };
+		switch (rg() % 5) {
+		case 0: {
+			Object* old = (Object*)RBremove(&tree, &probe);
+			ASSERT_EQ(content.count(key) > 0, old != nullptr);
+			if (old) {
+				EXPECT_EQ(content[key], old->version);
+				content.erase(key);
+				dele(old);
+			}
+			break;
+		}
+		case 1:
+			if (1 == RBremove_lazy(&tree, &probe)) content.erase(key);
+			break;
+		default: {
+			// replacing an element gives its place to the new link
+			Object* old = (Object*)RBinsert(&tree, new Object{ key, {}, i },
+				nullptr);
+			if (old) dele(old);
+			content[key] = i;
+		}
+		}
+		ASSERT_EQ(0, RBvalidate(&tree));
+		Object* found = (Object*)RBfind(&tree, &probe);
+		ASSERT_EQ(content.count(key) > 0, found != nullptr);
+		if (found) EXPECT_EQ(content[key], found->version);
+		if (i % 1000 == 999) ASSERT_EQ(0, RBpurge(&tree, dele));
+	}
+	ASSERT_EQ(content.size(), tree.count);
+}
@@ -0,0 +1,198 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <random>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#define lseek _lseek
+#define read _read
+#define write _write
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+	struct Item {
+		int key;
+		int val;
+	};
+
+	int compare(const void* a, const void* b) {
+		return ((const Item*)a)->key - ((const Item*)b)->key;
+	}
+
+	void dele(const void* data) {
+		delete (const Item*)data;
+	}
+
+	size_t serialize(const void* data, void* buf, size_t size) {
+		if (size >= sizeof(Item)) memcpy(buf, data, sizeof(Item));
+		return sizeof(Item);
+	}
+
+	void* deserialize(const void* buf, size_t size) {
+		if (size != sizeof(Item)) return nullptr;
+		Item* item = new Item;
+		memcpy(item, buf, sizeof(Item));
+		return item;
+	}
+
+	std::map<int, int> content(RBTree* tree) {
+		std::map<int, int> m;
+		RBforeach(tree, [](void* data, void* ctx) {
+			Item* item = (Item*)data;
+			(*(std::map<int, int>*)ctx)[item->key] = item->val;
+			return 0;
+			}, &m);
+		return m;
+	}
+
+	std::vector<char> file_content(FILE* file) {
+		int fd = fileno(file);
+		long size = lseek(fd, 0, SEEK_END);
+		std::vector<char> buf(size);
+		lseek(fd, 0, SEEK_SET);
+		EXPECT_EQ(size, read(fd, buf.data(), size));
+		return buf;
+	}
+}
+
+class TestJournal : public ::testing::Test {
+protected:
+	static constexpr int NB = 2000;
+	RBTree tree;
+	RBTree replayed;
+	FILE* log;
+	std::mt19937 rg;
+	// expected content after each operation
+	std::vector<std::map<int, int>> states;
+
+	TestJournal() : rg(0) {
+		RBinit(&tree, compare);
+		RBinit(&replayed, compare);
+		log = tmpfile();
+	}
+
+	~TestJournal() {
+		RBdestroy(&tree, dele);
+		RBdestroy(&replayed, dele);
+		if (log) fclose(log);
+	}
+
+	void run(RBJournal* journal, int nb) {
+		std::map<int, int> state = content(&tree);
+		states.push_back(state);
+		for (int i = 0; i < nb; i++) {
+			int key = rg() % 200;
+			if (rg() % 3) {
+				Item* item = new Item{ key, (int)(rg() % 1000) };
+				int err;
+				Item* old = (Item*)RBjournal_insert(journal, item, &err);
+				ASSERT_EQ(0, err);
+				if (old) dele(old);
+				state[key] = item->val;
+			}
+			else {
+				Item k{ key, 0 };
+				Item* old = (Item*)RBjournal_remove(journal, &k);
+				if (old == nullptr) continue;
+				dele(old);
+				state.erase(key);
+			}
+			states.push_back(state);
+		}
+	}
+};
+
+TEST_F(TestJournal, Replay) {
+	ASSERT_NE(nullptr, log);
+	RBJournal* journal = RBjournal_open(&tree, fileno(log), serialize, 16);
+	ASSERT_NE(nullptr, journal);
+	run(journal, NB);
+	ASSERT_EQ(0, RBjournal_close(journal));
+	lseek(fileno(log), 0, SEEK_SET);
+	EXPECT_EQ((long)states.size() - 1,
+		RBjournal_replay(&replayed, fileno(log), deserialize, dele));
+	EXPECT_EQ(0, RBvalidate(&replayed));
+	EXPECT_EQ(states.back(), content(&replayed));
+}
+
+// Simulates crashes by truncating the log at random offsets: replay must
+// give the state after the last complete record.
+TEST_F(TestJournal, Truncated) {
+	ASSERT_NE(nullptr, log);
+	RBJournal* journal = RBjournal_open(&tree, fileno(log), serialize, 0);
+	ASSERT_NE(nullptr, journal);
+	run(journal, 300);
+	ASSERT_EQ(0, RBjournal_close(journal));
+	std::vector<char> buf = file_content(log);
+	for (int i = 0; i < 50; i++) {
+		size_t size = 8 + rg() % (buf.size() - 7);
+		FILE* crashed = tmpfile();
+		ASSERT_NE(nullptr, crashed);
+		ASSERT_EQ((long)size, (long)write(fileno(crashed), buf.data(), size));
+		lseek(fileno(crashed), 0, SEEK_SET);
+		long nb = RBjournal_replay(&replayed, fileno(crashed), deserialize, dele);
+		fclose(crashed);
+		ASSERT_LE(0, nb);
+		ASSERT_LT(nb, (long)states.size());
+		EXPECT_EQ(states[nb], content(&replayed));
+		EXPECT_EQ(0, RBvalidate(&replayed));
+		RBdestroy(&replayed, dele);
+	}
+}
+
+TEST_F(TestJournal, Corrupted) {
+	ASSERT_NE(nullptr, log);
+	RBJournal* journal = RBjournal_open(&tree, fileno(log), serialize, 0);
+	ASSERT_NE(nullptr, journal);
+	run(journal, 10);
+	ASSERT_EQ(0, RBjournal_close(journal));
+	std::vector<char> buf = file_content(log);
+	// alter the 4th record
+	buf[8 + 3 * (5 + sizeof(Item) + 4) + 6] ^= 1;
+	FILE* crashed = tmpfile();
+	ASSERT_NE(nullptr, crashed);
+	ASSERT_EQ((long)buf.size(), (long)write(fileno(crashed), buf.data(),
+		buf.size()));
+	lseek(fileno(crashed), 0, SEEK_SET);
+	EXPECT_EQ(3, RBjournal_replay(&replayed, fileno(crashed), deserialize, dele));
+	fclose(crashed);
+	EXPECT_EQ(states[3], content(&replayed));
+}
+
+TEST_F(TestJournal, Checkpoint) {
+	ASSERT_NE(nullptr, log);
+	FILE* snap = tmpfile();
+	FILE* log2 = tmpfile();
+	ASSERT_NE(nullptr, snap);
+	ASSERT_NE(nullptr, log2);
+	RBJournal* journal = RBjournal_open(&tree, fileno(log), serialize, 100);
+	ASSERT_NE(nullptr, journal);
+	run(journal, NB / 2);
+	ASSERT_EQ(0, RBjournal_checkpoint(journal, fileno(snap), fileno(log2)));
+	states.clear();
+	run(journal, NB / 2);
+	ASSERT_EQ(0, RBjournal_close(journal));
+	lseek(fileno(snap), 0, SEEK_SET);
+	lseek(fileno(log2), 0, SEEK_SET);
+	ASSERT_EQ(0, RBload(&replayed, fileno(snap), deserialize, dele));
+	EXPECT_EQ(states.front(), content(&replayed));
+	EXPECT_EQ((long)states.size() - 1,
+		RBjournal_replay(&replayed, fileno(log2), deserialize, dele));
+	EXPECT_EQ(states.back(), content(&replayed));
+	fclose(snap);
+	fclose(log2);
+}
+
+TEST_F(TestJournal, BadLog) {
+	ASSERT_NE(nullptr, log);
+	fputs("RBTS", log);
+	fflush(log);
+	lseek(fileno(log), 0, SEEK_SET);
+	EXPECT_EQ(-1, RBjournal_replay(&replayed, fileno(log), deserialize, dele));
+}
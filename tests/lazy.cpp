@@ -0,0 +1,151 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <map>
+#include <random>
+#include <vector>
+
+namespace {
+	struct Item {
+		int key;
+		int val;
+	};
+
+	int compare(const void* a, const void* b) {
+		return ((const Item*)a)->key - ((const Item*)b)->key;
+	}
+
+	int released;
+
+	void dele(const void* data) {
+		released += 1;
+		delete (const Item*)data;
+	}
+
+	std::vector<int> keys(RBTree* tree) {
+		std::vector<int> v;
+		RBIter* iter = RBfirst(tree);
+		for (Item* item; (item = (Item*)RBnext(iter)) != nullptr;) {
+			v.push_back(item->key);
+		}
+		RBiter_release(iter);
+		return v;
+	}
+
+	std::vector<int> keys(const std::map<int, int>& m) {
+		std::vector<int> v;
+		for (auto& kv : m) v.push_back(kv.first);
+		return v;
+	}
+}
+
+class TestLazy : public ::testing::Test {
+protected:
+	RBTree tree;
+	std::map<int, int> content;
+
+	TestLazy() {
+		RBinit(&tree, compare);
+		released = 0;
+	}
+
+	~TestLazy() {
+		RBdestroy(&tree, dele);
+	}
+
+	void insert(int key, int val) {
+		Item* old = (Item*)RBinsert(&tree, new Item{ key, val }, nullptr);
+		if (old) dele(old);
+		content[key] = val;
+	}
+};
+
+TEST_F(TestLazy, Skip) {
+	for (int i = 1; i <= 10; i++) insert(i, i);
+	Item k{ 5, 0 };
+	EXPECT_EQ(1, RBremove_lazy(&tree, &k));
+	EXPECT_EQ(0, RBremove_lazy(&tree, &k));
+	content.erase(5);
+	EXPECT_EQ(9, tree.count);
+	EXPECT_EQ(1, tree.dead);
+	EXPECT_EQ(0, RBvalidate(&tree));
+	EXPECT_EQ(nullptr, RBfind(&tree, &k));
+	EXPECT_EQ(nullptr, RBremove(&tree, &k));
+	EXPECT_EQ(keys(content), keys(&tree));
+	// a search on a tombstone gives the next element
+	RBIter* iter = RBsearch(&tree, &k);
+	EXPECT_EQ(6, ((Item*)RBnext(iter))->key);
+	RBiter_release(iter);
+	Item k4{ 4, 0 };
+	EXPECT_EQ(1, RBremove_lazy(&tree, &k4));
+	iter = RBsearch(&tree, &k4);
+	EXPECT_EQ(6, ((Item*)RBnext(iter))->key);
+	RBiter_release(iter);
+	int nb = 0;
+	RBforeach(&tree, [](void*, void* ctx) { return ++*(int*)ctx, 0; }, &nb);
+	EXPECT_EQ(8, nb);
+}
+
+TEST_F(TestLazy, Revive) {
+	for (int i = 1; i <= 10; i++) insert(i, i);
+	Item k{ 3, 0 };
+	EXPECT_EQ(1, RBremove_lazy(&tree, &k));
+	Item* old = (Item*)RBinsert(&tree, new Item{ 3, 33 }, nullptr);
+	ASSERT_NE(nullptr, old);
+	EXPECT_EQ(3, old->val);
+	dele(old);
+	EXPECT_EQ(10, tree.count);
+	EXPECT_EQ(0, tree.dead);
+	EXPECT_EQ(33, ((Item*)RBfind(&tree, &k))->val);
+	EXPECT_EQ(0, RBvalidate(&tree));
+}
+
+TEST_F(TestLazy, Purge) {
+	std::mt19937 rg(0);
+	for (int i = 0; i < 20000; i++) {
+		int key = rg() % 2000;
+		Item k{ key, 0 };
+		switch (rg() % 4) {
+		case 0:
+			EXPECT_EQ((int)content.erase(key), RBremove_lazy(&tree, &k));
+			break;
+		case 1: {
+			Item* old = (Item*)RBremove(&tree, &k);
+			EXPECT_EQ(content.erase(key) > 0, old != nullptr);
+			if (old) dele(old);
+			break;
+		}
+		default:
+			insert(key, i);
+		}
+		ASSERT_EQ(content.size(), tree.count);
+		// purge once tombstones are a quarter of the nodes
+		if (4 * tree.dead > tree.count + tree.dead) {
+			unsigned dead = tree.dead;
+			int before = released;
+			ASSERT_EQ(0, RBpurge(&tree, dele));
+			EXPECT_EQ(dead, (unsigned)(released - before));
+			EXPECT_EQ(0, tree.dead);
+			ASSERT_EQ(0, RBvalidate(&tree));
+		}
+		if (i % 1000 == 0) {
+			ASSERT_EQ(0, RBvalidate(&tree));
+			EXPECT_EQ(keys(content), keys(&tree));
+		}
+	}
+	EXPECT_EQ(keys(content), keys(&tree));
+}
+
+TEST_F(TestLazy, PurgeAll) {
+	for (int i = 1; i <= 100; i++) insert(i, i);
+	for (int i = 1; i <= 100; i++) {
+		Item k{ i, 0 };
+		RBremove_lazy(&tree, &k);
+	}
+	EXPECT_TRUE(keys(&tree).empty());
+	EXPECT_EQ(0, tree.count);
+	ASSERT_EQ(0, RBpurge(&tree, dele));
+	EXPECT_EQ(100, released);
+	EXPECT_EQ(nullptr, tree.root);
+	EXPECT_EQ(0, tree.black_depth);
+	EXPECT_EQ(0, RBvalidate(&tree));
+}
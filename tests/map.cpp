@@ -0,0 +1,261 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <map>
+#include <random>
+#include <vector>
+
+namespace {
+	int compare(const void* a, const void* b) {
+		intptr_t x = (intptr_t)a, y = (intptr_t)b;
+		return (x > y) - (x < y);
+	}
+
+	uint64_t prefix(const void* a) {
+		return (uint64_t)(intptr_t)a;
+	}
+
+	size_t hash(const void* a) {
+		return (size_t)(intptr_t)a * 0x9E3779B97F4A7C15u;
+	}
+
+	// number of keys of a subtree
+	void combine(void* aug, const void*, const void* left,
+			const void* right, const void*) {
+		long n = 1;
+		if (left) n += *(const long*)left;
+		if (right) n += *(const long*)right;
+		*(long*)aug = n;
+	}
+
+	void* ptr(intptr_t n) {
+		return (void*)n;
+	}
+}
+
+class TestMap : public ::testing::TestWithParam<int> {
+protected:
+	RBTree tree;
+	std::map<intptr_t, intptr_t> content;
+
+	// the parameter tells which other options the map has
+	TestMap() {
+		RBinit(&tree, compare);
+		if (GetParam() & 1) RBprefix(&tree, prefix);
+		if (GetParam() & 2) RBaugment(&tree, 3, combine, nullptr);
+		if (GetParam() & 4) RBhash(&tree, hash);
+		EXPECT_EQ(0, RBmap(&tree));
+	}
+
+	~TestMap() {
+		RBdestroy(&tree, nullptr);
+	}
+
+	void check(RBTree* map) {
+		ASSERT_EQ(0, RBvalidate(map));
+		ASSERT_EQ(content.size(), map->count);
+		for (auto& kv : content) {
+			void** slot = RBfind_slot(map, ptr(kv.first));
+			ASSERT_NE(nullptr, slot) << kv.first;
+			ASSERT_EQ(ptr(kv.second), *slot) << kv.first;
+		}
+	}
+};
+
+TEST(Map, Invalid) {
+	RBTree tree;
+	RBinit(&tree, compare);
+	int err = 0;
+	EXPECT_EQ(nullptr, RBinsert_kv(&tree, ptr(1), ptr(2), nullptr, &err));
+	EXPECT_NE(0, err);
+	RBinsert(&tree, ptr(1), nullptr);
+	EXPECT_EQ(nullptr, RBfind_slot(&tree, ptr(1)));
+	EXPECT_EQ(-1, RBmap(&tree));
+	void* value = ptr(3);
+	EXPECT_EQ(nullptr, RBremove_kv(&tree, ptr(1), &value));
+	EXPECT_EQ(ptr(3), value);
+	RBdestroy(&tree, nullptr);
+	// a map cannot be intrusive and the other way round
+	EXPECT_EQ(0, RBmap(&tree));
+	EXPECT_EQ(-1, RBintrusive(&tree, 0));
+	RBinit(&tree, compare);
+	EXPECT_EQ(0, RBintrusive(&tree, 0));
+	EXPECT_EQ(-1, RBmap(&tree));
+}
+
+TEST_P(TestMap, Slots) {
+	int err = 1;
+	EXPECT_EQ(nullptr, RBfind_slot(&tree, ptr(1)));
+	EXPECT_EQ(nullptr, RBinsert_kv(&tree, ptr(1), ptr(10), nullptr, &err));
+	EXPECT_EQ(0, err);
+	EXPECT_EQ(ptr(10), RBinsert_kv(&tree, ptr(1), ptr(11), nullptr, &err));
+	void** slot = RBfind_slot(&tree, ptr(1));
+	ASSERT_NE(nullptr, slot);
+	EXPECT_EQ(ptr(11), *slot);
+	*slot = ptr(12);
+	EXPECT_EQ(ptr(12), *RBfind_slot(&tree, ptr(1)));
+	EXPECT_EQ(nullptr, RBfind_slot(&tree, ptr(2)));
+	// a plain insertion gives no value
+	RBinsert(&tree, ptr(2), nullptr);
+	EXPECT_EQ(nullptr, *RBfind_slot(&tree, ptr(2)));
+	EXPECT_EQ(ptr(1), RBfind(&tree, ptr(1)));
+}
+
+TEST_P(TestMap, Keys) {
+	void* old = ptr(1);
+	EXPECT_EQ(nullptr, RBinsert_kv(&tree, ptr(5), ptr(10), &old, nullptr));
+	EXPECT_EQ(nullptr, old);
+	// the replaced key is given back to be released
+	EXPECT_EQ(ptr(10), RBinsert_kv(&tree, ptr(5), ptr(11), &old, nullptr));
+	EXPECT_EQ(ptr(5), old);
+	void* value = nullptr;
+	EXPECT_EQ(nullptr, RBremove_kv(&tree, ptr(6), &value));
+	EXPECT_EQ(nullptr, value);
+	EXPECT_EQ(ptr(5), RBremove_kv(&tree, ptr(5), &value));
+	EXPECT_EQ(ptr(11), value);
+	EXPECT_EQ(0u, tree.count);
+}
+
+TEST_P(TestMap, Lazy) {
+	if (GetParam() & 2) GTEST_SKIP() << "no lazy removal in augmented trees";
+	RBinsert_kv(&tree, ptr(1), ptr(10), nullptr, nullptr);
+	EXPECT_EQ(1, RBremove_lazy(&tree, ptr(1)));
+	EXPECT_EQ(nullptr, RBfind_slot(&tree, ptr(1)));
+	// the value of the tombstone is given back
+	EXPECT_EQ(ptr(10), RBinsert_kv(&tree, ptr(1), ptr(11), nullptr, nullptr));
+	EXPECT_EQ(ptr(11), *RBfind_slot(&tree, ptr(1)));
+}
+
+TEST(Map, HashAfterMap) {
+	RBTree tree;
+	RBinit(&tree, compare);
+	ASSERT_EQ(0, RBmap(&tree));
+	ASSERT_EQ(0, RBhash(&tree, hash));
+	for (intptr_t k = 1; k <= 100; k++) {
+		RBinsert_kv(&tree, ptr(k), ptr(k + 1000), nullptr, nullptr);
+	}
+	RBremove(&tree, ptr(50));
+	EXPECT_EQ(nullptr, RBfind_slot(&tree, ptr(50)));
+	ASSERT_EQ(0, RBcompact(&tree));
+	for (intptr_t k = 1; k <= 100; k++) {
+		if (50 == k) continue;
+		void** slot = RBfind_slot(&tree, ptr(k));
+		ASSERT_NE(nullptr, slot) << k;
+		EXPECT_EQ(ptr(k + 1000), *slot) << k;
+	}
+	RBdestroy(&tree, nullptr);
+}
+
+TEST_P(TestMap, Churn) {
+	std::mt19937 rg(GetParam());
+	for (int i = 0; i < 5000; i++) {
+		intptr_t k = rg() % 500 + 1;
+		switch (rg() % 3) {
+		case 0: {
+			auto it = content.find(k);
+			void* old = RBinsert_kv(&tree, ptr(k), ptr(i + 1), nullptr,
+				nullptr);
+			ASSERT_EQ(it == content.end() ? nullptr : ptr(it->second), old);
+			content[k] = i + 1;
+			break;
+		}
+		case 1: {
+			void** slot = RBfind_slot(&tree, ptr(k));
+			ASSERT_EQ(content.count(k) > 0, slot != nullptr);
+			if (slot) {
+				*slot = ptr(i + 1);
+				content[k] = i + 1;
+			}
+			break;
+		}
+		default: {
+			auto it = content.find(k);
+			void* value = nullptr;
+			void* removed = RBremove_kv(&tree, ptr(k), &value);
+			ASSERT_EQ(it == content.end() ? nullptr : ptr(k), removed);
+			if (it != content.end()) {
+				ASSERT_EQ(ptr(it->second), value);
+				content.erase(it);
+			}
+		}
+		}
+	}
+	check(&tree);
+	RBTree* clone = RBclone(&tree, nullptr);
+	ASSERT_NE(nullptr, clone);
+	check(clone);
+	RBdestroy(clone, nullptr);
+	free(clone);
+	ASSERT_EQ(0, RBcompact(&tree));
+	check(&tree);
+}
+
+namespace {
+	int visit(void* key, void** slot, void* ctx) {
+		auto* seen = (std::vector<std::pair<intptr_t, intptr_t>>*)ctx;
+		seen->emplace_back((intptr_t)key, (intptr_t)*slot);
+		// the values can be replaced during the walk
+		*slot = ptr((intptr_t)*slot + 1);
+		return 0;
+	}
+}
+
+TEST_P(TestMap, Build) {
+	std::vector<void*> keys, values;
+	for (intptr_t k = 1; k <= 1000; k++) {
+		keys.push_back(ptr(3 * k));
+		values.push_back(ptr(k));
+		content[3 * k] = k;
+	}
+	ASSERT_EQ(0, RBbuild(&tree, keys.data(), values.data(), keys.size()));
+	check(&tree);
+	// only an empty tree can be built
+	EXPECT_EQ(-1, RBbuild(&tree, keys.data(), nullptr, 1));
+	int err = 1;
+	RBinsert_kv(&tree, ptr(4), ptr(5), nullptr, &err);
+	EXPECT_EQ(0, err);
+	content[4] = 5;
+	check(&tree);
+	std::vector<std::pair<intptr_t, intptr_t>> seen;
+	ASSERT_EQ(0, RBforeach_kv(&tree, visit, &seen));
+	std::vector<std::pair<intptr_t, intptr_t>> expected(content.begin(),
+		content.end());
+	EXPECT_EQ(expected, seen);
+	for (auto& kv : content) kv.second += 1;
+	check(&tree);
+}
+
+TEST(Map, BuildSet) {
+	RBTree tree;
+	RBinit(&tree, compare);
+	ASSERT_EQ(0, RBhash(&tree, hash));
+	std::vector<void*> keys;
+	for (intptr_t k = 1; k <= 5000; k++) keys.push_back(ptr(k));
+	ASSERT_EQ(0, RBbuild(&tree, keys.data(), nullptr, keys.size()));
+	EXPECT_EQ(0, RBvalidate(&tree));
+	// the nodes are in a single block and every key is in the hash index
+	RBMemory usage;
+	RBmemory_usage(&tree, &usage);
+	EXPECT_EQ(usage.nodes, usage.pooled);
+	for (void* key : keys) EXPECT_EQ(key, RBfind(&tree, key));
+	EXPECT_EQ(nullptr, RBfind(&tree, ptr(5001)));
+	// the slots of the removed nodes are reused
+	EXPECT_EQ(ptr(50), RBremove(&tree, ptr(50)));
+	EXPECT_EQ(nullptr, RBfind(&tree, ptr(50)));
+	int err = 1;
+	RBinsert(&tree, ptr(5001), &err);
+	EXPECT_EQ(0, err);
+	RBmemory_usage(&tree, &usage);
+	EXPECT_EQ(usage.nodes, usage.pooled);
+	EXPECT_EQ(ptr(5001), RBfind(&tree, ptr(5001)));
+	EXPECT_EQ(0, RBvalidate(&tree));
+	// a tree which is not a map gives no slot
+	void** slot = keys.data();
+	RBforeach_kv(&tree, [](void*, void** s, void* ctx) {
+		*(void***)ctx = s;
+		return 1;
+	}, &slot);
+	EXPECT_EQ(nullptr, slot);
+	RBdestroy(&tree, nullptr);
+}
+
+INSTANTIATE_TEST_SUITE_P(Options, TestMap, ::testing::Range(0, 8));
@@ -0,0 +1,197 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <map>
+#include <random>
+#include <vector>
+
+namespace {
+	struct Item {
+		int key;
+		int gen;	// the tree holding the item, 0 being the newest
+		bool removal;
+	};
+
+	long comparisons;
+
+	int compare(const void* a, const void* b) {
+		comparisons += 1;
+		int x = ((const Item*)a)->key, y = ((const Item*)b)->key;
+		return (x > y) - (x < y);
+	}
+
+	int compare_err(const void* a, const void* b, int* err) {
+		int x = ((const Item*)a)->key, y = ((const Item*)b)->key;
+		if (x < 0 || y < 0) *err = 1;
+		return (x > y) - (x < y);
+	}
+
+	// a removal hides the older items of its key
+	void* drop_removed(void* newer, void* older) {
+		(void)older;
+		return ((Item*)newer)->removal ? nullptr : newer;
+	}
+
+	void dele(const void* data) {
+		delete (const Item*)data;
+	}
+}
+
+class TestMerge : public ::testing::Test {
+protected:
+	std::vector<RBTree> trees;
+	std::vector<RBTree*> ptrs;
+
+	// builds k trees of n random keys from 0 to range - 1
+	void fill(size_t k, int n, int range) {
+		trees.resize(k);
+		std::mt19937 rg((unsigned)k);
+		for (size_t g = 0; g < k; g++) {
+			RBinit(&trees[g], compare);
+			for (int i = 0; i < n; i++) delete add(g, (int)(rg() % range));
+		}
+		for (auto& tree : trees) ptrs.push_back(&tree);
+	}
+
+	// gives back the item replaced
+	Item* add(size_t gen, int key, bool removal = false) {
+		return (Item*)RBinsert(&trees[gen], new Item{ key, (int)gen, removal },
+			nullptr);
+	}
+
+	// the newest item of every key
+	std::map<int, Item*> expected() {
+		std::map<int, Item*> newest;
+		for (size_t g = trees.size(); g-- > 0;) {
+			RBIter* iter = RBfirst(&trees[g]);
+			for (Item* item; (item = (Item*)RBnext(iter)) != nullptr;) {
+				newest[item->key] = item;
+			}
+			RBiter_release(iter);
+		}
+		return newest;
+	}
+
+	~TestMerge() {
+		for (auto& tree : trees) RBdestroy(&tree, dele);
+	}
+};
+
+TEST_F(TestMerge, Empty) {
+	RBMerge* merge = RBmerge_iter(nullptr, 0, nullptr);
+	ASSERT_NE(nullptr, merge);
+	EXPECT_EQ(nullptr, RBmerge_next(merge));
+	EXPECT_EQ(0, RBmerge_seek(merge, nullptr));
+	EXPECT_EQ(nullptr, RBmerge_next(merge));
+	RBmerge_release(merge);
+	fill(3, 0, 1);
+	merge = RBmerge_iter(ptrs.data(), ptrs.size(), nullptr);
+	EXPECT_EQ(nullptr, RBmerge_next(merge));
+	RBmerge_release(merge);
+}
+
+TEST_F(TestMerge, NewestWins) {
+	for (size_t k : { 1, 2, 3, 5, 8, 9 }) {
+		for (auto& tree : trees) RBdestroy(&tree, dele);
+		trees.clear();
+		ptrs.clear();
+		fill(k, 500, 2000);
+		auto newest = expected();
+		RBMerge* merge = RBmerge_iter(ptrs.data(), k, nullptr);
+		ASSERT_NE(nullptr, merge);
+		for (auto& kv : newest) {
+			ASSERT_EQ(kv.second, RBmerge_next(merge)) << k << " " << kv.first;
+		}
+		EXPECT_EQ(nullptr, RBmerge_next(merge));
+		RBmerge_release(merge);
+	}
+}
+
+TEST_F(TestMerge, Resolve) {
+	fill(3, 0, 1);
+	add(2, 1);
+	add(2, 2);
+	add(2, 3);
+	add(1, 2, true);
+	add(0, 3, true);
+	add(1, 3);
+	add(0, 4, true);
+	RBMerge* merge = RBmerge_iter(ptrs.data(), 3, drop_removed);
+	Item* item = (Item*)RBmerge_next(merge);
+	ASSERT_NE(nullptr, item);
+	EXPECT_EQ(1, item->key);
+	// a removal without an older item is returned
+	item = (Item*)RBmerge_next(merge);
+	ASSERT_NE(nullptr, item);
+	EXPECT_EQ(4, item->key);
+	EXPECT_TRUE(item->removal);
+	EXPECT_EQ(nullptr, RBmerge_next(merge));
+	RBmerge_release(merge);
+}
+
+TEST_F(TestMerge, Seek) {
+	fill(4, 300, 1000);
+	auto newest = expected();
+	RBMerge* merge = RBmerge_iter(ptrs.data(), 4, nullptr);
+	std::mt19937 rg(7);
+	for (int i = 0; i < 200; i++) {
+		Item key{ (int)(rg() % 1100), 0, false };
+		ASSERT_EQ(0, RBmerge_seek(merge, &key));
+		auto it = newest.lower_bound(key.key);
+		for (int j = 0; j < 5; j++, ++it) {
+			Item* expected = (it == newest.end()) ? nullptr : it->second;
+			ASSERT_EQ(expected, RBmerge_next(merge)) << key.key;
+			if (it == newest.end()) break;
+		}
+	}
+	RBmerge_release(merge);
+}
+
+TEST_F(TestMerge, Changes) {
+	fill(3, 200, 1000);
+	RBMerge* merge = RBmerge_iter(ptrs.data(), 3, nullptr);
+	std::mt19937 rg(3);
+	std::vector<Item*> removed;
+	int last = -1;
+	for (Item* item; (item = (Item*)RBmerge_next(merge)) != nullptr;) {
+		auto newest = expected();
+		// the newest item of the next key of the current content
+		auto it = newest.upper_bound(last);
+		ASSERT_NE(newest.end(), it);
+		ASSERT_EQ(it->second, item);
+		last = item->key;
+		// the active tree changes, the items going away being kept alive
+		Item* old = add(0, (int)(rg() % 1000));
+		if (old) removed.push_back(old);
+		Item key{ (int)(rg() % 1000), 0, false };
+		old = (Item*)RBremove(&trees[0], &key);
+		if (old) removed.push_back(old);
+	}
+	auto newest = expected();
+	EXPECT_EQ(newest.end(), newest.upper_bound(last));
+	RBmerge_release(merge);
+	for (Item* item : removed) delete item;
+}
+
+TEST_F(TestMerge, Comparisons) {
+	fill(16, 1000, 100000);
+	size_t n = expected().size();
+	comparisons = 0;
+	RBMerge* merge = RBmerge_iter(ptrs.data(), 16, nullptr);
+	size_t count = 0;
+	while (RBmerge_next(merge)) count++;
+	RBmerge_release(merge);
+	EXPECT_EQ(n, count);
+	// about log2(16) comparisons per element, plus the duplicate checks
+	EXPECT_LT(comparisons, (long)(16 * 1000 * 6));
+}
+
+TEST_F(TestMerge, Error) {
+	trees.resize(2);
+	for (auto& tree : trees) RBinit2(&tree, compare_err);
+	for (auto& tree : trees) ptrs.push_back(&tree);
+	add(0, -1);
+	add(1, 2);
+	RBMerge* merge = RBmerge_iter(ptrs.data(), 2, nullptr);
+	EXPECT_EQ(nullptr, RBmerge_next(merge));
+	RBmerge_release(merge);
+}
@@ -0,0 +1,188 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <map>
+#include <random>
+#include <vector>
+
+namespace {
+	struct Item {
+		int key;
+		int val;
+	};
+
+	int compare(const void* a, const void* b) {
+		return ((const Item*)a)->key - ((const Item*)b)->key;
+	}
+
+	void dele(const void* data) {
+		delete (const Item*)data;
+	}
+
+	std::vector<int> released;
+
+	void record(const void* data) {
+		released.push_back(((const Item*)data)->key);
+		delete (const Item*)data;
+	}
+
+	int collect(void* data, void* ctx) {
+		((std::vector<int>*)ctx)->push_back(((Item*)data)->key);
+		return 0;
+	}
+}
+
+class TestPool : public ::testing::TestWithParam<int> {
+protected:
+	RBTree tree;
+	std::map<int, int> content;
+
+	TestPool() {
+		RBinit(&tree, compare);
+	}
+
+	~TestPool() {
+		RBdestroy(&tree, dele);
+	}
+
+	void churn(int n, std::mt19937& rg) {
+		for (int i = 0; i < n; i++) {
+			int key = rg() % 20000;
+			Item k{ key, 0 };
+			if (rg() % 3) {
+				Item* old = (Item*)RBinsert(&tree, new Item{ key, i }, nullptr);
+				if (old) dele(old);
+				content[key] = i;
+			}
+			else {
+				Item* old = (Item*)RBremove(&tree, &k);
+				ASSERT_EQ(content.erase(key) > 0, old != nullptr);
+				if (old) dele(old);
+			}
+		}
+	}
+
+	void check(RBTree* t) {
+		ASSERT_EQ(0, RBvalidate(t));
+		std::vector<int> v, expected;
+		RBforeach(t, collect, &v);
+		for (auto& kv : content) expected.push_back(kv.first);
+		ASSERT_EQ(expected, v);
+		for (auto& kv : content) {
+			Item k{ kv.first, 0 };
+			Item* found = (Item*)RBfind(t, &k);
+			ASSERT_NE(nullptr, found);
+			ASSERT_EQ(kv.second, found->val);
+		}
+	}
+};
+
+TEST(Pool, Invalid) {
+	RBTree tree;
+	RBinit(&tree, compare);
+	EXPECT_EQ(-1, RBpool(&tree, 8, 0));
+	EXPECT_EQ(-1, RBpool(&tree, RB_POOL_BIND | RB_POOL_INTERLEAVE, 1));
+	EXPECT_EQ(-1, RBpool(&tree, RB_POOL_BIND, 0));
+	Item item{ 1, 1 };
+	RBinsert(&tree, &item, nullptr);
+	EXPECT_EQ(-1, RBpool(&tree, 0, 0));
+	RBdestroy(&tree, nullptr);
+	EXPECT_EQ(0, RBpool(&tree, 0, 0));
+	EXPECT_EQ(0, RBpool(&tree, RB_POOL_HUGE, 0));
+	RBdestroy(&tree, nullptr);
+}
+
+TEST_P(TestPool, Churn) {
+	ASSERT_EQ(0, RBpool(&tree, GetParam(), 1));
+	std::mt19937 rg(0);
+	for (int round = 0; round < 3; round++) {
+		churn(40000, rg);
+		check(&tree);
+		RBMemory usage;
+		RBmemory_usage(&tree, &usage);
+		EXPECT_EQ(tree.count * usage.node_size, usage.nodes);
+		EXPECT_EQ(usage.nodes, usage.pooled);
+		EXPECT_GT(usage.overhead, 0u);
+	}
+}
+
+TEST_P(TestPool, Compact) {
+	ASSERT_EQ(0, RBpool(&tree, GetParam(), 1));
+	std::mt19937 rg(1);
+	churn(30000, rg);
+	ASSERT_EQ(0, RBcompact(&tree));
+	check(&tree);
+	// the new arena keeps serving insertions
+	churn(10000, rg);
+	check(&tree);
+	RBMemory usage;
+	RBmemory_usage(&tree, &usage);
+	EXPECT_EQ(usage.nodes, usage.pooled);
+}
+
+TEST_P(TestPool, Clone) {
+	ASSERT_EQ(0, RBpool(&tree, GetParam(), 1));
+	std::mt19937 rg(2);
+	churn(5000, rg);
+	RBTree* copy = RBclone(&tree, nullptr);
+	ASSERT_NE(nullptr, copy);
+	ASSERT_NE(nullptr, copy->pool);
+	EXPECT_NE(tree.pool, copy->pool);
+	check(copy);
+	RBdestroy(copy, nullptr);
+	free(copy);
+	check(&tree);
+}
+
+TEST_P(TestPool, Destroy) {
+	ASSERT_EQ(0, RBpool(&tree, GetParam(), 1));
+	std::mt19937 rg(3);
+	churn(5000, rg);
+	std::vector<int> expected;
+	for (auto& kv : content) expected.push_back(kv.first);
+	// the elements are released in key order with the arena
+	released.clear();
+	RBdestroy(&tree, record);
+	EXPECT_EQ(expected, released);
+	EXPECT_EQ(nullptr, tree.root);
+	EXPECT_EQ(nullptr, tree.pool);
+	content.clear();
+	// without dele, the elements stay with the caller
+	std::vector<Item> items(1000);
+	ASSERT_EQ(0, RBpool(&tree, GetParam(), 1));
+	for (int i = 0; i < 1000; i++) {
+		items[i].key = i;
+		RBinsert(&tree, &items[i], nullptr);
+	}
+	RBdestroy(&tree, nullptr);
+	EXPECT_EQ(0u, tree.count);
+	EXPECT_EQ(nullptr, tree.pool);
+	EXPECT_EQ(999, items[999].key);
+}
+
+TEST(Pool, DestroyCompact) {
+	for (int extra = 0; extra < 2; extra++) {
+		RBTree tree;
+		RBinit(&tree, compare);
+		std::vector<int> expected;
+		for (int i = 0; i < 2000; i++) {
+			RBinsert(&tree, new Item{ i * 7919 % 2000, i }, nullptr);
+			expected.push_back(i);
+		}
+		Item k{ 10, 0 };
+		dele(RBremove(&tree, &k));
+		expected.erase(expected.begin() + 10);
+		ASSERT_EQ(0, RBcompact(&tree));
+		// a node out of the block of RBcompact needs a visit of all nodes
+		if (extra) {
+			RBinsert(&tree, new Item{ 10, 0 }, nullptr);
+			expected.insert(expected.begin() + 10, 10);
+		}
+		released.clear();
+		RBdestroy(&tree, record);
+		EXPECT_EQ(expected, released);
+		EXPECT_EQ(nullptr, tree.pool);
+	}
+}
+
+INSTANTIATE_TEST_SUITE_P(Flags, TestPool, ::testing::Values(0, RB_POOL_HUGE,
+	RB_POOL_INTERLEAVE, RB_POOL_HUGE | RB_POOL_BIND));
@@ -0,0 +1,124 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <cstring>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace {
+	int calls;
+
+	int compare(const void* a, const void* b) {
+		calls += 1;
+		return strcmp((const char*)a, (const char*)b);
+	}
+
+	uint64_t prefix(const void* a) {
+		return RBprefix_string((const char*)a);
+	}
+
+	std::string random_string(std::mt19937& rg, const char* start) {
+		std::string s = start;
+		int n = rg() % 12;
+		for (int i = 0; i < n; i++) s += (char)('a' + rg() % 4);
+		return s;
+	}
+
+	int collect(void* data, void* ctx) {
+		((std::vector<std::string>*)ctx)->push_back((const char*)data);
+		return 0;
+	}
+}
+
+TEST(TestPrefix, String) {
+	EXPECT_EQ(0u, RBprefix_string(""));
+	EXPECT_EQ(0x6162000000000000u, RBprefix_string("ab"));
+	EXPECT_EQ(0x6162636465666768u, RBprefix_string("abcdefghij"));
+	EXPECT_EQ(0xff00000000000000u, RBprefix_string("\xff"));
+	std::mt19937 rg(0);
+	for (int i = 0; i < 10000; i++) {
+		std::string a = random_string(rg, ""), b = random_string(rg, "");
+		uint64_t pa = RBprefix_string(a.c_str()), pb = RBprefix_string(b.c_str());
+		if (pa < pb) EXPECT_LT(strcmp(a.c_str(), b.c_str()), 0);
+		else if (pa > pb) EXPECT_GT(strcmp(a.c_str(), b.c_str()), 0);
+	}
+}
+
+TEST(TestPrefix, Refused) {
+	RBTree tree;
+	RBinit(&tree, compare);
+	ASSERT_EQ(0, RBintrusive(&tree, 0));
+	EXPECT_EQ(-1, RBprefix(&tree, prefix));
+	RBinit(&tree, compare);
+	char key[] = "a";
+	RBinsert(&tree, key, nullptr);
+	EXPECT_EQ(-1, RBprefix(&tree, prefix));
+	RBdestroy(&tree, nullptr);
+}
+
+class TestPrefixTree : public ::testing::TestWithParam<bool> {
+protected:
+	RBTree tree;
+	std::set<std::string> content;
+	std::vector<std::string> strings;
+
+	TestPrefixTree() {
+		RBinit(&tree, compare);
+		if (GetParam()) EXPECT_EQ(0, RBaugment(&tree, 1,
+			[](void* aug, const void*, const void*, const void*, const void*) {
+				*(char*)aug = 0;
+			}, nullptr));
+		EXPECT_EQ(0, RBprefix(&tree, prefix));
+		std::mt19937 rg(0);
+		const char* starts[] = { "", "a", "/usr/", "/usr/local/", "/usr/lib" };
+		for (int i = 0; i < 2000; i++) {
+			strings.push_back(random_string(rg, starts[rg() % 5]));
+		}
+	}
+
+	~TestPrefixTree() {
+		RBdestroy(&tree, nullptr);
+	}
+};
+
+TEST_P(TestPrefixTree, Random) {
+	std::mt19937 rg(1);
+	for (int i = 0; i < 20000; i++) {
+		std::string& s = strings[rg() % strings.size()];
+		void* key = (void*)s.c_str();
+		if (rg() % 3) {
+			RBinsert(&tree, key, nullptr);
+			content.insert(s);
+		}
+		else {
+			EXPECT_EQ(content.erase(s) > 0, nullptr != RBremove(&tree, key));
+		}
+		if (i % 1000 == 0) ASSERT_EQ(0, RBvalidate(&tree));
+	}
+	std::vector<std::string> v;
+	RBforeach(&tree, collect, &v);
+	EXPECT_EQ(std::vector<std::string>(content.begin(), content.end()), v);
+	for (auto& s : strings) {
+		void* found = RBfind(&tree, (void*)s.c_str());
+		EXPECT_EQ(content.count(s) > 0, nullptr != found);
+	}
+}
+
+TEST_P(TestPrefixTree, FewerCalls) {
+	RBTree plain;
+	RBinit(&plain, compare);
+	for (auto& s : strings) {
+		RBinsert(&tree, (void*)s.c_str(), nullptr);
+		RBinsert(&plain, (void*)s.c_str(), nullptr);
+	}
+	calls = 0;
+	for (auto& s : strings) RBfind(&plain, (void*)s.c_str());
+	int plain_calls = calls;
+	calls = 0;
+	for (auto& s : strings) RBfind(&tree, (void*)s.c_str());
+	EXPECT_LT(2 * calls, plain_calls);
+	RBdestroy(&plain, nullptr);
+}
+
+INSTANTIATE_TEST_SUITE_P(Augmented, TestPrefixTree, ::testing::Bool());
@@ -0,0 +1,175 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <map>
+#include <random>
+#include <vector>
+
+namespace {
+	struct Item {
+		int key;
+		int tenant;
+	};
+
+	long comparisons;
+
+	int compare(const void* a, const void* b) {
+		comparisons += 1;
+		return ((const Item*)a)->key - ((const Item*)b)->key;
+	}
+
+	size_t hash(const void* a) {
+		return (size_t)((const Item*)a)->key * 0x9E3779B97F4A7C15u;
+	}
+
+	int released;
+
+	void dele(const void* data) {
+		released += 1;
+		delete (const Item*)data;
+	}
+
+	int of_tenant(void* data, void* ctx) {
+		return ((Item*)data)->tenant == *(int*)ctx;
+	}
+
+	void combine(void* aug, const void* data, const void* left,
+			const void* right, const void*) {
+		long n = 1;
+		if (left) n += *(const long*)left;
+		if (right) n += *(const long*)right;
+		*(long*)aug = n;
+		(void)data;
+	}
+
+	std::vector<int> keys(RBTree* tree) {
+		std::vector<int> v;
+		RBIter* iter = RBfirst(tree);
+		for (Item* item; (item = (Item*)RBnext(iter)) != nullptr;) {
+			v.push_back(item->key);
+		}
+		RBiter_release(iter);
+		return v;
+	}
+}
+
+class TestRemoveIf : public ::testing::Test {
+protected:
+	RBTree tree;
+	std::map<int, int> content;
+	long compared;	// comparisons of the last RBremove_if
+
+	TestRemoveIf() {
+		RBinit(&tree, compare);
+		released = 0;
+	}
+
+	~TestRemoveIf() {
+		RBdestroy(&tree, dele);
+	}
+
+	// inserts n keys, one every tenants belonging to tenant 0
+	void fill(int n, int tenants) {
+		for (int i = 0; i < n; i++) {
+			RBinsert(&tree, new Item{ i, i % tenants }, nullptr);
+			content[i] = i % tenants;
+		}
+	}
+
+	// removes a tenant and checks what is left
+	void purge(int tenant) {
+		size_t expected = 0;
+		for (auto it = content.begin(); it != content.end();) {
+			if (it->second == tenant) {
+				it = content.erase(it);
+				expected += 1;
+			}
+			else ++it;
+		}
+		released = 0;
+		comparisons = 0;
+		ASSERT_EQ((long)expected, RBremove_if(&tree, of_tenant, &tenant, dele));
+		compared = comparisons;
+		EXPECT_EQ((int)expected, released);
+		ASSERT_EQ(0, RBvalidate(&tree));
+		EXPECT_EQ(content.size(), tree.count);
+		std::vector<int> v;
+		for (auto& kv : content) v.push_back(kv.first);
+		EXPECT_EQ(v, keys(&tree));
+	}
+};
+
+TEST_F(TestRemoveIf, Empty) {
+	int tenant = 0;
+	EXPECT_EQ(0, RBremove_if(&tree, of_tenant, &tenant, dele));
+	fill(10, 3);
+	tenant = 5;
+	EXPECT_EQ(0, RBremove_if(&tree, of_tenant, &tenant, dele));
+	EXPECT_EQ(10u, tree.count);
+}
+
+TEST_F(TestRemoveIf, Many) {
+	fill(10000, 3);
+	purge(1);
+	// the survivors are relinked without any comparison
+	EXPECT_EQ(0, compared);
+	purge(0);
+	purge(2);
+	EXPECT_EQ(nullptr, tree.root);
+}
+
+TEST_F(TestRemoveIf, Few) {
+	fill(10000, 1000);
+	purge(7);
+	// the few elements are removed one by one
+	EXPECT_GT(compared, 0);
+	EXPECT_LT(compared, 1000);
+}
+
+TEST_F(TestRemoveIf, Indexes) {
+	ASSERT_EQ(0, RBhash(&tree, hash));
+	fill(1000, 2);
+	purge(0);
+	for (int i = 0; i < 1000; i++) {
+		Item k{ i, 0 };
+		EXPECT_EQ(i % 2 != 0, RBfind(&tree, &k) != nullptr) << i;
+	}
+}
+
+TEST_F(TestRemoveIf, Augmented) {
+	ASSERT_EQ(0, RBaugment(&tree, sizeof(long), combine, nullptr));
+	fill(1000, 4);
+	purge(3);
+	Item lo{ -1, 0 }, hi{ 1000, 0 };
+	long n = 0;
+	ASSERT_EQ(0, RBaggregate_range(&tree, &lo, &hi, &n));
+	EXPECT_EQ((long)content.size(), n);
+}
+
+TEST_F(TestRemoveIf, Tombstones) {
+	fill(100, 2);
+	Item k{ 10, 0 };
+	ASSERT_EQ(1, RBremove_lazy(&tree, &k));
+	content.erase(10);
+	purge(0);
+	// the tombstone is left to RBpurge
+	EXPECT_EQ(1u, tree.dead);
+	EXPECT_EQ(0, RBpurge(&tree, dele));
+}
+
+TEST_F(TestRemoveIf, Balance) {
+	for (int policy : { RB_BALANCE_AVL, RB_BALANCE_WAVL }) {
+		RBdestroy(&tree, dele);
+		content.clear();
+		ASSERT_EQ(0, RBbalance(&tree, policy));
+		std::mt19937 rg(policy);
+		for (int i = 0; i < 3000; i++) {
+			int key = (int)(rg() % 10000);
+			int tenant = (int)(rg() % 50);
+			Item* old = (Item*)RBinsert(&tree, new Item{ key, tenant }, nullptr);
+			if (old) delete old;
+			content[key] = tenant;
+		}
+		purge(3);
+		for (int t = 10; t < 50; t++) purge(t);
+	}
+}
@@ -0,0 +1,241 @@
+#include "gtest/gtest.h"
+#include "rbtree.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#define lseek _lseek
+#define read _read
+#define write _write
+#else
+#include <unistd.h>
+#endif
+
+class TestSerial : public ::testing::Test {
+protected:
+	static constexpr int SIZE = 1000;
+	RBTree tree;
+	RBTree loaded;
+	FILE* file;
+
+	TestSerial() {
+		RBinit(&tree, compare);
+		RBinit(&loaded, compare);
+		file = tmpfile();
+	}
+
+	void SetUp() override {
+		ASSERT_NE(nullptr, file);
+		for (int i = 0; i < SIZE; i++) {
+			RBinsert(&tree, strdup(key(i).c_str()), nullptr);
+		}
+	}
+
+	~TestSerial() {
+		RBdestroy(&tree, dele);
+		RBdestroy(&loaded, dele);
+		if (file) fclose(file);
+	}
+
+	// keys of various sizes which are not in numeric order
+	static std::string key(int i) {
+		return "key" + std::string(i % 17, 'x') + std::to_string(i * 7919 % SIZE);
+	}
+
+	static int compare(const void* a, const void* b) {
+		return strcmp((const char*)a, (const char*)b);
+	}
+
+	static void dele(const void* data) {
+		free((void*)data);
+	}
+
+	static size_t serialize(const void* data, void* buf, size_t size) {
+		size_t len = strlen((const char*)data);
+		if (len <= size) memcpy(buf, data, len);
+		return len;
+	}
+
+	static void* deserialize(const void* buf, size_t size) {
+		char* data = (char*)malloc(size + 1);
+		memcpy(data, buf, size);
+		data[size] = 0;
+		return data;
+	}
+
+	static int image_comp(const void* key, const void* rec, size_t size) {
+		size_t len = strlen((const char*)key);
+		int cr = memcmp(key, rec, len < size ? len : size);
+		if (cr) return cr;
+		return (len > size) - (len < size);
+	}
+
+	std::vector<uint64_t> image() {
+		int fd = fileno(file);
+		long size = lseek(fd, 0, SEEK_END);
+		std::vector<uint64_t> buf((size + 7) / 8);
+		lseek(fd, 0, SEEK_SET);
+		EXPECT_EQ(size, read(fd, buf.data(), size));
+		buf.resize(size / 8);
+		return buf;
+	}
+};
+
+TEST_F(TestSerial, SaveLoad) {
+	ASSERT_EQ(0, RBsave(&tree, fileno(file), serialize));
+	lseek(fileno(file), 0, SEEK_SET);
+	ASSERT_EQ(0, RBload(&loaded, fileno(file), deserialize, dele));
+	EXPECT_EQ(0, RBvalidate(&loaded));
+	EXPECT_EQ(tree.count, loaded.count);
+	RBIter* it1 = RBfirst(&tree);
+	RBIter* it2 = RBfirst(&loaded);
+	for (int i = 0; i < SIZE; i++) {
+		EXPECT_STREQ((const char*)RBnext(it1), (const char*)RBnext(it2));
+	}
+	EXPECT_EQ(nullptr, RBnext(it2));
+	RBiter_release(it1);
+	RBiter_release(it2);
+}
+
+TEST_F(TestSerial, Empty) {
+	RBdestroy(&tree, dele);
+	ASSERT_EQ(0, RBsave(&tree, fileno(file), serialize));
+	lseek(fileno(file), 0, SEEK_SET);
+	ASSERT_EQ(0, RBload(&loaded, fileno(file), deserialize, dele));
+	EXPECT_EQ(0, loaded.count);
+	EXPECT_EQ(0, RBvalidate(&loaded));
+}
+
+namespace {
+	int released;
+
+	void count_dele(const void* data) {
+		released += 1;
+		free((void*)data);
+	}
+
+	// a comparison under which all the keys are equal
+	int same(const void*, const void*) {
+		return 0;
+	}
+}
+
+TEST_F(TestSerial, Duplicates) {
+	ASSERT_EQ(0, RBsave(&tree, fileno(file), serialize));
+	lseek(fileno(file), 0, SEEK_SET);
+	RBTree coarse;
+	RBinit(&coarse, same);
+	released = 0;
+	ASSERT_EQ(0, RBload(&coarse, fileno(file), deserialize, count_dele));
+	EXPECT_EQ(1u, coarse.count);
+	// the replaced elements are released instead of leaking
+	EXPECT_EQ(SIZE - 1, released);
+	RBdestroy(&coarse, dele);
+}
+
+TEST_F(TestSerial, BadFile) {
+	fputs("not a tree at all", file);
+	fflush(file);
+	lseek(fileno(file), 0, SEEK_SET);
+	EXPECT_EQ(-1, RBload(&loaded, fileno(file), deserialize, dele));
+	EXPECT_EQ(nullptr, loaded.root);
+}
+
+TEST_F(TestSerial, Image) {
+	ASSERT_EQ(0, RBsave(&tree, fileno(file), serialize));
+	std::vector<uint64_t> buf = image();
+	RBImage img;
+	ASSERT_EQ(0, RBimage_open(&img, buf.data(), buf.size() * 8));
+	EXPECT_EQ(SIZE, img.count);
+	for (int i = 0; i < SIZE; i++) {
+		std::string k = key(i);
+		size_t size;
+		const void* rec = RBimage_find(&img, k.c_str(), image_comp, &size);
+		ASSERT_NE(nullptr, rec);
+		EXPECT_EQ(k, std::string((const char*)rec, size));
+	}
+	EXPECT_EQ(nullptr, RBimage_find(&img, "kez", image_comp, nullptr));
+	EXPECT_EQ(SIZE, RBimage_search(&img, "kez", image_comp));
+	EXPECT_EQ(0, RBimage_search(&img, "", image_comp));
+	size_t size;
+	const void* first = RBimage_get(&img, 0, &size);
+	RBIter* iter = RBfirst(&tree);
+	EXPECT_EQ(std::string((const char*)RBnext(iter)),
+		std::string((const char*)first, size));
+	RBiter_release(iter);
+}
+
+TEST_F(TestSerial, BadImage) {
+	ASSERT_EQ(0, RBsave(&tree, fileno(file), serialize));
+	std::vector<uint64_t> buf = image();
+	RBImage img;
+	EXPECT_EQ(-1, RBimage_open(&img, buf.data(), buf.size() * 8 - 8));
+	buf[0] = 0;
+	EXPECT_EQ(-1, RBimage_open(&img, buf.data(), buf.size() * 8));
+}
+
+TEST_F(TestSerial, CorruptImage) {
+	ASSERT_EQ(0, RBsave(&tree, fileno(file), serialize));
+	std::vector<uint64_t> buf = image();
+	size_t table = buf.back() / 8;
+	RBImage img;
+	ASSERT_EQ(0, RBimage_open(&img, buf.data(), buf.size() * 8));
+	// an offset past the table
+	uint64_t offset = buf[table + 7];
+	buf[table + 7] = buf.size() * 8;
+	EXPECT_EQ(-1, RBimage_open(&img, buf.data(), buf.size() * 8));
+	// a record longer than what remains of the image
+	buf[table + 7] = offset;
+	buf[offset / 8] = buf.size() * 8;
+	EXPECT_EQ(-1, RBimage_open(&img, buf.data(), buf.size() * 8));
+	// a count whose table size wraps around to the right one
+	buf[offset / 8] = 0;
+	buf[1] = ((uint64_t)1 << 61) + SIZE;
+	EXPECT_EQ(-1, RBimage_open(&img, buf.data(), buf.size() * 8));
+}
+
+TEST_F(TestSerial, CorruptLength) {
+	ASSERT_EQ(0, RBsave(&tree, fileno(file), serialize));
+	// a first record far longer than the file
+	uint64_t len = (uint64_t)1 << 42;
+	lseek(fileno(file), 16, SEEK_SET);
+	ASSERT_EQ(8, write(fileno(file), &len, sizeof(len)));
+	lseek(fileno(file), 0, SEEK_SET);
+	EXPECT_EQ(-1, RBload(&loaded, fileno(file), deserialize, dele));
+	EXPECT_EQ(nullptr, loaded.root);
+}
+
+#ifndef _WIN32
+TEST_F(TestSerial, CorruptLengthPipe) {
+	// the header of a single record which is cut short
+	int fds[2];
+	ASSERT_EQ(0, pipe(fds));
+	unsigned char header[24];
+	uint32_t bom = 0x01020304u;
+	uint64_t count = 1, len = (uint64_t)1 << 42;
+	memcpy(header, "RBTS", 4);
+	memcpy(header + 4, &bom, 4);
+	memcpy(header + 8, &count, 8);
+	memcpy(header + 16, &len, 8);
+	ASSERT_EQ(24, write(fds[1], header, sizeof(header)));
+	ASSERT_EQ(5, write(fds[1], "bytes", 5));
+	close(fds[1]);
+	EXPECT_EQ(-1, RBload(&loaded, fds[0], deserialize, dele));
+	EXPECT_EQ(nullptr, loaded.root);
+	close(fds[0]);
+}
+#endif
+
+TEST_F(TestSerial, CorruptCount) {
+	ASSERT_EQ(0, RBsave(&tree, fileno(file), serialize));
+	// far more records than the file can hold
+	uint64_t count = 0xFFFFFFF0u;
+	lseek(fileno(file), 8, SEEK_SET);
+	ASSERT_EQ(8, write(fileno(file), &count, sizeof(count)));
+	lseek(fileno(file), 0, SEEK_SET);
+	EXPECT_EQ(-1, RBload(&loaded, fileno(file), deserialize, dele));
+	EXPECT_EQ(nullptr, loaded.root);
+}
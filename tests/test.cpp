@@ -4,6 +4,7 @@
 #include <algorithm>
 #include <iostream>
 #include<sstream>
+#include <thread>
 
 
 namespace {
@@ -196,6 +197,112 @@ TEST_F(TestSearch, NotFound) {
 	RBiter_release(iter);
 }
 
+namespace {
+	int collect(void* data, void* ctx) {
+		static_cast<std::vector<int>*>(ctx)->push_back((int)(intptr_t)data);
+		return 0;
+	}
+
+	int stop_at_10(void* data, void* ctx) {
+		collect(data, ctx);
+		return (10 == (int)(intptr_t)data) ? 42 : 0;
+	}
+}
+
+TEST_F(TestSearch, Foreach) {
+	std::vector<int> seen;
+	EXPECT_EQ(0, RBforeach(&tree, collect, &seen));
+	EXPECT_EQ(std::vector<int>({ 2, 4, 6, 8, 10, 12, 14 }), seen);
+}
+
+TEST_F(TestSearch, ForeachStop) {
+	std::vector<int> seen;
+	EXPECT_EQ(42, RBforeach(&tree, stop_at_10, &seen));
+	EXPECT_EQ(std::vector<int>({ 2, 4, 6, 8, 10 }), seen);
+}
+
+TEST_F(TestSearch, ForeachRange) {
+	std::vector<int> seen;
+	EXPECT_EQ(0, RBforeach_range(&tree, (void*)(intptr_t)5,
+		(void*)(intptr_t)12, collect, &seen));
+	EXPECT_EQ(std::vector<int>({ 6, 8, 10 }), seen);
+	seen.clear();
+	EXPECT_EQ(0, RBforeach_range(&tree, (void*)(intptr_t)4, nullptr,
+		collect, &seen));
+	EXPECT_EQ(std::vector<int>({ 4, 6, 8, 10, 12, 14 }), seen);
+	seen.clear();
+	EXPECT_EQ(0, RBforeach_range(&tree, nullptr, (void*)(intptr_t)3,
+		collect, &seen));
+	EXPECT_EQ(std::vector<int>({ 2 }), seen);
+	seen.clear();
+	EXPECT_EQ(0, RBforeach_range(&tree, (void*)(intptr_t)15, nullptr,
+		collect, &seen));
+	EXPECT_TRUE(seen.empty());
+}
+
+TEST_F(TestIntTree, ForeachEmpty) {
+	std::vector<int> seen;
+	EXPECT_EQ(0, RBforeach(&tree, collect, &seen));
+	EXPECT_EQ(0, RBforeach_range(&tree, nullptr, nullptr, collect, &seen));
+	EXPECT_TRUE(seen.empty());
+}
+
+#ifdef RB_STATS
+TEST_F(TestIntTree, Stats) {
+	RBStats stats;
+	for (int i = 1; i <= 7; i++) {
+		RBinsert(&tree, (void*)(intptr_t)i, nullptr);
+	}
+	ASSERT_EQ(0, RBstats(&tree, &stats));
+	EXPECT_EQ(7, stats.allocs);
+	EXPECT_EQ(6, stats.searches);
+#ifndef RB_TOPDOWN
+	EXPECT_EQ(6, stats.iterators);
+#else
+	EXPECT_EQ(0, stats.iterators);
+#endif
+	EXPECT_LT(0, stats.rotations);
+	EXPECT_LT(0, stats.recolors);
+	EXPECT_LE(stats.searches, stats.comparisons);
+	ASSERT_EQ(0, RBstats(&tree, &stats));
+	EXPECT_EQ(0, stats.comparisons);
+	EXPECT_EQ((void*)(intptr_t)1, RBfind(&tree, (void*)(intptr_t)1));
+	EXPECT_EQ((void*)(intptr_t)4, RBremove(&tree, (void*)(intptr_t)4));
+	ASSERT_EQ(0, RBstats(&tree, &stats));
+	EXPECT_EQ(2, stats.searches);
+	EXPECT_EQ(1, stats.frees);
+	unsigned long long total = 0;
+	for (unsigned long long nb : stats.depths) total += nb;
+	EXPECT_EQ(2, total);
+	EXPECT_EQ(0, stats.depths[2 * tree.black_depth + 1]);
+}
+TEST_F(TestIntTree, StatsConcurrentReaders) {
+	for (int i = 1; i <= 100; i++) {
+		RBinsert(&tree, (void*)(intptr_t)i, nullptr);
+	}
+	RBStats stats;
+	ASSERT_EQ(0, RBstats(&tree, &stats));
+	// readers share the tree: none of their searches is lost
+	std::vector<std::thread> readers;
+	for (int t = 0; t < 4; t++) {
+		readers.emplace_back([this] {
+			for (int i = 1; i <= 1000; i++) {
+				RBfind(&tree, (void*)(intptr_t)(1 + i % 100));
+			}
+		});
+	}
+	for (std::thread& reader : readers) reader.join();
+	ASSERT_EQ(0, RBstats(&tree, &stats));
+	EXPECT_EQ(4000, stats.searches);
+}
+#else
+TEST_F(TestIntTree, NoStats) {
+	RBStats stats;
+	EXPECT_EQ(-1, RBstats(&tree, &stats));
+	EXPECT_EQ(0, stats.comparisons);
+}
+#endif // RB_STATS
+
 TEST(TestVersion, NotNull) {
 	const unsigned char* version = RBversion();
 	int null = 1;
@@ -256,4 +363,23 @@ TEST_F(TestClone, clone15) {
 	EXPECT_EQ(0, RBvalidate(copy));
 	RBdestroy(copy, nullptr);
 	free(copy);
-}
\ No newline at end of file
+}
+TEST_F(TestClone, cloneLarge) {
+	std::vector<int> arr(10000);
+	for (int i = 0; i < 10000; i++) arr[i] = i + 1;
+	std::shuffle(arr.begin(), arr.end(), std::mt19937(0));
+	for (int i : arr) {
+		RBinsert(&tree, (void*)(intptr_t)i, nullptr);
+	}
+	RBTree* copy = RBclone(&tree, process);
+	ASSERT_NE(nullptr, copy);
+	EXPECT_EQ(10000, count);
+	EXPECT_EQ(0, RBvalidate(copy));
+	RBIter* iter = RBfirst(copy);
+	for (int i = 1; i <= 10000; i++) {
+		ASSERT_EQ((void*)(intptr_t)i, RBnext(iter));
+	}
+	RBiter_release(iter);
+	RBdestroy(copy, nullptr);
+	free(copy);
+}